@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib> // exit
@@ -23,6 +25,8 @@ enum Flags
     Flag_NT   = (1 << 14),
     Flag_R    = (1 << 16),
     Flag_VM   = (1 << 17),
+    Flag_AC   = (1 << 18), // 486
+    Flag_ID   = (1 << 21), // 486 (CPUID supported if writable)
 };
 
 enum SegmentDescriptorFlags
@@ -38,6 +42,10 @@ enum SegmentDescriptorFlags
     SD_Granularity    =   1 << 15,
     SD_Size           =   1 << 14,
 
+    // not from the descriptor, cached by setSegmentReg
+    SD_FlatRead       =   1 << 1, // base 0, 4G limit, expand-up
+    SD_FlatWrite      =   1 << 0, // ... and a writable data segment
+
     // system descriptor types
     SD_SysTypeTSS16      =   1 << 16,
     SD_SysTypeLDT        =   2 << 16,
@@ -65,6 +73,29 @@ enum PageFlags
     Page_Dirty    = 1 << 6,
 };
 
+// rough 386 clock counts for virtual time, register forms and not-taken branches mostly
+// (prefixes are never looked up, 0F covers all the two-byte opcodes, REP string ops are charged per iteration)
+static const uint8_t opcodeCycles[256]
+{
+//  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+    2,  2,  2,  2,  2,  2,  2,  7,  2,  2,  2,  2,  2,  2,  2,  3, // 0x
+    2,  2,  2,  2,  2,  2,  2,  7,  2,  2,  2,  2,  2,  2,  2,  7, // 1x
+    2,  2,  2,  2,  2,  2,  0,  4,  2,  2,  2,  2,  2,  2,  0,  4, // 2x
+    2,  2,  2,  2,  2,  2,  0,  4,  2,  2,  2,  2,  2,  2,  0,  4, // 3x
+    2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2, // 4x
+    2,  2,  2,  2,  2,  2,  2,  2,  4,  4,  4,  4,  4,  4,  4,  4, // 5x
+   18, 24, 10, 20,  0,  0,  0,  0,  2, 20,  2, 20, 15, 15, 14, 14, // 6x
+    5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5, // 7x
+    2,  2,  2,  2,  2,  2,  3,  3,  2,  2,  2,  2,  2,  2,  4,  5, // 8x
+    3,  3,  3,  3,  3,  3,  3,  3,  3,  2, 17,  6,  4,  5,  3,  2, // 9x
+    4,  4,  4,  4,  7,  7, 10, 10,  2,  2,  4,  4,  5,  5,  7,  7, // Ax
+    2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2, // Bx
+    3,  3, 10, 10,  7,  7,  2,  2, 10,  4, 18, 18, 33, 37, 35, 22, // Cx
+    3,  3,  3,  3, 17, 19,  2,  5, 20, 20, 20, 20, 20, 20, 20, 20, // Dx
+   11, 11, 11,  9, 12, 12, 10, 10,  7,  7, 12,  7, 13, 13, 11, 11, // Ex
+    0,  2,  0,  0,  5,  2, 12, 12,  2,  2,  2,  2,  2,  2,  4,  4, // Fx
+};
+
 // opcode helpers
 
 static constexpr bool parity(uint8_t v)
@@ -85,92 +116,49 @@ template<> struct BiggerInt<int32_t> {using type = int64_t;};
 template<class T> using BiggerInt_t=typename BiggerInt<T>::type;
 
 template<class T>
-static T doAdd(T dest, T src, uint32_t &flags)
+static T doAdd(T dest, T src, CPUFlags &flags)
 {
     T res = dest + src;
-
-    bool overflow = ~(dest ^ src) & (src ^ res) & signBit<T>();
-    bool carry4 = (dest ^ src ^ res) & 0x10;
-
-    flags = (flags & ~(Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O))
-          | (res < dest ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
-
+    flags.setLazy(CPUFlags::Op::Add, dest, src, res);
     return res;
 }
 
 template<class T>
-static T doAddWithCarry(T dest, T src, uint32_t &flags)
+static T doAddWithCarry(T dest, T src, CPUFlags &flags)
 {
+    // carry in stays in the flags value until they are evaluated
     int c = flags & Flag_C ? 1 : 0;
     T res = dest + src + c;
-
-    bool carry = res < dest || (res == dest && c);
-    bool overflow = ~(dest ^ src) & (src ^ res) & signBit<T>();
-    bool carry4 = (dest ^ src ^ res) & 0x10;
-
-    flags = (flags & ~(Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O))
-          | (carry ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
-
+    flags.setLazy(CPUFlags::Op::AddWithCarry, dest, src, res);
     return res;
 }
 
 template<class T>
-static T doAnd(T dest, T src, uint32_t &flags)
+static T doAnd(T dest, T src, CPUFlags &flags)
 {
     T res = dest & src;
-
-    // c/o cleared
-    // szp set from res
-    flags = (flags & ~(Flag_C | Flag_P | Flag_Z | Flag_S | Flag_O))
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (parity(res) ? Flag_P : 0);
-
+    flags.setLazy(CPUFlags::Op::Logic, dest, src, res);
     return res;
 }
 
 template<class T>
-static T doDec(T dest, uint32_t &flags)
+static T doDec(T dest, CPUFlags &flags)
 {
     T res = dest - 1;
-
-    flags = (flags & ~(Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O))
-          | (parity(res) ? Flag_P : 0)
-          | ((res & 0xF) == 0xF ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (res == signBit<T>() - 1 ? Flag_O : 0);
-
+    flags.setLazy(CPUFlags::Op::Dec, dest, T(1), res);
     return res;
 }
 
 template<class T>
-static T doInc(T dest, uint32_t &flags)
+static T doInc(T dest, CPUFlags &flags)
 {
     T res = dest + 1;
-
-    flags = (flags & ~(Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O))
-          | (parity(res) ? Flag_P : 0)
-          | ((res & 0xF) == 0 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (res == signBit<T>() ? Flag_O : 0);
-
+    flags.setLazy(CPUFlags::Op::Inc, dest, T(1), res);
     return res;
 }
 
 template<class T>
-static T doMultiplySigned(T dest, T src, uint32_t &flags)
+static T doMultiplySigned(T dest, T src, CPUFlags &flags)
 {
     // use BiggerInt to only do 64-bit multiply if necessary
     auto res = static_cast<BiggerInt_t<T>>(dest) * src;
@@ -185,22 +173,15 @@ static T doMultiplySigned(T dest, T src, uint32_t &flags)
 }
 
 template<class T>
-static T doOr(T dest, T src, uint32_t &flags)
+static T doOr(T dest, T src, CPUFlags &flags)
 {
     T res = dest | src;
-
-    // c/o cleared
-    // szp set from res
-    flags = (flags & ~(Flag_C | Flag_P | Flag_Z | Flag_S | Flag_O))
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (parity(res) ? Flag_P : 0);
-
+    flags.setLazy(CPUFlags::Op::Logic, dest, src, res);
     return res;
 }
 
 template<class T>
-static T doRotateLeft(T dest, int count, uint32_t &flags)
+static T doRotateLeft(T dest, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -221,7 +202,7 @@ static T doRotateLeft(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doRotateLeftCarry(T dest, int count, uint32_t &flags)
+static T doRotateLeftCarry(T dest, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -262,7 +243,7 @@ static T doRotateLeftCarry(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doRotateRight(T dest, int count, uint32_t &flags)
+static T doRotateRight(T dest, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -283,7 +264,7 @@ static T doRotateRight(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doRotateRightCarry(T dest, int count, uint32_t &flags)
+static T doRotateRightCarry(T dest, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -325,7 +306,7 @@ static T doRotateRightCarry(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doShiftLeft(T dest, int count, uint32_t &flags)
+static T doShiftLeft(T dest, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -353,7 +334,7 @@ static T doShiftLeft(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doDoubleShiftLeft(T dest, T src, int count, uint32_t &flags)
+static T doDoubleShiftLeft(T dest, T src, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -387,7 +368,7 @@ static T doDoubleShiftLeft(T dest, T src, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doShiftRight(T dest, int count, uint32_t &flags)
+static T doShiftRight(T dest, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -415,7 +396,7 @@ static T doShiftRight(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doShiftRightArith(T dest, int count, uint32_t &flags)
+static T doShiftRightArith(T dest, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -442,7 +423,7 @@ static T doShiftRightArith(T dest, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doDoubleShiftRight(T dest, T src, int count, uint32_t &flags)
+static T doDoubleShiftRight(T dest, T src, int count, CPUFlags &flags)
 {
     if(!count)
         return dest;
@@ -476,63 +457,33 @@ static T doDoubleShiftRight(T dest, T src, int count, uint32_t &flags)
 }
 
 template<class T>
-static T doSub(T dest, T src, uint32_t &flags)
+static T doSub(T dest, T src, CPUFlags &flags)
 {
     T res = dest - src;
-
-    bool overflow = (dest ^ src) & (dest ^ res) & signBit<T>();
-    bool carry4 = (dest ^ src ^ res) & 0x10;
-
-    flags = (flags & ~(Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O))
-          | (src > dest ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
-
+    flags.setLazy(CPUFlags::Op::Sub, dest, src, res);
     return res;
 }
 
 template<class T>
-static T doSubWithBorrow(T dest, T src, uint32_t &flags)
+static T doSubWithBorrow(T dest, T src, CPUFlags &flags)
 {
     int c = flags & Flag_C ? 1 : 0;
     T res = dest - src - c;
-
-    bool carry = src > dest || (src == dest && c);
-    bool overflow = (dest ^ src) & (dest ^ res) & signBit<T>();
-    bool carry4 = (dest ^ src ^ res) & 0x10;
-
-    flags = (flags & ~(Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O))
-          | (carry ? Flag_C : 0) 
-          | (parity(res) ? Flag_P : 0)
-          | (carry4 ? Flag_A : 0)
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (overflow ? Flag_O : 0);
-
+    flags.setLazy(CPUFlags::Op::SubWithBorrow, dest, src, res);
     return res;
 }
 
 template<class T>
-static T doXor(T dest, T src, uint32_t &flags)
+static T doXor(T dest, T src, CPUFlags &flags)
 {
     T res = dest ^ src;
-
-    // c/o cleared
-    // szp set from res
-    flags = (flags & ~(Flag_C | Flag_P | Flag_Z | Flag_S | Flag_O))
-          | (res == 0 ? Flag_Z : 0)
-          | (res & signBit<T>() ? Flag_S : 0)
-          | (parity(res) ? Flag_P : 0);
-
+    flags.setLazy(CPUFlags::Op::Logic, dest, src, res);
     return res;
 }
 
 // higher level shift wrapper
 template<class T>
-static T doShift(int exOp, T dest, int count, uint32_t &flags)
+static T doShift(int exOp, T dest, int count, CPUFlags &flags)
 {
     count &= 0x1F;
 
@@ -559,44 +510,70 @@ static T doShift(int exOp, T dest, int count, uint32_t &flags)
     return 0;
 }
 
-// checks a condition code
-// used by Jcc/SETcc
-static bool getCondValue(int cond, uint32_t flags)
+// evaluates the flags from the last lazy op
+uint32_t CPUFlags::calculate() const
+{
+    if(lazyOp == Op::None)
+        return value;
+
+    uint32_t signBit = 1u << (lazySize * 8 - 1);
+
+    return (value & ~(Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_O))
+         | (calculateCarry() ? Flag_C : 0)
+         | (parity(res) ? Flag_P : 0)
+         | (calculateAuxCarry() ? Flag_A : 0)
+         | (res == 0 ? Flag_Z : 0)
+         | (res & signBit ? Flag_S : 0)
+         | (calculateOverflow() ? Flag_O : 0);
+}
+
+bool CPUFlags::getCondition(int cond) const
 {
+    bool carry, zero, sign, overflow;
+
+    if(lazyOp == Op::None)
+    {
+        carry = value & Flag_C;
+        zero = value & Flag_Z;
+        sign = value & Flag_S;
+        overflow = value & Flag_O;
+    }
+    else
+    {
+        // only calculate C/O if they're needed, the others are cheap
+        uint32_t signBit = 1u << (lazySize * 8 - 1);
+        carry = (cond & 0xA) == 0x2 && calculateCarry(); // B/BE
+        zero = res == 0;
+        sign = res & signBit;
+        overflow = (cond < 2 || cond >= 0xC) && calculateOverflow(); // O/L/LE
+    }
+
     bool condVal;
-    switch(cond)
+    switch(cond >> 1)
     {
-        case 0x0: // JO
-        case 0x1: // JNO
-            condVal = flags & Flag_O;
+        case 0: // JO/JNO
+            condVal = overflow;
             break;
-        case 0x2: // JB/JNAE
-        case 0x3: // JAE/JNB
-            condVal = flags & Flag_C;
+        case 1: // JB/JAE
+            condVal = carry;
             break;
-        case 0x4: // JE/JZ
-        case 0x5: // JNE/JNZ
-            condVal = flags & Flag_Z;
+        case 2: // JE/JNE
+            condVal = zero;
             break;
-        case 0x6: // JBE/JNA
-        case 0x7: // JNBE/JA
-            condVal = flags & (Flag_C | Flag_Z);
+        case 3: // JBE/JA
+            condVal = carry || zero;
             break;
-        case 0x8: // JS
-        case 0x9: // JNS
-            condVal = flags & Flag_S;
+        case 4: // JS/JNS
+            condVal = sign;
             break;
-        case 0xA: // JP/JPE
-        case 0xB: // JNP/JPO
-            condVal = flags & Flag_P;
+        case 5: // JP/JNP
+            condVal = lazyOp == Op::None ? (value & Flag_P) : parity(res);
             break;
-        case 0xC: // JL/JNGE
-        case 0xD: // JNL/JGE
-            condVal = !!(flags & Flag_S) != !!(flags & Flag_O);
+        case 6: // JL/JGE
+            condVal = sign != overflow;
             break;
-        case 0xE: // JLE/JNG
-        case 0xF: // JNLE/JG
-            condVal = !!(flags & Flag_S) != !!(flags & Flag_O) || (flags & Flag_Z);
+        default: // JLE/JG
+            condVal = sign != overflow || zero;
             break;
     }
 
@@ -606,6 +583,65 @@ static bool getCondValue(int cond, uint32_t flags)
     return condVal;
 }
 
+bool CPUFlags::calculateCarry() const
+{
+    switch(lazyOp)
+    {
+        case Op::Add:
+            return res < dest;
+        case Op::AddWithCarry:
+            // value still has the carry in
+            return res < dest || (res == dest && (value & Flag_C));
+        case Op::Sub:
+            return src > dest;
+        case Op::SubWithBorrow:
+            return src > dest || (src == dest && (value & Flag_C));
+        case Op::Logic:
+            return false;
+        default: // inc/dec don't change it
+            return value & Flag_C;
+    }
+}
+
+bool CPUFlags::calculateOverflow() const
+{
+    uint32_t signBit = 1u << (lazySize * 8 - 1);
+
+    switch(lazyOp)
+    {
+        case Op::Add:
+        case Op::AddWithCarry:
+            return ~(dest ^ src) & (src ^ res) & signBit;
+        case Op::Sub:
+        case Op::SubWithBorrow:
+            return (dest ^ src) & (dest ^ res) & signBit;
+        case Op::Inc:
+            return res == signBit;
+        case Op::Dec:
+            return res == signBit - 1;
+        default: // logic
+            return false;
+    }
+}
+
+bool CPUFlags::calculateAuxCarry() const
+{
+    switch(lazyOp)
+    {
+        case Op::Add:
+        case Op::AddWithCarry:
+        case Op::Sub:
+        case Op::SubWithBorrow:
+            return (dest ^ src ^ res) & 0x10;
+        case Op::Inc:
+            return (res & 0xF) == 0;
+        case Op::Dec:
+            return (res & 0xF) == 0xF;
+        default: // logic ops don't change it
+            return value & Flag_A;
+    }
+}
+
 CPU::CPU(System &sys) : sys(sys)
 {}
 
@@ -625,9 +661,17 @@ void CPU::reset()
 
     stackAddrSize32 = false;
 
-    reg(Reg16::DX) = 3 << 8 | 8; // 386, D1/D2 stepping
+    reg(Reg16::DX) = getSignature();
+
+#ifdef CPU_FPU
+    reg(Reg32::CR0) = 1 << 4; // ET, 387 present
 
+    resetFPU();
+    for(auto &r : fpuRegs)
+        r = 0;
+#else
     reg(Reg32::CR0) = 0;
+#endif
 
     setSegmentReg(Reg16::CS, 0xF000);
     reg(Reg16::DS) = reg(Reg16::ES) = reg(Reg16::SS) = reg(Reg16::FS) = reg(Reg16::GS) = 0;
@@ -637,26 +681,80 @@ void CPU::reset()
     reg(Reg32::EIP) = 0xFFF0;
 
     for(auto &entry : tlb)
+        entry.tag[TLB_Read] = entry.tag[TLB_Write] = entry.tag[TLB_UserRead] = entry.tag[TLB_UserWrite] = 0;
+
+    tlbGeneration = 1;
+
+    for(auto &ptr : tssPagePtrs)
+        ptr = nullptr;
+
+    invalidateStackWindow();
+
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    for(auto &entry : descriptorCache)
+        entry.tag = 0;
+
+    descriptorCacheGeneration[0] = descriptorCacheGeneration[1] = 1;
+
+    for(auto &entry : idtCache)
         entry.tag = 0;
 
-    tlbIndex = 0;
+    idtCacheGeneration = 1;
+#endif
+
+    ipPtrBase = ~0u;
+
+#ifdef CPU_BLOCK_CACHE_SIZE
+    for(auto &block : blockCache)
+        block.tag = ~0u;
+
+    invalidateDecodedBlock();
+#endif
+
+#ifdef CPU_JIT
+    flushCompiledBlocks();
+#endif
 
     cpl = 0;
 }
 
+// reads the host clock every hostClockSampleInterval calls (instructions or REP iterations)
+inline void CPU::sampleHostClock()
+{
+#ifdef USE_HOST_CLOCK
+    if(!(++hostClockSampleCount & (hostClockSampleInterval - 1)))
+        sys.updateCycleCount();
+#endif
+}
+
 void CPU::run(int ms)
 {
     uint32_t cycles = (System::getClockSpeed() * ms) / 1000;
 
-    auto startCycleCount = sys.getCycleCount();
+    runEndCycle = sys.getCycleCount() + cycles;
 
-    auto &chipset = sys.getChipset();
+    // try again, the caller has waited for whatever it was
+    busyWaiting = false;
+
+    // faults unwind to here, the instruction loop then carries on with the handler
+    // (nothing local is live across this, so nothing can be clobbered by the longjmp)
+    std::jmp_buf faultJmp;
+    faultJmpBuf = &faultJmp;
+
+    setjmp(faultJmp);
 
-    uint32_t cycleCount = startCycleCount;
+    auto &chipset = sys.getChipset();
 
-    while(cycleCount - startCycleCount < cycles)
+    while(true)
     {
-        auto oldCycles = cycleCount;
+        sys.updateCycleCount();
+        auto cycleCount = sys.getCycleCount();
+
+        if(static_cast<int32_t>(cycleCount - runEndCycle) >= 0)
+            break;
+
+        if(static_cast<int32_t>(cycleCount - sys.getNextEventCycle()) >= 0)
+            sys.runEvents();
 
         if(chipset.needDMAUpdate())
             chipset.updateDMA();
@@ -669,23 +767,157 @@ void CPU::run(int ms)
 
         delayInterrupt = false;
 
-        if(halted) // TODO: sync until interrupt
-            break;
+        if(halted)
+        {
+            // nothing to do until the next device event, let the caller wait for it
+            // (or with virtual time, skip straight to it)
+            if(static_cast<int32_t>(cycleCount - sys.getNextEventCycle()) < 0)
+            {
+                if(!sys.isVirtualTime())
+                    break;
+
+                skipVirtualTime(sys.getNextEventCycle());
+                continue;
+            }
+
+            // ... which has just run, go back around to service the interrupt
+            if(!(chipset.hasInterrupt() && (flags & Flag_I)))
+                break;
+
+            continue;
+        }
+
+        // polling something that isn't going to change yet, let the caller wait
+        if(busyWaiting)
+        {
+            if(!sys.isVirtualTime())
+                break;
+
+            skipVirtualTime(busyWaitEndCycle);
+            busyWaiting = false;
+            continue;
+        }
+
+        // run until the next device event or something that needs handling out here
+        // (always at least one instruction, so an interrupt delayed by STI/MOV SS still waits for it)
+        do
+        {
+            (this->*executeFunc)();
+            busyWaitInsns++;
+
+            sampleHostClock();
+
+            cycleCount = sys.getCycleCount();
+        }
+        while(static_cast<int32_t>(cycleCount - sys.getNextEventCycle()) < 0
+            && static_cast<int32_t>(cycleCount - runEndCycle) < 0
+            && !halted && !busyWaiting
+            && !(chipset.hasInterrupt() && (flags & Flag_I))
+            && !chipset.needDMAUpdate());
+    }
+
+    faultJmpBuf = nullptr;
+}
+
+// advances virtual time to target, without going past the end of run()
+void CPU::skipVirtualTime(uint32_t target)
+{
+    auto cycleCount = sys.getCycleCount();
+
+    if(static_cast<int32_t>(target - runEndCycle) > 0)
+        target = runEndCycle;
+
+    if(static_cast<int32_t>(target - cycleCount) > 0)
+        sys.addVirtualCycles(target - cycleCount);
+}
+
+// called at the start of each iteration (or bulk chunk) of a REP string op
+// after the first, writes back the registers as a fault doesn't come back to the loop,
+// then checks for anything that should run first so that a large copy doesn't delay interrupts
+// returns true if the op should stop here, it continues from the same point after the interrupt returns
+// (always makes some progress first, so this can't get stuck restarting the same instruction)
+bool CPU::repIterationStart(bool first, uint32_t count, uint32_t si, uint32_t di, bool useSI, bool useDI, bool addressSize32)
+{
+    if(first)
+        return false;
+
+    if(addressSize32)
+    {
+        reg(Reg32::ECX) = count;
+        if(useSI) reg(Reg32::ESI) = si;
+        if(useDI) reg(Reg32::EDI) = di;
+    }
+    else
+    {
+        reg(Reg16::CX) = count;
+        if(useSI) reg(Reg16::SI) = si;
+        if(useDI) reg(Reg16::DI) = di;
+    }
+
+    // ... and charges virtual time for the iterations so far, which would also be lost on a fault
+    if(sys.isVirtualTime())
+    {
+        sys.addVirtualCycles((repChargedCount - count) * repIterationCycles);
+        repChargedCount = count;
+    }
 
-        doExecuteInstruction();
+    if(!shouldInterruptRep())
+        return false;
+
+    reg(Reg32::EIP) = faultIP;
+    return true;
+}
+
+bool CPU::shouldInterruptRep()
+{
+    sampleHostClock();
+    auto cycleCount = sys.getCycleCount();
+
+    // an interrupt that would be serviced right away
+    if((flags & Flag_I) && sys.getChipset().hasInterrupt())
+        return true;
+
+    // a device (PIT) needs updating or run() is out of time
+    return static_cast<int32_t>(cycleCount - sys.getNextEventCycle()) >= 0
+        || static_cast<int32_t>(cycleCount - runEndCycle) >= 0;
+}
+
+// called after each IN, looks for a short loop reading the same value from a port
+// once it's been going for a while, run() stops until the port or an interrupt could change it
+void CPU::checkBusyWait(uint16_t port, uint32_t value)
+{
+    auto addr = faultIP + getSegmentOffset(Reg16::CS);
+
+    if(addr != busyWaitAddr || port != busyWaitPort || value != busyWaitValue || busyWaitInsns > busyWaitMaxLoop)
+    {
+        busyWaitAddr = addr;
+        busyWaitPort = port;
+        busyWaitValue = value;
+        busyWaitCount = 0;
+    }
+    else if(++busyWaitCount == busyWaitThreshold)
+    {
+        busyWaitCount = 0;
 
-        // sync for interrupts
-        cycleCount = sys.getCycleCount();
-        uint32_t exec = cycleCount - oldCycles;
+        auto cycleCount = sys.getCycleCount();
+        int toChange = std::min(sys.getCyclesToPortChange(port, cycleCount), static_cast<int>(sys.getNextEventCycle() - cycleCount));
 
-        bool shouldUpdate = sys.getNextInterruptCycle() - oldCycles <= exec;
-        if(shouldUpdate)
-            sys.updateForInterrupts();
+        if(toChange > 0)
+        {
+            busyWaiting = true;
+            busyWaitEndCycle = cycleCount + toChange;
+        }
     }
+
+    busyWaitInsns = 0;
 }
 
 void CPU::updateFlags(uint32_t newFlags, uint32_t mask, bool is32)
 {
+    // not privileged, so always writable
+    if(model == Model::i486)
+        mask |= Flag_AC | Flag_ID;
+
     if(!is32)
         mask &= 0xFFFF;
 
@@ -703,10 +935,70 @@ void CPU::updateSegmentDescriptorCache()
     setSegmentReg(CPU::Reg16::GS, reg(CPU::Reg16::GS));
 }
 
+void CPU::flushTLB()
+{
+    // tags are virtual page | generation, clear everything when it wraps
+    if(++tlbGeneration == 0x1000)
+    {
+        for(auto &entry : tlb)
+            entry.tag[TLB_Read] = entry.tag[TLB_Write] = entry.tag[TLB_UserRead] = entry.tag[TLB_UserWrite] = 0;
+
+        tlbGeneration = 1;
+    }
+
+    // the IP cache is also a mapping
+    ipPtrBase = ~0u;
+#ifdef CPU_BLOCK_CACHE_SIZE
+    invalidateDecodedBlock();
+#endif
+
+    for(auto &ptr : tssPagePtrs)
+        ptr = nullptr;
+
+    invalidateStackWindow();
+}
+
+// INVLPG
+void CPU::invalidateTLBEntry(uint32_t virtAddr)
+{
+    auto &entry = tlb[(virtAddr >> 12) % CPU_TLB_SIZE];
+    entry.tag[TLB_Read] = entry.tag[TLB_Write] = entry.tag[TLB_UserRead] = entry.tag[TLB_UserWrite] = 0;
+
+    ipPtrBase = ~0u;
+#ifdef CPU_BLOCK_CACHE_SIZE
+    invalidateDecodedBlock();
+#endif
+
+    for(auto &ptr : tssPagePtrs)
+        ptr = nullptr;
+
+    invalidateStackWindow();
+}
+
+uint16_t CPU::getSignature() const
+{
+    if(model == Model::i486)
+    {
+#ifdef CPU_FPU
+        return 4 << 8 | 1 << 4; // 486DX
+#else
+        return 4 << 8 | 2 << 4; // 486SX
+#endif
+    }
+
+    return 3 << 8 | 8; // 386, D1/D2 stepping
+}
+
 // wrapper for tests
 void CPU::executeInstruction()
 {
-    doExecuteInstruction();
+    std::jmp_buf faultJmp;
+    faultJmpBuf = &faultJmp;
+
+    if(!setjmp(faultJmp))
+        (this->*executeFunc)();
+
+    faultJmpBuf = nullptr;
 }
 
 std::tuple<uint16_t, uint32_t, uint32_t> CPU::getOpStartAddr()
@@ -720,15 +1012,22 @@ void CPU::dumpTrace()
     trace.dump();
 }
 
-[[gnu::always_inline]] // this has exactly two callers, and one of them is only used by tests
-inline void CPU::doExecuteInstruction()
+// called when CR0 or CS changes
+void CPU::updateExecuteMode()
+{
+    if(isProtectedMode())
+        executeFunc = codeSizeBit ? &CPU::doExecuteInstruction<true, true> : &CPU::doExecuteInstruction<true, false>;
+    else
+        executeFunc = codeSizeBit ? &CPU::doExecuteInstruction<false, true> : &CPU::doExecuteInstruction<false, false>;
+}
+
+template<bool protectedMode, bool codeSize32>
+void CPU::doExecuteInstruction()
 {
     faultIP = reg(Reg32::EIP);
     auto addr = getSegmentOffset(Reg16::CS) + (reg(Reg32::EIP)++);
 
-    uint8_t opcode;
-    if(!readMemIP8(addr, opcode))
-        return;
+    uint8_t opcode = readMemIP8(addr);
 
     bool lock = false;
     bool rep = false, repZ = true;
@@ -739,11 +1038,43 @@ inline void CPU::doExecuteInstruction()
     // tracing
     if(trace.isEnabled())
     {
-        uint32_t physAddr = 0;
-        getPhysicalAddress(addr, physAddr); // shouldn't fault, we just read from it
-        trace.addEntry(addr, physAddr, opcode, isOperandSize32(false), regs, flags);
+        uint32_t physAddr = getPhysicalAddress(addr); // shouldn't fault, we just read from it
+        trace.addEntry(addr, physAddr, opcode, codeSize32, regs, flags.get());
     }
 
+#ifdef CPU_BLOCK_CACHE_SIZE
+    decodedModRMAddr = ~0u;
+    bool fuseJcc = false;
+
+    if(auto op = getDecodedOp(addr))
+    {
+#ifdef CPU_JIT
+        // (compiled blocks don't charge cycles, so not with virtual time)
+        if(curBlockOp == 0 && curBlock->jitCode && !sys.isVirtualTime() && runCompiledBlock(addr))
+            return;
+#endif
+
+        opcode = op->opcode;
+        lock = op->prefixes & Prefix_Lock;
+        rep = op->prefixes & (Prefix_Rep | Prefix_RepNZ);
+        repZ = !(op->prefixes & Prefix_RepNZ);
+        segmentOverride = static_cast<Reg16>(op->segmentOverride);
+        operandSizeOverride = op->prefixes & Prefix_OperandSize;
+        addressSizeOverride = op->prefixes & Prefix_AddressSize;
+
+        addr += op->opcodeOffset;
+        reg(Reg32::EIP) += op->opcodeOffset;
+
+        if(op->modRMOffset)
+        {
+            decodedModRMAddr = addr + op->modRMOffset;
+            decodedOp = op;
+        }
+
+        fuseJcc = op->fuseJcc && !trace.isEnabled();
+    }
+    else // not cached, decode prefixes
+#endif
     // prefixes
     while(true)
     {
@@ -769,8 +1100,7 @@ inline void CPU::doExecuteInstruction()
         else
             break;
 
-        if(!readMemIP8(++addr, opcode))
-            return;
+        opcode = readMemIP8(++addr);
 
         reg(Reg32::EIP)++;
     }
@@ -779,8 +1109,8 @@ inline void CPU::doExecuteInstruction()
     if(lock && !validateLOCKPrefix(opcode, addr))
         return;
 
-    bool operandSize32 = isOperandSize32(operandSizeOverride);
-    addressSize32 = isOperandSize32(addressSizeOverride);
+    bool operandSize32 = codeSize32 != operandSizeOverride;
+    addressSize32 = codeSize32 != addressSizeOverride;
 
     // with 16-bit operands the high bits of IP should be zeroed
     auto setIP = [this, &operandSize32](uint32_t newIP)
@@ -794,41 +1124,54 @@ inline void CPU::doExecuteInstruction()
     //push/pop
     auto push = [this](uint32_t val, bool is32)
     {
-        return doPush(val, is32, stackAddrSize32);
+        doPush(val, is32, stackAddrSize32);
     };
 
     auto pushSeg = [this](uint32_t val, bool is32)
     {
-        return doPush(val, is32, stackAddrSize32, true);
+        doPush(val, is32, stackAddrSize32, true);
     };
 
     // for use when we've already validated SP
     // doesn't currently skip any validation
     auto pushPreChecked = [&push](uint32_t val, bool is32)
     {
-        [[maybe_unused]] bool ok = push(val, is32);
-        assert(ok);
+        push(val, is32);
     };
 
-    auto pop = [this](bool is32, uint32_t &v)
+    auto pop = [this](bool is32)
     {
-        return doPop(v, is32, stackAddrSize32);
+        return doPop(is32, stackAddrSize32);
     };
 
     // for use when we've already validated SP
     // doesn't currently skip any validation
-    auto popPreChecked = [&pop](bool is32, uint32_t &v)
+    auto popPreChecked = [&pop](bool is32)
     {
-        [[maybe_unused]] bool ok = pop(is32, v);
-        assert(ok);
+        return pop(is32);
     };
 
     // sometimes we need to check values (segments) before affecting SP
-    auto peek = [this](bool is32, int offset, uint32_t &v, int byteOffset = 0)
+    auto peek = [this](bool is32, int offset, int byteOffset = 0)
     {
-        return doPeek(v, is32, stackAddrSize32, offset, byteOffset);
+        return doPeek(is32, stackAddrSize32, offset, byteOffset);
     };
 
+    // INS/OUTS/MOVS/CMPS/STOS/LODS/SCAS, REP is ignored on anything else
+    bool repString = rep && ((opcode & 0xFC) == 0x6C || (opcode >= 0xA4 && opcode <= 0xAF && (opcode & 0xFE) != 0xA8));
+
+    // virtual time, charge for the instruction (REP string ops pay for their iterations as they go, see repIterationStart)
+    if(sys.isVirtualTime())
+    {
+        sys.addVirtualCycles(opcodeCycles[opcode]);
+
+        if(repString)
+        {
+            repChargedCount = addressSize32 ? reg(Reg32::ECX) : reg(Reg16::CX);
+            repIterationCycles = opcodeCycles[opcode];
+        }
+    }
+
     switch(opcode)
     {
         case 0x00: // ADD r/m8 r8
@@ -876,9 +1219,7 @@ inline void CPU::doExecuteInstruction()
         {
             auto r = static_cast<Reg16>(((opcode >> 3) & 7) + static_cast<int>(Reg16::ES));
 
-            uint32_t v;
-            if(!doPop(v, operandSize32, stackAddrSize32, true))
-                break;
+            uint32_t v = doPop(operandSize32, stackAddrSize32, true);
 
             setSegmentReg(r, v);
 
@@ -1139,12 +1480,8 @@ inline void CPU::doExecuteInstruction()
         case 0x38: // CMP r/m8 r8
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
-            uint8_t dest;
-            if(!readRM8(rm, dest))
-                break;
+            uint8_t dest = readRM8(rm);
 
             doSub(dest, reg(rm.reg8()), flags);
 
@@ -1154,16 +1491,12 @@ inline void CPU::doExecuteInstruction()
         case 0x39: // CMP r/m16 r16
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             if(operandSize32)
             {
                 auto src = reg(rm.reg32());
 
-                uint32_t dest;
-                if(!readRM32(rm, dest))
-                    break;
+                uint32_t dest = readRM32(rm);
 
                 doSub(dest, src, flags);
             }
@@ -1171,9 +1504,7 @@ inline void CPU::doExecuteInstruction()
             {
                 auto src = reg(rm.reg16());
 
-                uint16_t dest;
-                if(!readRM16(rm, dest))
-                    break;
+                uint16_t dest = readRM16(rm);
 
                 doSub(dest, src, flags);
             }
@@ -1184,12 +1515,8 @@ inline void CPU::doExecuteInstruction()
         case 0x3A: // CMP r8 r/m8
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
-            uint8_t src;
-            if(!readRM8(rm, src))
-                break;
+            uint8_t src = readRM8(rm);
 
             doSub(reg(rm.reg8()), src, flags);
 
@@ -1199,22 +1526,16 @@ inline void CPU::doExecuteInstruction()
         case 0x3B: // CMP r16 r/m16
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             if(operandSize32)
             {
-                uint32_t src;
-                if(!readRM32(rm, src))
-                    break;
+                uint32_t src = readRM32(rm);
 
                 doSub(reg(rm.reg32()), src, flags);
             }
             else
             {
-                uint16_t src;
-                if(!readRM16(rm, src))
-                    break;
+                uint16_t src = readRM16(rm);
 
                 doSub(reg(rm.reg16()), src, flags);
             }
@@ -1224,9 +1545,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0x3C: // CMP AL imm
         {
-            uint8_t imm;
-            if(!readMemIP8(addr + 1, imm))
-                return;
+            uint8_t imm = readMemIP8(addr + 1);
 
             doSub(reg(Reg8::AL), imm, flags);
 
@@ -1237,9 +1556,7 @@ inline void CPU::doExecuteInstruction()
         {
             if(operandSize32)
             {
-                uint32_t imm;
-                if(!readMemIP32(addr + 1, imm))
-                    return;
+                uint32_t imm = readMemIP32(addr + 1);
 
                 doSub(reg(Reg32::EAX), imm, flags);
 
@@ -1247,9 +1564,7 @@ inline void CPU::doExecuteInstruction()
             }
             else
             {
-                uint16_t imm;
-                if(!readMemIP16(addr + 1, imm))
-                    return;
+                uint16_t imm = readMemIP16(addr + 1);
 
                 doSub(reg(Reg16::AX), imm, flags);
 
@@ -1345,9 +1660,7 @@ inline void CPU::doExecuteInstruction()
         {
             auto r = opcode & 7;
 
-            uint32_t v;
-            if(!pop(operandSize32, v))
-                break;
+            uint32_t v = pop(operandSize32);
 
             if(operandSize32)
                 reg(static_cast<Reg32>(r)) = v;
@@ -1376,32 +1689,30 @@ inline void CPU::doExecuteInstruction()
         }
         case 0x61: // POPA
         {
-            uint32_t v;
-
-            if(!peek(operandSize32, 7, v))
-                break;
+            // check that the last one is readable before popping anything
+            peek(operandSize32, 7);
 
             if(operandSize32)
             {
-                popPreChecked(true, reg(Reg32::EDI));
-                popPreChecked(true, reg(Reg32::ESI));
-                popPreChecked(true, reg(Reg32::EBP));
-                popPreChecked(true, v); // skip sp
-                popPreChecked(true, reg(Reg32::EBX));
-                popPreChecked(true, reg(Reg32::EDX));
-                popPreChecked(true, reg(Reg32::ECX));
-                popPreChecked(true, reg(Reg32::EAX));
+                reg(Reg32::EDI) = popPreChecked(true);
+                reg(Reg32::ESI) = popPreChecked(true);
+                reg(Reg32::EBP) = popPreChecked(true);
+                popPreChecked(true); // skip sp
+                reg(Reg32::EBX) = popPreChecked(true);
+                reg(Reg32::EDX) = popPreChecked(true);
+                reg(Reg32::ECX) = popPreChecked(true);
+                reg(Reg32::EAX) = popPreChecked(true);
             }
             else
             {
-                popPreChecked(false, v); reg(Reg16::DI) = v;
-                popPreChecked(false, v); reg(Reg16::SI) = v;
-                popPreChecked(false, v); reg(Reg16::BP) = v;
-                popPreChecked(false, v); // skip sp
-                popPreChecked(false, v); reg(Reg16::BX) = v;
-                popPreChecked(false, v); reg(Reg16::DX) = v;
-                popPreChecked(false, v); reg(Reg16::CX) = v;
-                popPreChecked(false, v); reg(Reg16::AX) = v;
+                reg(Reg16::DI) = popPreChecked(false);
+                reg(Reg16::SI) = popPreChecked(false);
+                reg(Reg16::BP) = popPreChecked(false);
+                popPreChecked(false); // skip sp
+                reg(Reg16::BX) = popPreChecked(false);
+                reg(Reg16::DX) = popPreChecked(false);
+                reg(Reg16::CX) = popPreChecked(false);
+                reg(Reg16::AX) = popPreChecked(false);
             }
 
             break;
@@ -1410,8 +1721,6 @@ inline void CPU::doExecuteInstruction()
         case 0x62: // BOUND
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             if(rm.isReg())
             {
@@ -1424,24 +1733,14 @@ inline void CPU::doExecuteInstruction()
             if(operandSize32)
             {
                 index = static_cast<int32_t>(reg(rm.reg32()));
-                uint32_t tmpL, tmpU;
-
-                if(!readMem32(rm.offset, rm.rmBase, tmpL) || !readMem32(rm.offset + 4, rm.rmBase, tmpU))
-                    break;
-
-                lower = static_cast<int32_t>(tmpL);
-                upper = static_cast<int32_t>(tmpU);
+                lower = static_cast<int32_t>(readMem32(rm.offset, rm.rmBase));
+                upper = static_cast<int32_t>(readMem32(rm.offset + 4, rm.rmBase));
             }
             else
             {
                 index = static_cast<int16_t>(reg(rm.reg16()));
-                uint16_t tmpL, tmpU;
-
-                if(!readMem16(rm.offset, rm.rmBase, tmpL) || !readMem16(rm.offset + 2, rm.rmBase, tmpU))
-                    break;
-
-                lower = static_cast<int16_t>(tmpL);
-                upper = static_cast<int16_t>(tmpU);
+                lower = static_cast<int16_t>(readMem16(rm.offset, rm.rmBase));
+                upper = static_cast<int16_t>(readMem16(rm.offset + 2, rm.rmBase));
             }
 
             if(index < lower || index > upper)
@@ -1454,19 +1753,15 @@ inline void CPU::doExecuteInstruction()
         case 0x63: // ARPL
         {
             // not valid in real or virtual-8086 mode
-            if(!isProtectedMode() || (flags & Flag_VM))
+            if(!protectedMode || (flags & Flag_VM))
                 fault(Fault::UD);
             else
             {
                 auto rm = readModRM(addr + 1);
-                if(!rm.isValid())
-                    return;
 
                 reg(Reg32::EIP)++;
 
-                uint16_t dest;
-                if(!readRM16(rm, dest))
-                    break;
+                uint16_t dest = readRM16(rm);
 
                 auto destRPL = dest & 3;
                 auto srcRPL = reg(rm.reg16()) & 3;
@@ -1488,15 +1783,13 @@ inline void CPU::doExecuteInstruction()
   
             if(operandSize32)
             {
-                if(!readMemIP32(addr + 1, imm))
-                    return;
+                imm = readMemIP32(addr + 1);
 
                 reg(Reg32::EIP) += 4;
             }
             else
             {
-                if(!readMemIP16(addr + 1, imm))
-                    return;
+                imm = readMemIP16(addr + 1);
 
                 reg(Reg32::EIP) += 2;
             }
@@ -1509,19 +1802,14 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
             if(operandSize32)
             {
                 uint32_t imm;
 
-                if(!readMemIP32(immAddr, imm))
-                    return;
+                imm = readMemIP32(immAddr);
 
-                uint32_t tmp;
-                if(!readRM32(rm, tmp))
-                    break;
+                uint32_t tmp = readRM32(rm);
 
                 reg(rm.reg32()) = doMultiplySigned(static_cast<int32_t>(tmp), static_cast<int32_t>(imm), flags);
 
@@ -1531,12 +1819,9 @@ inline void CPU::doExecuteInstruction()
             {
                 uint16_t imm;
 
-                if(!readMemIP16(immAddr, imm))
-                    return;
+                imm = readMemIP16(immAddr);
 
-                uint16_t tmp;
-                if(!readRM16(rm, tmp))
-                    break;
+                uint16_t tmp = readRM16(rm);
 
                 reg(rm.reg16()) = doMultiplySigned(static_cast<int16_t>(tmp), static_cast<int16_t>(imm), flags);
 
@@ -1548,9 +1833,7 @@ inline void CPU::doExecuteInstruction()
 
         case 0x6A: // PUSH imm8
         {
-            int32_t imm;
-            if(!readMemIP8(addr + 1, imm))
-                return;
+            int32_t imm = int8_t(readMemIP8(addr + 1));
 
             reg(Reg32::EIP)++;
     
@@ -1562,26 +1845,18 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
-            int32_t imm;
-            if(!readMemIP8(immAddr, imm))
-                return;
+            int32_t imm = int8_t(readMemIP8(immAddr));
 
             if(operandSize32)
             {
-                uint32_t tmp;
-                if(!readRM32(rm, tmp))
-                    break;
+                uint32_t tmp = readRM32(rm);
 
                 reg(rm.reg32()) = doMultiplySigned(static_cast<int32_t>(tmp), imm, flags);
             }
             else
             {
-                uint16_t tmp;
-                if(!readRM16(rm, tmp))
-                    break;
+                uint16_t tmp = readRM16(rm);
 
                 reg(rm.reg16()) = doMultiplySigned(static_cast<int16_t>(tmp), static_cast<int16_t>(imm), flags);
             }
@@ -1604,7 +1879,7 @@ inline void CPU::doExecuteInstruction()
         {
             auto port = reg(Reg16::DX);
 
-            if(!checkIOPermission(port))
+            if(!checkIOPermission(port, operandSize32 ? 4 : 2))
                 break;
 
             if(operandSize32)
@@ -1630,7 +1905,7 @@ inline void CPU::doExecuteInstruction()
         {
             auto port = reg(Reg16::DX);
 
-            if(!checkIOPermission(port))
+            if(!checkIOPermission(port, operandSize32 ? 4 : 2))
                 break;
 
             if(operandSize32)
@@ -1660,11 +1935,9 @@ inline void CPU::doExecuteInstruction()
         {
             int cond = opcode & 0xF;
 
-            int32_t off;
-            if(!readMemIP8(addr + 1, off))
-                return;
+            int32_t off = int8_t(readMemIP8(addr + 1));
        
-            if(getCondValue(cond, flags))
+            if(flags.getCondition(cond))
                 setIP(reg(Reg32::EIP) + 1 + off);
             else
                 reg(Reg32::EIP)++;
@@ -1676,16 +1949,10 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
-            uint8_t dest;
-            if(!readRM8(rm, dest))
-                break;
+            uint8_t dest = readRM8(rm);
 
-            uint8_t imm;
-            if(!readMemIP8(immAddr, imm))
-                return;
+            uint8_t imm = readMemIP8(immAddr);
 
             reg(Reg32::EIP) += 2;
 
@@ -1723,18 +1990,12 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
             if(operandSize32)
             {
-                uint32_t imm;
-                if(!readMemIP32(immAddr, imm))
-                    return;
+                uint32_t imm = readMemIP32(immAddr);
 
-                uint32_t dest;
-                if(!readRM32(rm, dest))
-                    break;
+                uint32_t dest = readRM32(rm);
 
                 reg(Reg32::EIP) += 5;
 
@@ -1768,13 +2029,9 @@ inline void CPU::doExecuteInstruction()
             }
             else
             {
-                uint16_t imm;
-                if(!readMemIP16(immAddr, imm))
-                    return;
+                uint16_t imm = readMemIP16(immAddr);
 
-                uint16_t dest;
-                if(!readRM16(rm, dest))
-                    break;
+                uint16_t dest = readRM16(rm);
 
                 reg(Reg32::EIP) += 3;
 
@@ -1813,21 +2070,14 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP) += 2;
 
             if(operandSize32)
             {
-                uint32_t dest;
-                if(!readRM32(rm, dest))
-                    break;
+                uint32_t dest = readRM32(rm);
 
-                int32_t simm;
-
-                if(!readMemIP8(immAddr, simm))
-                    return;
+                int32_t simm = int8_t(readMemIP8(immAddr));
 
                 uint32_t imm = simm;
 
@@ -1861,15 +2111,12 @@ inline void CPU::doExecuteInstruction()
             }
             else
             {
-                uint16_t dest;
-                if(!readRM16(rm, dest))
-                    break;
+                uint16_t dest = readRM16(rm);
 
                 uint16_t imm;
                 uint8_t imm8;
                 
-                if(!readMemIP8(immAddr, imm8))
-                    return;
+                imm8 = readMemIP8(immAddr);
 
                 imm = imm8;
 
@@ -1912,12 +2159,8 @@ inline void CPU::doExecuteInstruction()
         case 0x84: // TEST r/m8 r8
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
-            uint8_t dest;
-            if(!readRM8(rm, dest))
-                break;
+            uint8_t dest = readRM8(rm);
 
             doAnd(dest, reg(rm.reg8()), flags);
 
@@ -1927,25 +2170,19 @@ inline void CPU::doExecuteInstruction()
         case 0x85: // TEST r/m16 r16
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             if(operandSize32)
             {
                 auto src = reg(rm.reg32());
 
-                uint32_t dest;
-                if(!readRM32(rm, dest))
-                    break;
+                uint32_t dest = readRM32(rm);
                 doAnd(dest, src, flags);
             }
             else
             {
                 auto src = reg(rm.reg16());
 
-                uint16_t dest;
-                if(!readRM16(rm, dest))
-                    break;
+                uint16_t dest = readRM16(rm);
 
                 doAnd(dest, src, flags);
             }
@@ -1957,14 +2194,11 @@ inline void CPU::doExecuteInstruction()
         case 0x86: // XCHG r/m8 r8
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             auto srcReg = rm.reg8();
 
-            uint8_t tmp;
-            if(!readRM8(rm, tmp) || !writeRM8(rm, reg(srcReg)))
-                break;
+            uint8_t tmp = readRM8(rm);
+            writeRM8(rm, reg(srcReg));
 
             reg(srcReg) = tmp;
 
@@ -1974,16 +2208,13 @@ inline void CPU::doExecuteInstruction()
         case 0x87: // XCHG r/m16 r16
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             if(operandSize32)
             {
                 auto srcReg = rm.reg32();
     
-                uint32_t tmp;
-                if(!readRM32(rm, tmp) || !writeRM32(rm, reg(srcReg)))
-                    break;
+                uint32_t tmp = readRM32(rm);
+                writeRM32(rm, reg(srcReg));
 
                 reg(srcReg) = tmp;
             }
@@ -1991,9 +2222,8 @@ inline void CPU::doExecuteInstruction()
             {
                 auto srcReg = rm.reg16();
 
-                uint16_t tmp;
-                if(!readRM16(rm, tmp) || !writeRM16(rm, reg(srcReg)))
-                    break;
+                uint16_t tmp = readRM16(rm);
+                writeRM16(rm, reg(srcReg));
 
                 reg(srcReg) = tmp;
             }
@@ -2004,8 +2234,6 @@ inline void CPU::doExecuteInstruction()
         case 0x88: // MOV reg8 -> r/m
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
@@ -2015,8 +2243,6 @@ inline void CPU::doExecuteInstruction()
         case 0x89: // MOV reg16 -> r/m
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
@@ -2030,34 +2256,28 @@ inline void CPU::doExecuteInstruction()
         case 0x8A: // MOV r/m -> reg8
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
-            readRM8(rm, reg(rm.reg8()));
+            reg(rm.reg8()) = readRM8(rm);
             break;
         }
         case 0x8B: // MOV r/m -> reg16
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
             if(operandSize32)
-                readRM32(rm, reg(rm.reg32()));
+                reg(rm.reg32()) = readRM32(rm);
             else
-                readRM16(rm, reg(rm.reg16()));
+                reg(rm.reg16()) = readRM16(rm);
 
             break;
         }
         case 0x8C: // MOV sreg -> r/m
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
@@ -2077,8 +2297,6 @@ inline void CPU::doExecuteInstruction()
         case 0x8D: // LEA
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             if(rm.isReg())
             {
@@ -2098,8 +2316,6 @@ inline void CPU::doExecuteInstruction()
         case 0x8E: // MOV r/m -> sreg
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
@@ -2112,9 +2328,7 @@ inline void CPU::doExecuteInstruction()
                 break;
             }
 
-            uint16_t v;
-            if(readRM16(rm, v))
-                setSegmentReg(destReg, v);
+            setSegmentReg(destReg, readRM16(rm));
 
             break;
         }
@@ -2122,27 +2336,23 @@ inline void CPU::doExecuteInstruction()
         case 0x8F: // POP r/m
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
             assert(rm.op() == 0);
 
-            uint32_t v;
-            if(!pop(operandSize32, v))
-                break;
+            uint32_t v = pop(operandSize32);
 
             // annoying corner case, if SP is the base it should be the value after the pop
             if(addressSize32)
             {
                 uint8_t modRM, sib;
-                readMemIP8(addr + 1, modRM);
+                modRM = readMemIP8(addr + 1);
 
                 // SIB
                 if(modRM >> 6 != 3 && (modRM & 7) == 4)
                 {
-                    readMemIP8(addr + 2, sib);
+                    sib = readMemIP8(addr + 2);
                     if((sib & 7) == 4) // SP as base
                         rm.offset += operandSize32 ? 4 : 2;
                 }
@@ -2232,21 +2442,18 @@ inline void CPU::doExecuteInstruction()
 
             if(operandSize32)
             {
-                if(!readMemIP32(addr + 1, newIP))
-                    return;
+                newIP = readMemIP32(addr + 1);
 
                 offset += 4;
             }
             else
             {
-                if(!readMemIP16(addr + 1, newIP))
-                    return;
+                newIP = readMemIP16(addr + 1);
 
                 offset += 2;
             }
 
-            if(!readMemIP16(addr + offset, newCS))
-                return;
+            newCS = readMemIP16(addr + offset);
 
             auto retAddr = reg(Reg32::EIP) + offset + 1 /*+2 for CS, -1 that was added by fetch*/;
 
@@ -2256,7 +2463,12 @@ inline void CPU::doExecuteInstruction()
         }
 
         case 0x9B: // WAIT/FWAIT
-            // we don't have a floating point unit
+#ifdef CPU_FPU
+            if((reg(Reg32::CR0) & ((1 << 1)/*MP*/ | (1 << 3)/*TS*/)) == ((1 << 1) | (1 << 3)))
+                fault(Fault::NM);
+            else
+                checkFPUError();
+#endif
             break;
 
         case 0x9C: // PUSHF
@@ -2288,13 +2500,11 @@ inline void CPU::doExecuteInstruction()
                 // fall through to the protected mode path with CPL == IOPL == 3
             }
 
-            uint32_t newFlags;
-            if(!pop(operandSize32, newFlags))
-                break;
+            uint32_t newFlags = pop(operandSize32);
 
             uint32_t flagMask;
 
-            if(!isProtectedMode() || cpl == 0) // real mode or CPL == 0
+            if(!protectedMode || cpl == 0) // real mode or CPL == 0
                 flagMask = Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_T | Flag_I | Flag_D | Flag_O | Flag_IOPL | Flag_NT;
             else // protected mode, CPL > 0
             {
@@ -2320,7 +2530,7 @@ inline void CPU::doExecuteInstruction()
 
         case 0x9F: // LAHF
         {
-            reg(Reg8::AH) = flags;
+            reg(Reg8::AH) = flags.get();
             break;
         }
 
@@ -2330,22 +2540,20 @@ inline void CPU::doExecuteInstruction()
 
             if(addressSize32)
             {
-                if(!readMemIP32(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP32(addr + 1);
 
                 reg(Reg32::EIP) += 4;
             }
             else
             {
-                if(!readMemIP16(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP16(addr + 1);
 
                 reg(Reg32::EIP) += 2;
             }
 
             auto segment = segmentOverride == Reg16::AX ? Reg16::DS : segmentOverride;
 
-            readMem8(memAddr, segment, reg(Reg8::AL));
+            reg(Reg8::AL) = readMem8(memAddr, segment);
             break;
         }
         case 0xA1: // MOV off16 -> AX
@@ -2356,23 +2564,21 @@ inline void CPU::doExecuteInstruction()
 
             if(addressSize32)
             {
-                if(!readMemIP32(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP32(addr + 1);
 
                 reg(Reg32::EIP) += 4;
             }
             else
             {
-                if(!readMemIP16(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP16(addr + 1);
 
                 reg(Reg32::EIP) += 2;
             }
 
             if(operandSize32)
-                readMem32(memAddr, segment, reg(Reg32::EAX));
+                reg(Reg32::EAX) = readMem32(memAddr, segment);
             else
-                readMem16(memAddr, segment, reg(Reg16::AX));
+                reg(Reg16::AX) = readMem16(memAddr, segment);
 
             break;
         }
@@ -2382,15 +2588,13 @@ inline void CPU::doExecuteInstruction()
 
             if(addressSize32)
             {
-                if(!readMemIP32(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP32(addr + 1);
 
                 reg(Reg32::EIP) += 4;
             }
             else
             {
-                if(!readMemIP16(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP16(addr + 1);
 
                 reg(Reg32::EIP) += 2;
             }
@@ -2409,15 +2613,13 @@ inline void CPU::doExecuteInstruction()
 
             if(addressSize32)
             {
-                if(!readMemIP32(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP32(addr + 1);
 
                 reg(Reg32::EIP) += 4;
             }
             else
             {
-                if(!readMemIP16(addr + 1, memAddr))
-                    return;
+                memAddr = readMemIP16(addr + 1);
 
                 reg(Reg32::EIP) += 2;
             }
@@ -2464,14 +2666,37 @@ inline void CPU::doExecuteInstruction()
             if(rep)
             {
                 uint32_t count = addressSize32 ? reg(Reg32::ECX) : reg(Reg16::CX);
+                uint32_t startCount = count;
 
                 while(count)
                 {
-                    // TODO: interrupt
-                    uint8_t src, dest;
-                    if(!readMem8(si, segment, src) || !readMem8(di, Reg16::ES, dest))
+                    if(repIterationStart(count == startCount, count, si, di, true, true, addressSize32))
                         break;
 
+                    int done = doCompareStringBulk<uint8_t, true>(segment, si, di, count, addressSize32, repZ);
+
+                    if(done)
+                    {
+                        si += step * done;
+                        di += step * done;
+
+                        if(!addressSize32)
+                        {
+                            si &= 0xFFFF;
+                            di &= 0xFFFF;
+                        }
+
+                        count -= done;
+
+                        if(!!(flags & Flag_Z) != repZ)
+                            break;
+
+                        continue;
+                    }
+
+                    uint8_t src = readMem8(si, segment);
+                    uint8_t dest = readMem8(di, Reg16::ES);
+
                     doSub(src, dest, flags);
 
                     si += step;
@@ -2496,9 +2721,8 @@ inline void CPU::doExecuteInstruction()
             }
             else
             {
-                uint8_t src, dest;
-                if(!readMem8(si, segment, src) || !readMem8(di, Reg16::ES, dest))
-                    break;
+                uint8_t src = readMem8(si, segment);
+                uint8_t dest = readMem8(di, Reg16::ES);
 
                 doSub(src, dest, flags);
 
@@ -2547,23 +2771,46 @@ inline void CPU::doExecuteInstruction()
             if(rep)
             {
                 uint32_t count = addressSize32 ? reg(Reg32::ECX) : reg(Reg16::CX);
+                uint32_t startCount = count;
 
                 while(count)
                 {
-                    // TODO: interrupt
-                    if(operandSize32)
+                    if(repIterationStart(count == startCount, count, si, di, true, true, addressSize32))
+                        break;
+
+                    int done = operandSize32 ? doCompareStringBulk<uint32_t, true>(segment, si, di, count, addressSize32, repZ)
+                                             : doCompareStringBulk<uint16_t, true>(segment, si, di, count, addressSize32, repZ);
+
+                    if(done)
                     {
-                        uint32_t src, dest;
-                        if(!readMem32(si, segment, src) || !readMem32(di, Reg16::ES, dest))
+                        si += step * done;
+                        di += step * done;
+
+                        if(!addressSize32)
+                        {
+                            si &= 0xFFFF;
+                            di &= 0xFFFF;
+                        }
+
+                        count -= done;
+
+                        if(!!(flags & Flag_Z) != repZ)
                             break;
 
+                        continue;
+                    }
+
+                    if(operandSize32)
+                    {
+                        uint32_t src = readMem32(si, segment);
+                        uint32_t dest = readMem32(di, Reg16::ES);
+
                         doSub(src, dest, flags);
                     }
                     else
                     {
-                        uint16_t src, dest;
-                        if(!readMem16(si, segment, src) || !readMem16(di, Reg16::ES, dest))
-                            break;
+                        uint16_t src = readMem16(si, segment);
+                        uint16_t dest = readMem16(di, Reg16::ES);
 
                         doSub(src, dest, flags);
                     }
@@ -2592,17 +2839,15 @@ inline void CPU::doExecuteInstruction()
             {
                 if(operandSize32)
                 {
-                    uint32_t src, dest;
-                    if(!readMem32(si, segment, src) || !readMem32(di, Reg16::ES, dest))
-                        break;
+                    uint32_t src = readMem32(si, segment);
+                    uint32_t dest = readMem32(di, Reg16::ES);
 
                     doSub(src, dest, flags);
                 }
                 else
                 {
-                    uint16_t src, dest;
-                    if(!readMem16(si, segment, src) || !readMem16(di, Reg16::ES, dest))
-                        break;
+                    uint16_t src = readMem16(si, segment);
+                    uint16_t dest = readMem16(di, Reg16::ES);
 
                     doSub(src, dest, flags);
                 }
@@ -2626,9 +2871,7 @@ inline void CPU::doExecuteInstruction()
 
         case 0xA8: // TEST AL imm8
         {
-            uint8_t imm;
-            if(!readMemIP8(addr + 1, imm))
-                return;
+            uint8_t imm = readMemIP8(addr + 1);
 
             doAnd(reg(Reg8::AL), imm, flags);
 
@@ -2639,18 +2882,14 @@ inline void CPU::doExecuteInstruction()
         {
             if(operandSize32)
             {
-                uint32_t imm;
-                if(!readMemIP32(addr + 1, imm))
-                    return;
+                uint32_t imm = readMemIP32(addr + 1);
 
                 doAnd(reg(Reg32::EAX), imm, flags);
                 reg(Reg32::EIP) += 4;
             }
             else
             {
-                uint16_t imm;
-                if(!readMemIP16(addr + 1, imm))
-                    return;
+                uint16_t imm = readMemIP16(addr + 1);
 
                 doAnd(reg(Reg16::AX), imm, flags);
                 reg(Reg32::EIP) += 2;
@@ -2699,14 +2938,32 @@ inline void CPU::doExecuteInstruction()
             if(rep)
             {
                 uint32_t count = addressSize32 ? reg(Reg32::ECX) : reg(Reg16::CX);
+                uint32_t startCount = count;
 
                 while(count)
                 {
-                    // TODO: interrupt
-                    uint8_t rSrc;
-                    if(!readMem8(di, Reg16::ES, rSrc))
+                    if(repIterationStart(count == startCount, count, 0, di, false, true, addressSize32))
                         break;
 
+                    int done = doCompareStringBulk<uint8_t, false>(Reg16::ES, 0, di, count, addressSize32, repZ);
+
+                    if(done)
+                    {
+                        di += step * done;
+
+                        if(!addressSize32)
+                            di &= 0xFFFF;
+
+                        count -= done;
+
+                        if(!!(flags & Flag_Z) != repZ)
+                            break;
+
+                        continue;
+                    }
+
+                    uint8_t rSrc = readMem8(di, Reg16::ES);
+
                     doSub(reg(Reg8::AL), rSrc, flags);
 
                     di += step;
@@ -2727,9 +2984,7 @@ inline void CPU::doExecuteInstruction()
             }
             else
             {
-                uint8_t rSrc;
-                if(!readMem8(di, Reg16::ES, rSrc))
-                    break;
+                uint8_t rSrc = readMem8(di, Reg16::ES);
 
                 doSub(reg(Reg8::AL), rSrc, flags);
 
@@ -2759,23 +3014,40 @@ inline void CPU::doExecuteInstruction()
             if(rep)
             {
                 uint32_t count = addressSize32 ? reg(Reg32::ECX) : reg(Reg16::CX);
+                uint32_t startCount = count;
 
                 while(count)
                 {
-                    // TODO: interrupt
-                    if(operandSize32)
+                    if(repIterationStart(count == startCount, count, 0, di, false, true, addressSize32))
+                        break;
+
+                    int done = operandSize32 ? doCompareStringBulk<uint32_t, false>(Reg16::ES, 0, di, count, addressSize32, repZ)
+                                             : doCompareStringBulk<uint16_t, false>(Reg16::ES, 0, di, count, addressSize32, repZ);
+
+                    if(done)
                     {
-                        uint32_t rSrc;
-                        if(!readMem32(di, Reg16::ES, rSrc))
+                        di += step * done;
+
+                        if(!addressSize32)
+                            di &= 0xFFFF;
+
+                        count -= done;
+
+                        if(!!(flags & Flag_Z) != repZ)
                             break;
 
+                        continue;
+                    }
+
+                    if(operandSize32)
+                    {
+                        uint32_t rSrc = readMem32(di, Reg16::ES);
+
                         doSub(reg(Reg32::EAX), rSrc, flags);
                     }
                     else
                     {
-                        uint16_t rSrc;
-                        if(!readMem16(di, Reg16::ES, rSrc))
-                            break;
+                        uint16_t rSrc = readMem16(di, Reg16::ES);
 
                         doSub(reg(Reg16::AX), rSrc, flags);
                     }
@@ -2800,17 +3072,13 @@ inline void CPU::doExecuteInstruction()
             {
                 if(operandSize32)
                 {
-                    uint32_t rSrc;
-                    if(!readMem32(di, Reg16::ES, rSrc))
-                        break;
+                    uint32_t rSrc = readMem32(di, Reg16::ES);
 
                     doSub(reg(Reg32::EAX), rSrc, flags);
                 }
                 else
                 {
-                    uint16_t rSrc;
-                    if(!readMem16(di, Reg16::ES, rSrc))
-                        break;
+                    uint16_t rSrc = readMem16(di, Reg16::ES);
 
                     doSub(reg(Reg16::AX), rSrc, flags);
                 }
@@ -2836,7 +3104,7 @@ inline void CPU::doExecuteInstruction()
         {
             auto r = static_cast<Reg8>(opcode & 7);
             reg(Reg32::EIP)++;
-            readMemIP8(addr + 1, reg(r));
+            reg(r) = readMemIP8(addr + 1);
             break;
         }
 
@@ -2853,13 +3121,13 @@ inline void CPU::doExecuteInstruction()
             {
                 auto r = static_cast<Reg32>(opcode & 7);
                 reg(Reg32::EIP) += 4;
-                readMemIP32(addr + 1, reg(r));
+                reg(r) = readMemIP32(addr + 1);
             }
             else
             {
                 auto r = static_cast<Reg16>(opcode & 7);
                 reg(Reg32::EIP) += 2;
-                readMemIP16(addr + 1, reg(r));
+                reg(r) = readMemIP16(addr + 1);
             }
             break;
         }
@@ -2868,18 +3136,12 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
-            uint8_t count;
-            if(!readMemIP8(immAddr, count))
-                return;
+            uint8_t count = readMemIP8(immAddr);
     
             reg(Reg32::EIP) += 2;
 
-            uint8_t v;
-            if(!readRM8(rm, v))
-                break;
+            uint8_t v = readRM8(rm);
 
             writeRM8(rm, doShift(rm.op(), v, count, flags));
             break;
@@ -2888,28 +3150,20 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
     
-            uint8_t count;
-            if(!readMemIP8(immAddr, count))
-                return;
+            uint8_t count = readMemIP8(immAddr);
 
             reg(Reg32::EIP) += 2;
 
             if(operandSize32)
             {
-                uint32_t v;
-                if(!readRM32(rm, v))
-                    break;
+                uint32_t v = readRM32(rm);
 
                 writeRM32(rm, doShift(rm.op(), v, count, flags));
             }
             else
             {
-                uint16_t v;
-                if(!readRM16(rm, v))
-                    break;
+                uint16_t v = readRM16(rm);
 
                 writeRM16(rm, doShift(rm.op(), v, count, flags));
             }
@@ -2919,15 +3173,10 @@ inline void CPU::doExecuteInstruction()
     
         case 0xC2: // RET near, add to SP
         {
-            uint16_t imm;
-            if(!readMemIP16(addr + 1, imm))
-                return;
+            uint16_t imm = readMemIP16(addr + 1);
             
             // pop from stack
-            uint32_t newIP;
-
-            if(!peek(operandSize32, 0, newIP))
-                break;
+            uint32_t newIP = peek(operandSize32, 0);
 
             // check IP against limit
             if(newIP > getCachedSegmentDescriptor(Reg16::CS).limit)
@@ -2948,10 +3197,7 @@ inline void CPU::doExecuteInstruction()
         case 0xC3: // RET near
         {
             // pop from stack
-            uint32_t newIP;
-
-            if(!peek(operandSize32, 0, newIP))
-                break;
+            uint32_t newIP = peek(operandSize32, 0);
 
             // check IP against limit
             if(newIP > getCachedSegmentDescriptor(Reg16::CS).limit)
@@ -2981,14 +3227,10 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
             assert(rm.op() == 0);
 
-            uint8_t imm;
-            if(!readMemIP8(immAddr, imm))
-                return;
+            uint8_t imm = readMemIP8(immAddr);
 
             reg(Reg32::EIP) += 2;
 
@@ -3000,25 +3242,19 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
             assert(rm.op() == 0);
 
             if(operandSize32)
             {
-                uint32_t imm;
-                if(!readMemIP32(immAddr, imm))
-                    return;
+                uint32_t imm = readMemIP32(immAddr);
 
                 reg(Reg32::EIP) += 5;
                 writeRM32(rm, imm);
             }
             else
             {
-                uint16_t imm;
-                if(!readMemIP16(immAddr, imm))
-                    return;
+                uint16_t imm = readMemIP16(immAddr);
 
                 reg(Reg32::EIP) += 3;
                 writeRM16(rm, imm);
@@ -3028,12 +3264,8 @@ inline void CPU::doExecuteInstruction()
 
         case 0xC8: // ENTER
         {
-            uint16_t allocSize;
-            uint8_t nestingLevel;
-            if(!readMemIP16(addr + 1, allocSize) || !readMemIP8(addr + 3, nestingLevel))
-                return;
-            
-            nestingLevel %= 32;
+            uint16_t allocSize = readMemIP16(addr + 1);
+            uint8_t nestingLevel = readMemIP8(addr + 3) % 32;
 
             // calculate the final SP
             int pushSize = operandSize32 ? 4 : 2;
@@ -3050,13 +3282,10 @@ inline void CPU::doExecuteInstruction()
             if(!checkSegmentLimit(ssDesc, finalSP, pushSize))
                 break;
 
-            uint32_t tempAddr;
-            if(!getPhysicalAddress(finalSP + ssDesc.base, tempAddr, true))
-                break;
+            getPhysicalAddress(finalSP + ssDesc.base, true);
 
             // we can at least handle this one easily...
-            if(!push(reg(Reg32::EBP), operandSize32))
-                break;
+            push(reg(Reg32::EBP), operandSize32);
 
             auto frameTemp = operandSize32 ? reg(Reg32::ESP) : reg(Reg16::SP);
 
@@ -3073,11 +3302,10 @@ inline void CPU::doExecuteInstruction()
 
                     uint32_t val;
                     if(operandSize32)
-                        readMem32(bp, ss, val);
+                        val = readMem32(bp, ss);
                     else
                     {
-                        uint16_t tmp;
-                        readMem16(bp, ss, tmp);
+                        uint16_t tmp = readMem16(bp, ss);
                         val = tmp;
                     }
 
@@ -3113,14 +3341,12 @@ inline void CPU::doExecuteInstruction()
 
             if(operandSize32)
             {
-                if(!readMem32(newSP, Reg16::SS, reg(Reg32::EBP)))
-                    break;
+                reg(Reg32::EBP) = readMem32(newSP, Reg16::SS);
                 newSP += 4;
             }
             else
             {
-                if(!readMem16(newSP, Reg16::SS, reg(Reg16::BP)))
-                    break;
+                reg(Reg16::BP) = readMem16(newSP, Reg16::SS);
                 newSP += 2;
             }
 
@@ -3137,26 +3363,21 @@ inline void CPU::doExecuteInstruction()
         case 0xCB: // RET far
         {
             // read the offset if needed
-            uint16_t imm = 0;
-            if(opcode == 0xCA && !readMemIP16(addr + 1, imm))
-                return;
-
-            uint32_t newIP, newCS;
+            uint16_t imm = opcode == 0xCA ? readMemIP16(addr + 1) : 0;
 
             // "pop" CS:IP
-            if(!peek(operandSize32, 0, newIP) || !peek(operandSize32, 1, newCS))
-                break;
+            uint32_t newIP = peek(operandSize32, 0);
+            uint32_t newCS = peek(operandSize32, 1);
 
             // need to validate CS (and SS) BEFORE popping anything...
-            if(isProtectedMode() && !(flags & Flag_VM))
+            if(protectedMode && !(flags & Flag_VM))
             {
                 if(!checkSegmentSelector(Reg16::CS, newCS, (newCS & 3)))
                     break;
 
                 // validate new SS if return to outer
-                uint32_t newSS;
                 int rpl = (newCS & 3);
-                if(rpl > cpl && (!peek(operandSize32, 3, newSS, imm) || !checkSegmentSelector(Reg16::SS, newSS, rpl)))
+                if(rpl > cpl && !checkSegmentSelector(Reg16::SS, peek(operandSize32, 3, imm), rpl))
                     break;
 
                 // can't return to a higher privilege
@@ -3184,7 +3405,7 @@ inline void CPU::doExecuteInstruction()
             else
                 reg(Reg16::SP) += imm + (operandSize32 ? 8 : 4);
 
-            if(isProtectedMode() && !(flags & Flag_VM))
+            if(protectedMode && !(flags & Flag_VM))
             {
                 int rpl = newCS & 3;
 
@@ -3197,8 +3418,8 @@ inline void CPU::doExecuteInstruction()
                     uint32_t newSP, newSS;
 
                     // can't fault, we pre-validated
-                    popPreChecked(operandSize32, newSP);
-                    popPreChecked(operandSize32, newSS);
+                    newSP = popPreChecked(operandSize32);
+                    newSS = popPreChecked(operandSize32);
 
                     setSegmentReg(Reg16::SS, newSS, false);
 
@@ -3230,9 +3451,7 @@ inline void CPU::doExecuteInstruction()
 
         case 0xCD: // INT
         {
-            uint8_t imm;
-            if(!readMemIP8(addr + 1, imm))
-                return;
+            uint8_t imm = readMemIP8(addr + 1);
 
             reg(Reg32::EIP)++;
             serviceInterrupt(imm, true);
@@ -3253,16 +3472,12 @@ inline void CPU::doExecuteInstruction()
         case 0xD0: // shift r/m8 by 1
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
             auto count = 1;
 
-            uint8_t v;
-            if(!readRM8(rm, v))
-                break;
+            uint8_t v = readRM8(rm);
 
             writeRM8(rm, doShift(rm.op(), v, count, flags));
             break;
@@ -3270,8 +3485,6 @@ inline void CPU::doExecuteInstruction()
         case 0xD1: // shift r/m16 by 1
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
     
@@ -3279,16 +3492,12 @@ inline void CPU::doExecuteInstruction()
     
             if(operandSize32)
             {
-                uint32_t v;
-                if(!readRM32(rm, v))
-                    break;
+                uint32_t v = readRM32(rm);
                 writeRM32(rm, doShift(rm.op(), v, count, flags));
             }
             else
             {
-                uint16_t v;
-                if(!readRM16(rm, v))
-                    break;
+                uint16_t v = readRM16(rm);
                 writeRM16(rm, doShift(rm.op(), v, count, flags));
             }
 
@@ -3297,16 +3506,12 @@ inline void CPU::doExecuteInstruction()
         case 0xD2: // shift r/m8 by cl
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
             auto count = reg(Reg8::CL);
 
-            uint8_t v;
-            if(!readRM8(rm, v))
-                break;
+            uint8_t v = readRM8(rm);
 
             writeRM8(rm, doShift(rm.op(), v, count, flags));
             break;
@@ -3314,8 +3519,6 @@ inline void CPU::doExecuteInstruction()
         case 0xD3: // shift r/m16 by cl
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP)++;
 
@@ -3323,16 +3526,12 @@ inline void CPU::doExecuteInstruction()
     
             if(operandSize32)
             {
-                uint32_t v;
-                if(!readRM32(rm, v))
-                    break;
+                uint32_t v = readRM32(rm);
                 writeRM32(rm, doShift(rm.op(), v, count, flags));
             }
             else
             {
-                uint16_t v;
-                if(!readRM16(rm, v))
-                    break;
+                uint16_t v = readRM16(rm);
                 writeRM16(rm, doShift(rm.op(), v, count, flags));
             }
 
@@ -3341,9 +3540,7 @@ inline void CPU::doExecuteInstruction()
 
         case 0xD4: // AAM
         {
-            uint8_t imm;
-            if(!readMemIP8(addr + 1, imm))
-                return;
+            uint8_t imm = readMemIP8(addr + 1);
 
             auto v = reg(Reg8::AL);
 
@@ -3370,9 +3567,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xD5: // AAD
         {
-            uint8_t imm;
-            if(!readMemIP8(addr + 1, imm))
-                return;
+            uint8_t imm = readMemIP8(addr + 1);
 
             uint8_t res = reg(Reg8::AL) + reg(Reg8::AH) * imm;
 
@@ -3398,7 +3593,7 @@ inline void CPU::doExecuteInstruction()
 
             auto segment = segmentOverride == Reg16::AX ? Reg16::DS : segmentOverride;
 
-            readMem8(memAddr, segment, reg(Reg8::AL));
+            reg(Reg8::AL) = readMem8(memAddr, segment);
             break;
         }
 
@@ -3411,24 +3606,26 @@ inline void CPU::doExecuteInstruction()
         case 0xDE:
         case 0xDF:
         {
+#ifdef CPU_FPU
+            if(reg(Reg32::CR0) & ((1 << 2)/*EM*/ | (1 << 3)/*TS*/))
+                fault(Fault::NM);
+            else
+                executeFPU(opcode, addr, operandSize32);
+#else
             if(reg(Reg32::CR0) & (1 << 2)/*EM*/)
                 fault(Fault::NM);
             else
             {
-                auto rm = readModRM(addr + 1);
-                if(!rm.isValid())
-                    return;
-
+                readModRM(addr + 1);
                 reg(Reg32::EIP)++;
             }
+#endif
             break;
         }
 
         case 0xE0: // LOOPNE/LOOPNZ
         {
-            int32_t off;
-            if(!readMemIP8(addr + 1, off))
-                return;
+            int32_t off = int8_t(readMemIP8(addr + 1));
 
             uint32_t count;
 
@@ -3448,9 +3645,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xE1: // LOOPE/LOOPZ
         {
-            int32_t off;
-            if(!readMemIP8(addr + 1, off))
-                return;
+            int32_t off = int8_t(readMemIP8(addr + 1));
 
             uint32_t count;
 
@@ -3470,9 +3665,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xE2: // LOOP
         {
-            int32_t off;
-            if(!readMemIP8(addr + 1, off))
-                return;
+            int32_t off = int8_t(readMemIP8(addr + 1));
 
             uint32_t count;
 
@@ -3492,9 +3685,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xE3: // JCXZ
         {
-            int32_t off;
-            if(!readMemIP8(addr + 1, off))
-                return;
+            int32_t off = int8_t(readMemIP8(addr + 1));
 
             auto val = addressSize32 ? reg(Reg32::ECX) : reg(Reg16::CX);
 
@@ -3507,11 +3698,12 @@ inline void CPU::doExecuteInstruction()
 
         case 0xE4: // IN AL from imm8
         {
-            uint8_t port;
-    
-            if(readMemIP8(addr + 1, port) && checkIOPermission(port))
+            uint8_t port = readMemIP8(addr + 1);
+
+            if(checkIOPermission(port))
             {
                 reg(Reg8::AL) = sys.readIOPort(port);
+                checkBusyWait(port, reg(Reg8::AL));
 
                 reg(Reg32::EIP)++;
             }
@@ -3519,25 +3711,28 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xE5: // IN AX from imm8
         {
-            uint8_t port;
+            uint8_t port = readMemIP8(addr + 1);
 
-            if(readMemIP8(addr + 1, port) && checkIOPermission(port))
+            if(checkIOPermission(port, operandSize32 ? 4 : 2))
             {
                 if(operandSize32)
                     reg(Reg32::EAX) = sys.readIOPort16(port) | sys.readIOPort16(port + 2) << 16;
                 else
                     reg(Reg16::AX) = sys.readIOPort16(port);
 
+                checkBusyWait(port, reg(Reg32::EAX));
+
                 reg(Reg32::EIP)++;
             }
             break;
         }
         case 0xE6: // OUT AL to imm8
         {
-            uint8_t port;
+            uint8_t port = readMemIP8(addr + 1);
 
-            if(readMemIP8(addr + 1, port) && checkIOPermission(port))
+            if(checkIOPermission(port))
             {
+                busyWaitCount = 0; // anything being polled may change now
                 auto data = reg(Reg8::AL);
                 reg(Reg32::EIP)++;
                 sys.writeIOPort(port, data);
@@ -3546,10 +3741,11 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xE7: // OUT AX to imm8
         {
-            uint8_t port;
+            uint8_t port = readMemIP8(addr + 1);
 
-            if(readMemIP8(addr + 1, port) && checkIOPermission(port))
+            if(checkIOPermission(port, operandSize32 ? 4 : 2))
             {
+                busyWaitCount = 0;
                 reg(Reg32::EIP)++;
                 auto data = operandSize32 ? reg(Reg32::EAX) : reg(Reg16::AX);
 
@@ -3567,17 +3763,14 @@ inline void CPU::doExecuteInstruction()
             int immSize = operandSize32 ? 4 : 2;
             
             if(operandSize32)
-            {
-                if(!readMemIP32(addr + 1, off))
-                    return;
-            }
-            else if(!readMemIP16(addr + 1, off))
-                return;
+                off = readMemIP32(addr + 1);
+            else
+                off = readMemIP16(addr + 1);
 
             // push
             auto retAddr = reg(Reg32::EIP) + immSize;
-            if(push(retAddr, operandSize32))
-                setIP(reg(Reg32::EIP) + immSize + off);
+            push(retAddr, operandSize32);
+            setIP(reg(Reg32::EIP) + immSize + off);
             break;
         }
 
@@ -3588,12 +3781,9 @@ inline void CPU::doExecuteInstruction()
             int immSize = operandSize32 ? 4 : 2;
             
             if(operandSize32)
-            {
-                if(!readMemIP32(addr + 1, off))
-                    return;
-            }
-            else if(!readMemIP16(addr + 1, off))
-                return;
+                off = readMemIP32(addr + 1);
+            else
+                off = readMemIP16(addr + 1);
 
             setIP(reg(Reg32::EIP) + immSize + off);
             break;
@@ -3607,21 +3797,18 @@ inline void CPU::doExecuteInstruction()
 
             if(operandSize32)
             {
-                if(!readMemIP32(addr + 1, newIP))
-                    return;
+                newIP = readMemIP32(addr + 1);
 
                 offset += 4;
             }
             else
             {
-                if(!readMemIP16(addr + 1, newIP))
-                    return;
+                newIP = readMemIP16(addr + 1);
 
                 offset += 2;
             }
 
-            if(!readMemIP16(addr + offset, newCS))
-                return;
+            newCS = readMemIP16(addr + offset);
 
             auto retAddr = reg(Reg32::EIP) + offset + 1 /*+2 for CS, -1 that was added by fetch*/;
 
@@ -3631,9 +3818,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xEB: // JMP short
         {
-            int32_t off;
-            if(!readMemIP8(addr + 1, off))
-                return;
+            int32_t off = int8_t(readMemIP8(addr + 1));
 
             setIP(reg(Reg32::EIP) + 1 + off);
             break;
@@ -3644,19 +3829,24 @@ inline void CPU::doExecuteInstruction()
             auto port = reg(Reg16::DX);
 
             if(checkIOPermission(port))
+            {
                 reg(Reg8::AL) = sys.readIOPort(port);
+                checkBusyWait(port, reg(Reg8::AL));
+            }
             break;
         }
         case 0xED: // IN AX from DX
         {
             auto port = reg(Reg16::DX);
 
-            if(checkIOPermission(port))
+            if(checkIOPermission(port, operandSize32 ? 4 : 2))
             {
                 if(operandSize32)
                     reg(Reg32::EAX) = sys.readIOPort16(port) | sys.readIOPort16(port + 2) << 16;
                 else
                     reg(Reg16::AX) = sys.readIOPort16(port);
+
+                checkBusyWait(port, reg(Reg32::EAX));
             }
             break;
         }
@@ -3667,6 +3857,7 @@ inline void CPU::doExecuteInstruction()
 
             if(checkIOPermission(port))
             {
+                busyWaitCount = 0;
                 auto data = reg(Reg8::AL);
 
                 sys.writeIOPort(port, data);
@@ -3678,8 +3869,9 @@ inline void CPU::doExecuteInstruction()
         {
             auto port = reg(Reg16::DX);
 
-            if(checkIOPermission(port))
+            if(checkIOPermission(port, operandSize32 ? 4 : 2))
             {
+                busyWaitCount = 0;
                 auto data = operandSize32 ? reg(Reg32::EAX) : reg(Reg16::AX);
 
                 sys.writeIOPort16(port, data);
@@ -3692,7 +3884,7 @@ inline void CPU::doExecuteInstruction()
 
         case 0xF4: // HLT
         {
-            if(isProtectedMode())
+            if(protectedMode)
             {
                 if(cpl != 0)
                 {
@@ -3718,21 +3910,15 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
-            uint8_t v;
-            if(!readRM8(rm, v))
-                break;
+            uint8_t v = readRM8(rm);
 
             switch(rm.op())
             {
                 case 0: // TEST imm
                 case 1: // alias
                 {
-                    uint8_t imm;
-                    if(!readMemIP8(immAddr, imm))
-                        return;
+                    uint8_t imm = readMemIP8(immAddr);
 
                     doAnd(v, imm, flags);
 
@@ -3829,21 +4015,16 @@ inline void CPU::doExecuteInstruction()
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 1, immAddr);
-            if(!rm.isValid())
-                return;
 
             uint32_t v;
 
             if(operandSize32)
             {
-                if(!readRM32(rm, v))
-                    break;
+                v = readRM32(rm);
             }
             else
             {
-                uint16_t tmp;
-                if(!readRM16(rm, tmp))
-                    break;
+                uint16_t tmp = readRM16(rm);
 
                 v = tmp;
             }
@@ -3855,9 +4036,7 @@ inline void CPU::doExecuteInstruction()
                 {
                     if(operandSize32)
                     {
-                        uint32_t imm;
-                        if(!readMemIP32(immAddr, imm))
-                            return;
+                        uint32_t imm = readMemIP32(immAddr);
 
                         doAnd(v, imm, flags);
 
@@ -3865,9 +4044,7 @@ inline void CPU::doExecuteInstruction()
                     }
                     else
                     {
-                        uint16_t imm;
-                        if(!readMemIP16(immAddr, imm))
-                            return;
+                        uint16_t imm = readMemIP16(immAddr);
 
                         doAnd(uint16_t(v), imm, flags);
 
@@ -4057,7 +4234,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xFA: // CLI
         {
-            if(isProtectedMode())
+            if(protectedMode)
             {
                 int iopl = (flags & Flag_IOPL) >> 12;
                 if(iopl < cpl)
@@ -4072,7 +4249,7 @@ inline void CPU::doExecuteInstruction()
         }
         case 0xFB: // STI
         {
-            if(isProtectedMode())
+            if(protectedMode)
             {
                 int iopl = (flags & Flag_IOPL) >> 12;
                 if(iopl < cpl)
@@ -4100,12 +4277,8 @@ inline void CPU::doExecuteInstruction()
         case 0xFE: // group2 byte
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
-            uint8_t v;
-            if(!readRM8(rm, v))
-                break;
+            uint8_t v = readRM8(rm);
 
             switch(rm.op())
             {
@@ -4136,21 +4309,16 @@ inline void CPU::doExecuteInstruction()
         case 0xFF: // group2 word
         {
             auto rm = readModRM(addr + 1);
-            if(!rm.isValid())
-                return;
 
             uint32_t v;
 
             if(operandSize32)
             {
-                if(!readRM32(rm, v))
-                    break;
+                v = readRM32(rm);
             }
             else
             {
-                uint16_t tmp;
-                if(!readRM16(rm, tmp))
-                    break;
+                uint16_t tmp = readRM16(rm);
 
                 v = tmp;
             }
@@ -4194,8 +4362,8 @@ inline void CPU::doExecuteInstruction()
                 {
                     // push
                     auto retAddr = reg(Reg32::EIP) + 1;
-                    if(push(retAddr, operandSize32))
-                        setIP(v);
+                    push(retAddr, operandSize32);
+                    setIP(v);
                     break;
                 }
                 case 3: // CALL far indirect
@@ -4206,9 +4374,8 @@ inline void CPU::doExecuteInstruction()
                         break;
                     }
 
-                    uint16_t newCS;
-                    if(readMem16(rm.offset + (operandSize32 ? 4 : 2), rm.rmBase, newCS))
-                        farCall(newCS, v, reg(Reg32::EIP) + 1, operandSize32, stackAddrSize32);
+                    uint16_t newCS = readMem16(rm.offset + (operandSize32 ? 4 : 2), rm.rmBase);
+                    farCall(newCS, v, reg(Reg32::EIP) + 1, operandSize32, stackAddrSize32);
                     break;
                 }
                 case 4: // JMP near indirect
@@ -4224,8 +4391,7 @@ inline void CPU::doExecuteInstruction()
                         break;
                     }
 
-                    uint16_t newCS;
-                    readMem16(rm.offset + (operandSize32 ? 4 : 2), rm.rmBase, newCS);
+                    uint16_t newCS = readMem16(rm.offset + (operandSize32 ? 4 : 2), rm.rmBase);
 
                     farJump(newCS, v, reg(Reg32::EIP) + 1);
                     break;
@@ -4250,21 +4416,26 @@ inline void CPU::doExecuteInstruction()
             exit(1);
             break;
     }
+
+    // the iterations since the last repIterationStart
+    if(repString && sys.isVirtualTime())
+        sys.addVirtualCycles((repChargedCount - (addressSize32 ? reg(Reg32::ECX) : reg(Reg16::CX))) * repIterationCycles);
+
+#ifdef CPU_BLOCK_CACHE_SIZE
+    if(fuseJcc)
+        executeFusedJcc();
+#endif
 }
 
 void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 {
-    uint8_t opcode2;
-    if(!readMemIP8(addr + 1, opcode2))
-        return;
+    uint8_t opcode2 = readMemIP8(addr + 1);
 
     switch(opcode2)
     {
         case 0x00:
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             switch(rm.op())
             {
@@ -4313,9 +4484,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                         break;
                     }
 
-                    uint16_t selector;
-
-                    if(readRM16(rm, selector) && setLDT(selector))
+                    if(setLDT(readRM16(rm)))
                         reg(Reg32::EIP) += 2;
                     break;
                 }
@@ -4328,9 +4497,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                         break;
                     }
 
-                    uint16_t selector;
-                    if(!readRM16(rm, selector))
-                        break;
+                    uint16_t selector = readRM16(rm);
 
                     // must be global
                     if((selector & 4) || (selector | 7) > gdtLimit)
@@ -4379,9 +4546,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                         break;
                     }
 
-                    uint16_t selector;
-                    if(!readRM16(rm, selector))
-                        break;
+                    uint16_t selector = readRM16(rm);
 
                     SegmentDescriptor desc;
                     bool validDesc = false;
@@ -4432,21 +4597,21 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0x01:
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             switch(rm.op())
             {
                 case 0x0: // SGDT
                 {
-                    if(writeMem16(rm.offset, rm.rmBase, gdtLimit) && writeMem32(rm.offset + 2, rm.rmBase, gdtBase))
-                        reg(Reg32::EIP) += 2;
+                    writeMem16(rm.offset, rm.rmBase, gdtLimit);
+                    writeMem32(rm.offset + 2, rm.rmBase, gdtBase);
+                    reg(Reg32::EIP) += 2;
                     break;
                 }
                 case 0x1: // SIDT
                 {
-                    if(writeMem16(rm.offset, rm.rmBase, idtLimit) && writeMem32(rm.offset + 2, rm.rmBase, idtBase))
-                        reg(Reg32::EIP) += 2;
+                    writeMem16(rm.offset, rm.rmBase, idtLimit);
+                    writeMem32(rm.offset + 2, rm.rmBase, idtBase);
+                    reg(Reg32::EIP) += 2;
                     break;
                 }
                 case 0x2: // LGDT
@@ -4457,12 +4622,14 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                         break;
                     }
 
-                    if(readMem16(rm.offset, rm.rmBase, gdtLimit) && readMem32(rm.offset + 2, rm.rmBase, gdtBase))
-                    {
-                        if(!operandSize32)
-                            gdtBase &= 0xFFFFFF;
-                        reg(Reg32::EIP) += 2;
-                    }
+                    gdtLimit = readMem16(rm.offset, rm.rmBase);
+                    gdtBase = readMem32(rm.offset + 2, rm.rmBase);
+
+                    if(!operandSize32)
+                        gdtBase &= 0xFFFFFF;
+
+                    flushDescriptorCache();
+                    reg(Reg32::EIP) += 2;
                     break;
                 }
                 case 0x3: // LIDT
@@ -4473,13 +4640,14 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                         break;
                     }
 
-                    if(readMem16(rm.offset, rm.rmBase, idtLimit) && readMem32(rm.offset + 2, rm.rmBase, idtBase))
-                    {
-                        if(!operandSize32)
-                            idtBase &= 0xFFFFFF;
+                    idtLimit = readMem16(rm.offset, rm.rmBase);
+                    idtBase = readMem32(rm.offset + 2, rm.rmBase);
 
-                        reg(Reg32::EIP) += 2;
-                    }
+                    if(!operandSize32)
+                        idtBase &= 0xFFFFFF;
+
+                    flushIDTCache();
+                    reg(Reg32::EIP) += 2;
                     break;
                 }
 
@@ -4498,23 +4666,41 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                         break;
                     }
 
-                    uint16_t tmp;
-                    if(!readRM16(rm, tmp))
-                        return;
+                    uint16_t tmp = readRM16(rm);
 
-                    reg(Reg32::CR0) = (reg(Reg32::CR0) & ~0x1E) | (tmp & 0x1F);
+                    reg(Reg32::CR0) = (reg(Reg32::CR0) & ~0xE) | (tmp & 0xF); // can't clear PE or change ET
+                    updateExecuteMode();
                     reg(Reg32::EIP) += 2;
                     break;
                 }
+                case 0x7: // INVLPG
+                {
+                    if(model != Model::i486 || rm.isReg())
+                    {
+                        fault(Fault::UD);
+                        break;
+                    }
 
-                default:
-                    printf("op 0f 01 %02x @%05x\n", rm.op(), addr);
-                    fault(Fault::UD);
-                    break;
-            }
-
-            break;
-        }
+                    if(cpl > 0)
+                    {
+                        fault(Fault::GP, 0);
+                        break;
+                    }
+
+                    // only the one page instead of the whole TLB
+                    invalidateTLBEntry(getSegmentOffset(rm.rmBase) + rm.offset);
+                    reg(Reg32::EIP) += 2;
+                    break;
+                }
+
+                default:
+                    printf("op 0f 01 %02x @%05x\n", rm.op(), addr);
+                    fault(Fault::UD);
+                    break;
+            }
+
+            break;
+        }
 
         case 0x02: // LAR
         {
@@ -4526,12 +4712,8 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             }
 
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
-            uint16_t selector;
-            if(!readRM16(rm, selector))
-                break;
+            uint16_t selector = readRM16(rm);
 
             bool validDesc = false;
             SegmentDescriptor desc;
@@ -4600,12 +4782,8 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             }
 
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
-            uint16_t selector;
-            if(!readRM16(rm, selector))
-                break;
+            uint16_t selector = readRM16(rm);
 
             bool validDesc = false;
             SegmentDescriptor desc;
@@ -4672,6 +4850,26 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             break;
         }
 
+        case 0x08: // INVD
+        case 0x09: // WBINVD
+        {
+            if(model != Model::i486)
+            {
+                fault(Fault::UD);
+                break;
+            }
+
+            if(cpl > 0)
+            {
+                fault(Fault::GP, 0);
+                break;
+            }
+
+            // no cache
+            reg(Reg32::EIP)++;
+            break;
+        }
+
         case 0x20: // MOV from control reg
         {
             if(cpl > 0)
@@ -4680,9 +4878,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                 break;
             }
 
-            uint8_t modRM;
-            if(!readMemIP8(addr + 2, modRM))
-                return;
+            uint8_t modRM = readMemIP8(addr + 2);
 
             auto r = static_cast<Reg32>(((modRM >> 3) & 0x7) + static_cast<int>(Reg32::CR0));
             auto rm = static_cast<Reg32>(modRM & 0x7);
@@ -4701,9 +4897,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                 break;
             }
 
-            uint8_t modRM;
-            if(!readMemIP8(addr + 2, modRM))
-                return;
+            uint8_t modRM = readMemIP8(addr + 2);
 
             //auto r = static_cast<Reg32>(((modRM >> 3) & 0x7) + static_cast<int>(Reg32::CR0));
             auto r = ((modRM >> 3) & 0x7);
@@ -4727,25 +4921,29 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                 break;
             }
 
-            uint8_t modRM;
-            if(!readMemIP8(addr + 2, modRM))
-                return;
+            uint8_t modRM = readMemIP8(addr + 2);
 
             auto r = static_cast<Reg32>(((modRM >> 3) & 0x7) + static_cast<int>(Reg32::CR0));
             auto rm = static_cast<Reg32>(modRM & 0x7);
 
             reg(r) = reg(rm);
 
-            if(r == Reg32::CR3)
+            if(r == Reg32::CR0)
             {
-                // invalidate TLB
-                for(auto &entry : tlb)
-                    entry.tag &= ~Page_Present;
-
-                // also invalidate our special IP cache
-                ipPtrBase = 0;
+                // NE/WP/AM are 486 additions, ET is hardwired there
+                if(model == Model::i486)
+                    reg(r) |= 1 << 4;
+                else
+                    reg(r) &= ~((1 << 5)/*NE*/ | (1 << 16)/*WP*/ | (1 << 18)/*AM*/);
             }
 
+            // invalidate TLB (also used for the unpaged mapping)
+            if(r == Reg32::CR0 || r == Reg32::CR3)
+                flushTLB();
+
+            if(r == Reg32::CR0)
+                updateExecuteMode();
+
             reg(Reg32::EIP) += 2;
             break;
         }
@@ -4758,9 +4956,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                 break;
             }
 
-            uint8_t modRM;
-            if(!readMemIP8(addr + 2, modRM))
-                return;
+            uint8_t modRM = readMemIP8(addr + 2);
 
             //auto r = static_cast<Reg32>(((modRM >> 3) & 0x7) + static_cast<int>(Reg32::CR0));
             auto r = ((modRM >> 3) & 0x7);
@@ -4797,19 +4993,16 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
             if(operandSize32)
             {
-                if(!readMemIP32(addr + 2, off))
-                    return;
+                off = readMemIP32(addr + 2);
             }
             else
             {
-                uint16_t tmp;
-                if(!readMemIP16(addr + 2, tmp))
-                    return;
+                uint16_t tmp = readMemIP16(addr + 2);
 
                 off = (tmp & 0x8000) ? (0xFFFF0000 | tmp) : tmp;
             }
 
-            if(getCondValue(cond, flags))
+            if(flags.getCondition(cond))
             {
                 uint32_t newIP = reg(Reg32::EIP) + (operandSize32 ? 5 : 3) + off;
 
@@ -4841,12 +5034,10 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         {
             int cond = opcode2 & 0xF;
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP) += 2;
 
-            writeRM8(rm, getCondValue(cond, flags) ? 1 : 0);
+            writeRM8(rm, flags.getCondition(cond) ? 1 : 0);
             break;
         }
 
@@ -4856,20 +5047,47 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             break;
         case 0xA1: // POP FS
         {
-            uint32_t v;
-            if(!doPop(v, operandSize32, stackAddrSize32, true))
-                break;
+            uint32_t v = doPop(operandSize32, stackAddrSize32, true);
 
             if(setSegmentReg(Reg16::FS, v))
                 reg(Reg32::EIP)++;
 
             break;
         }
+        case 0xA2: // CPUID (later 486s)
+        {
+            if(model != Model::i486)
+            {
+                fault(Fault::UD);
+                break;
+            }
+
+            if(reg(Reg32::EAX) == 0)
+            {
+                reg(Reg32::EAX) = 1; // max leaf
+                reg(Reg32::EBX) = 0x756E6547; // Genu
+                reg(Reg32::EDX) = 0x49656E69; // ineI
+                reg(Reg32::ECX) = 0x6C65746E; // ntel
+            }
+            else if(reg(Reg32::EAX) == 1)
+            {
+                reg(Reg32::EAX) = getSignature();
+                reg(Reg32::EBX) = reg(Reg32::ECX) = 0;
+#ifdef CPU_FPU
+                reg(Reg32::EDX) = 1 << 0; // FPU
+#else
+                reg(Reg32::EDX) = 0;
+#endif
+            }
+            else
+                reg(Reg32::EAX) = reg(Reg32::EBX) = reg(Reg32::ECX) = reg(Reg32::EDX) = 0;
+
+            reg(Reg32::EIP)++;
+            break;
+        }
         case 0xA3: // BT
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             int32_t bit;
             bool value;
@@ -4882,9 +5100,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                 if(!addressSize32)
                     rm.offset &= 0xFFFF;
 
-                uint32_t data;
-                if(!readRM32(rm, data))
-                    break;
+                uint32_t data = readRM32(rm);
 
                 value = data & (1 << (bit & 31));
             }
@@ -4895,9 +5111,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
                 if(!addressSize32)
                     rm.offset &= 0xFFFF;
 
-                uint16_t data;
-                if(!readRM16(rm, data))
-                    break;
+                uint16_t data = readRM16(rm);
 
                 value = data & (1 << (bit & 15));
             }
@@ -4915,21 +5129,15 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 2, immAddr);
-            if(!rm.isValid())
-                return;
 
-            uint8_t count;
-            if(!readMemIP8(immAddr, count))
-                return;
+            uint8_t count = readMemIP8(immAddr);
 
             count &= 0x1F;
             reg(Reg32::EIP) += 3;
 
             if(operandSize32)
             {
-                uint32_t v;
-                if(!readRM32(rm, v))
-                    break;
+                uint32_t v = readRM32(rm);
 
                 auto src = reg(rm.reg32());
                 writeRM32(rm, doDoubleShiftLeft(v, src, count, flags));
@@ -4938,8 +5146,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             {
                 uint16_t v;
 
-                if(!readRM16(rm, v))
-                    break;
+                v = readRM16(rm);
 
                 auto src = reg(rm.reg16());
                 writeRM16(rm, doDoubleShiftLeft(v, src, count, flags));
@@ -4950,8 +5157,6 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xA5: // SHLD by CL
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP) += 2;
 
@@ -4959,18 +5164,14 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
             if(operandSize32)
             {
-                uint32_t v;
-                if(!readRM32(rm, v))
-                    break;
+                uint32_t v = readRM32(rm);
 
                 auto src = reg(rm.reg32());
                 writeRM32(rm, doDoubleShiftLeft(v, src, count, flags));
             }
             else
             {
-                uint16_t v;
-                if(!readRM16(rm, v))
-                    break;
+                uint16_t v = readRM16(rm);
 
                 auto src = reg(rm.reg16());
                 writeRM16(rm, doDoubleShiftLeft(v, src, count, flags));
@@ -4985,9 +5186,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             break;
         case 0xA9: // POP GS
         {
-            uint32_t v;
-            if(!doPop(v, operandSize32, stackAddrSize32, true))
-                break;
+            uint32_t v = doPop(operandSize32, stackAddrSize32, true);
 
             if(setSegmentReg(Reg16::GS, v))
                 reg(Reg32::EIP)++;
@@ -4998,8 +5197,6 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xAB: // BTS
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             int32_t bit;
             bool value;
@@ -5014,13 +5211,10 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
                 bit &= 31;
 
-                uint32_t data;
-                if(!readRM32(rm, data))
-                    break;
+                uint32_t data = readRM32(rm);
 
                 value = data & (1 << bit);
-                if(!writeRM32(rm, data | 1 << bit))
-                    break;
+                writeRM32(rm, data | 1 << bit);
             }
             else
             {
@@ -5032,13 +5226,10 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
                 bit &= 15;
 
-                uint16_t data;
-                if(!readRM16(rm, data))
-                    break;
+                uint16_t data = readRM16(rm);
 
                 value = data & (1 << bit);
-                if(!writeRM16(rm, data | 1 << bit))
-                    break;
+                writeRM16(rm, data | 1 << bit);
             }
 
             if(value)
@@ -5054,30 +5245,22 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 2, immAddr);
-            if(!rm.isValid())
-                return;
 
-            uint8_t count;
-            if(!readMemIP8(immAddr, count))
-                return;
+            uint8_t count = readMemIP8(immAddr);
 
             count &= 0x1F;
             reg(Reg32::EIP) += 3;
 
             if(operandSize32)
             {
-                uint32_t v;
-                if(!readRM32(rm, v))
-                    break;
+                uint32_t v = readRM32(rm);
 
                 auto src = reg(rm.reg32());
                 writeRM32(rm, doDoubleShiftRight(v, src, count, flags));
             }
             else
             {
-                uint16_t v;
-                if(!readRM16(rm, v))
-                    break;
+                uint16_t v = readRM16(rm);
 
                 auto src = reg(rm.reg16());
                 writeRM16(rm, doDoubleShiftRight(v, src, count, flags));
@@ -5088,8 +5271,6 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xAD: // SHRD by CL
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             reg(Reg32::EIP) += 2;
 
@@ -5097,18 +5278,14 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
             if(operandSize32)
             {
-                uint32_t v;
-                if(!readRM32(rm, v))
-                    break;
+                uint32_t v = readRM32(rm);
 
                 auto src = reg(rm.reg32());
                 writeRM32(rm, doDoubleShiftRight(v, src, count, flags));
             }
             else
             {
-                uint16_t v;
-                if(!readRM16(rm, v))
-                    break;
+                uint16_t v = readRM16(rm);
 
                 auto src = reg(rm.reg16());
                 writeRM16(rm, doDoubleShiftRight(v, src, count, flags));
@@ -5120,23 +5297,17 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xAF: // IMUL r, r/m
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             if(operandSize32)
             {
-                uint32_t tmp;
-                if(!readRM32(rm, tmp))
-                    break;
+                uint32_t tmp = readRM32(rm);
 
                 auto regVal = static_cast<int32_t>(reg(rm.reg32()));
                 reg(rm.reg32()) = doMultiplySigned(regVal, static_cast<int32_t>(tmp), flags);
             }
             else
             {
-                uint16_t tmp;
-                if(!readRM16(rm, tmp))
-                    break;
+                uint16_t tmp = readRM16(rm);
 
                 auto regVal = static_cast<int16_t>(reg(rm.reg16()));
                 reg(rm.reg16()) = doMultiplySigned(regVal, static_cast<int16_t>(tmp), flags);
@@ -5146,6 +5317,84 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             break;
         }
 
+        case 0xB0: // CMPXCHG r/m8 r8
+        {
+            if(model != Model::i486)
+            {
+                fault(Fault::UD);
+                break;
+            }
+
+            auto rm = readModRM(addr + 2);
+
+            uint8_t dest = readRM8(rm);
+
+            doSub(reg(Reg8::AL), dest, flags);
+
+            // the destination is always written
+            if(dest == reg(Reg8::AL))
+            {
+                writeRM8(rm, reg(rm.reg8()));
+            }
+            else
+            {
+                writeRM8(rm, dest);
+
+                reg(Reg8::AL) = dest;
+            }
+
+            reg(Reg32::EIP) += 2;
+            break;
+        }
+        case 0xB1: // CMPXCHG r/m16 r16
+        {
+            if(model != Model::i486)
+            {
+                fault(Fault::UD);
+                break;
+            }
+
+            auto rm = readModRM(addr + 2);
+
+            if(operandSize32)
+            {
+                uint32_t dest = readRM32(rm);
+
+                doSub(reg(Reg32::EAX), dest, flags);
+
+                if(dest == reg(Reg32::EAX))
+                {
+                    writeRM32(rm, reg(rm.reg32()));
+                }
+                else
+                {
+                    writeRM32(rm, dest);
+
+                    reg(Reg32::EAX) = dest;
+                }
+            }
+            else
+            {
+                uint16_t dest = readRM16(rm);
+
+                doSub(reg(Reg16::AX), dest, flags);
+
+                if(dest == reg(Reg16::AX))
+                {
+                    writeRM16(rm, reg(rm.reg16()));
+                }
+                else
+                {
+                    writeRM16(rm, dest);
+
+                    reg(Reg16::AX) = dest;
+                }
+            }
+
+            reg(Reg32::EIP) += 2;
+            break;
+        }
+
         case 0xB2: // LSS
             reg(Reg32::EIP)++;
             loadFarPointer(addr + 1, Reg16::SS, operandSize32);
@@ -5154,8 +5403,6 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xB3: // BTR
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             int32_t bit;
             bool value;
@@ -5170,13 +5417,10 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
                 bit &= 31;
 
-                uint32_t data;
-                if(!readRM32(rm, data))
-                    break;
+                uint32_t data = readRM32(rm);
 
                 value = data & (1 << bit);
-                if(!writeRM32(rm, data & ~(1 << bit)))
-                    break;
+                writeRM32(rm, data & ~(1 << bit));
             }
             else
             {
@@ -5188,13 +5432,10 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
                 bit &= 15;
 
-                uint16_t data;
-                if(!readRM16(rm, data))
-                    break;
+                uint16_t data = readRM16(rm);
 
                 value = data & (1 << bit);
-                if(!writeRM16(rm, data & ~(1 << bit)))
-                    break;
+                writeRM16(rm, data & ~(1 << bit));
             }
 
             if(value)
@@ -5218,12 +5459,8 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xB6: // MOVZX 8 -> 16/32
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
-            uint8_t v;
-            if(!readRM8(rm, v))
-                break;
+            uint8_t v = readRM8(rm);
 
             if(operandSize32)
                 reg(rm.reg32()) = v;
@@ -5236,12 +5473,8 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xB7: // MOVZX 16 -> 16/32
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
-            uint16_t v;
-            if(!readRM16(rm, v))
-                break;
+            uint16_t v = readRM16(rm);
 
             if(operandSize32)
                 reg(rm.reg32()) = v;
@@ -5256,12 +5489,8 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         {
             uint32_t immAddr;
             auto rm = readModRM(addr + 2, immAddr);
-            if(!rm.isValid())
-                return;
 
-            uint8_t bit;
-            if(!readMemIP8(immAddr, bit))
-                return;
+            uint8_t bit = readMemIP8(immAddr);
 
             reg(Reg32::EIP) += 3;
 
@@ -5272,8 +5501,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             {
                 bit &= 31;
 
-                if(!readRM32(rm, data))
-                    break;
+                data = readRM32(rm);
 
                 value = data & (1 << bit);
             }
@@ -5281,9 +5509,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             {
                 bit &= 15;
 
-                uint16_t data16;
-                if(!readRM16(rm, data16))
-                    break;
+                uint16_t data16 = readRM16(rm);
 
                 value = data16 & (1 << bit);
                 data = data16;
@@ -5336,8 +5562,6 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xBB: // BTC
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             int32_t bit;
             bool value;
@@ -5352,13 +5576,10 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
                 bit &= 31;
 
-                uint32_t data;
-                if(!readRM32(rm, data))
-                    break;
+                uint32_t data = readRM32(rm);
 
                 value = data & (1 << bit);
-                if(!writeRM32(rm, data ^ 1 << bit))
-                    break;
+                writeRM32(rm, data ^ 1 << bit);
             }
             else
             {
@@ -5370,13 +5591,10 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
 
                 bit &= 15;
 
-                uint16_t data;
-                if(!readRM16(rm, data))
-                    break;
+                uint16_t data = readRM16(rm);
 
                 value = data & (1 << bit);
-                if(!writeRM16(rm, data ^ 1 << bit))
-                    break;
+                writeRM16(rm, data ^ 1 << bit);
             }
 
             if(value)
@@ -5391,21 +5609,16 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xBC: // BSF
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             uint32_t val;
 
             if(operandSize32)
             {
-                if(!readRM32(rm, val))
-                    break;
+                val = readRM32(rm);
             }
             else
             {
-                uint16_t tmp;
-                if(!readRM16(rm, tmp))
-                    break;
+                uint16_t tmp = readRM16(rm);
 
                 val = tmp;
             }
@@ -5429,21 +5642,16 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xBD: // BSR
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             uint32_t val;
 
             if(operandSize32)
             {
-                if(!readRM32(rm, val))
-                    break;
+                val = readRM32(rm);
             }
             else
             {
-                uint16_t tmp;
-                if(!readRM16(rm, tmp))
-                    break;
+                uint16_t tmp = readRM16(rm);
 
                 val = tmp;
             }
@@ -5467,13 +5675,9 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xBE: // MOVSX 8 -> 16/32
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             uint32_t v;
-            uint8_t v8;
-            if(!readRM8(rm, v8))
-                break;
+            uint8_t v8 = readRM8(rm);
 
             // sign extend
             if(v8 & 0x80)
@@ -5492,13 +5696,9 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xBF: // MOVSX 16 -> 16/32
         {
             auto rm = readModRM(addr + 2);
-            if(!rm.isValid())
-                return;
 
             uint32_t v;
-            uint16_t v16;
-            if(!readRM16(rm, v16))
-                break;
+            uint16_t v16 = readRM16(rm);
 
             // sign extend
             if(v16 & 0x8000)
@@ -5515,6 +5715,63 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
             break;
         }
 
+        case 0xC0: // XADD r/m8 r8
+        {
+            if(model != Model::i486)
+            {
+                fault(Fault::UD);
+                break;
+            }
+
+            auto rm = readModRM(addr + 2);
+
+            auto srcReg = rm.reg8();
+
+            uint8_t dest = readRM8(rm);
+            writeRM8(rm, doAdd(dest, reg(srcReg), flags));
+
+            // the sum wins if both are the same register
+            if(rm.rmBase != rm.reg)
+                reg(srcReg) = dest;
+
+            reg(Reg32::EIP) += 2;
+            break;
+        }
+        case 0xC1: // XADD r/m16 r16
+        {
+            if(model != Model::i486)
+            {
+                fault(Fault::UD);
+                break;
+            }
+
+            auto rm = readModRM(addr + 2);
+
+            if(operandSize32)
+            {
+                auto srcReg = rm.reg32();
+
+                uint32_t dest = readRM32(rm);
+                writeRM32(rm, doAdd(dest, reg(srcReg), flags));
+
+                if(rm.rmBase != rm.reg)
+                    reg(srcReg) = dest;
+            }
+            else
+            {
+                auto srcReg = rm.reg16();
+
+                uint16_t dest = readRM16(rm);
+                writeRM16(rm, doAdd(dest, reg(srcReg), flags));
+
+                if(rm.rmBase != rm.reg)
+                    reg(srcReg) = dest;
+            }
+
+            reg(Reg32::EIP) += 2;
+            break;
+        }
+
         case 0xC8: // BSWAP (486, need for seabios)
         case 0xC9:
         case 0xCA:
@@ -5524,7 +5781,7 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
         case 0xCE:
         case 0xCF:
         {
-            auto r = static_cast<Reg32>(opcode2 & 3);
+            auto r = static_cast<Reg32>(opcode2 & 7);
             reg(r) = __builtin_bswap32(reg(r));
             reg(Reg32::EIP)++;
             break;
@@ -5546,334 +5803,834 @@ void CPU::executeInstruction0F(uint32_t addr, bool operandSize32)
     }
 }
 
-bool CPU::readMem8(uint32_t offset, Reg16 segment, uint8_t &data)
+#ifdef CPU_BLOCK_CACHE_SIZE
+// instruction length info for the decoded block cache
+enum OpcodeInfo
 {
-    if(!checkSegmentAccess(segment, offset, 1, false))
-        return false;
-    return readMem8(offset + getSegmentOffset(segment), data);
-}
+    Op_Imm8        = 1,
+    Op_Imm16       = 2,
+    Op_ImmOpSize   = 3, // 16/32 bit depending on operand size
+    Op_ImmAddrSize = 4, // moffs
+    Op_ImmEnter    = 5, // 16 + 8
+    Op_ImmFarPtr   = 6, // 16 + operand size
+    Op_ImmGroup3   = 7, // F6/F7, only TEST has an immediate
 
-bool CPU::readMem16(uint32_t offset, Reg16 segment, uint16_t &data)
-{
-    if(!checkSegmentAccess(segment, offset, 2, false))
-        return false;
-    return readMem16(offset + getSegmentOffset(segment), data);
-}
+    Op_ImmMask     = 7,
 
-bool CPU::readMem32(uint32_t offset, Reg16 segment, uint32_t &data)
-{
-    if(!checkSegmentAccess(segment, offset, 4, false))
-        return false;
-    return readMem32(offset + getSegmentOffset(segment), data);
-}
+    Op_ModRM       = 1 << 3,
 
-bool CPU::writeMem8(uint32_t offset, Reg16 segment, uint8_t data)
-{
-    if(!checkSegmentAccess(segment, offset, 1, true))
-        return false;
-    return writeMem8(offset + getSegmentOffset(segment), data);
-}
+    Op_Invalid     = 0xFF,
+};
 
-bool CPU::writeMem16(uint32_t offset, Reg16 segment, uint16_t data)
+static constexpr std::array<uint8_t, 256> opcodeInfo = []()
 {
-    if(!checkSegmentAccess(segment, offset, 2, true))
-        return false;
-    return writeMem16(offset + getSegmentOffset(segment), data);
-}
+    std::array<uint8_t, 256> info{};
 
-bool CPU::writeMem32(uint32_t offset, Reg16 segment, uint32_t data)
-{
-    if(!checkSegmentAccess(segment, offset, 4, true))
-        return false;
-    return writeMem32(offset + getSegmentOffset(segment), data);
-}
+    // ALU ops
+    for(int i = 0; i < 0x40; i += 8)
+    {
+        info[i + 0] = info[i + 1] = info[i + 2] = info[i + 3] = Op_ModRM;
+        info[i + 4] = Op_Imm8;
+        info[i + 5] = Op_ImmOpSize;
+    }
 
-bool CPU::readMem8(uint32_t offset, uint8_t &data, bool privileged)
-{
-    uint32_t physAddr;
-    if(!getPhysicalAddress(offset, physAddr, false, privileged))
-        return false;
+    info[0x62] = info[0x63] = Op_ModRM; // BOUND, ARPL
+    info[0x68] = Op_ImmOpSize; // PUSH imm
+    info[0x69] = Op_ModRM | Op_ImmOpSize; // IMUL imm
+    info[0x6A] = Op_Imm8;
+    info[0x6B] = Op_ModRM | Op_Imm8;
 
-    data = sys.readMem(physAddr);
-    return true;
-}
+    for(int i = 0x70; i < 0x80; i++) // Jcc
+        info[i] = Op_Imm8;
 
-bool CPU::readMem16(uint32_t offset, uint16_t &data, bool privileged)
-{
-    // break up access if crossing page boundary
-    if((offset & 0xFFF) == 0xFFF)
-    {
-        uint8_t tmp[2];
+    info[0x80] = info[0x82] = info[0x83] = Op_ModRM | Op_Imm8;
+    info[0x81] = Op_ModRM | Op_ImmOpSize;
 
-        if(!readMem8(offset, tmp[0], privileged) || !readMem8(offset + 1, tmp[1], privileged))
-            return false;
+    for(int i = 0x84; i < 0x90; i++) // TEST/XCHG/MOV/LEA/POP
+        info[i] = Op_ModRM;
 
-        data = tmp[0] | tmp[1] << 8;
+    info[0x9A] = Op_ImmFarPtr; // CALL far
 
-        return true;
-    }
+    for(int i = 0xA0; i < 0xA4; i++) // MOV moffs
+        info[i] = Op_ImmAddrSize;
 
-    uint32_t physAddr;
-    if(!getPhysicalAddress(offset, physAddr, false, privileged))
-        return false;
+    info[0xA8] = Op_Imm8;
+    info[0xA9] = Op_ImmOpSize;
 
-    data = sys.readMem16(physAddr);
-    return true;
-}
+    for(int i = 0xB0; i < 0xB8; i++) // MOV reg8 imm
+        info[i] = Op_Imm8;
+    for(int i = 0xB8; i < 0xC0; i++) // MOV reg imm
+        info[i] = Op_ImmOpSize;
 
-bool CPU::readMem32(uint32_t offset, uint32_t &data, bool privileged)
-{
-    // break up access if crossing page boundary
-    if((offset & 0xFFF) > 0xFFC)
+    info[0xC0] = info[0xC1] = Op_ModRM | Op_Imm8; // shifts
+    info[0xC2] = info[0xCA] = Op_Imm16; // RET imm
+    info[0xC4] = info[0xC5] = Op_ModRM; // LES/LDS
+    info[0xC6] = Op_ModRM | Op_Imm8;
+    info[0xC7] = Op_ModRM | Op_ImmOpSize;
+    info[0xC8] = Op_ImmEnter;
+    info[0xCD] = Op_Imm8; // INT
+
+    for(int i = 0xD0; i < 0xD4; i++) // shifts
+        info[i] = Op_ModRM;
+
+    info[0xD4] = info[0xD5] = Op_Imm8; // AAM/AAD
+
+    for(int i = 0xD8; i < 0xE0; i++) // ESC
+        info[i] = Op_ModRM;
+
+    for(int i = 0xE0; i < 0xE8; i++) // LOOP/JCXZ/IN/OUT
+        info[i] = Op_Imm8;
+
+    info[0xE8] = info[0xE9] = Op_ImmOpSize; // CALL/JMP
+    info[0xEA] = Op_ImmFarPtr;
+    info[0xEB] = Op_Imm8;
+
+    info[0xF6] = info[0xF7] = Op_ModRM | Op_ImmGroup3;
+    info[0xFE] = info[0xFF] = Op_ModRM;
+
+    return info;
+}();
+
+static constexpr std::array<uint8_t, 256> opcode0FInfo = []()
+{
+    std::array<uint8_t, 256> info{};
+
+    for(auto &i : info)
+        i = Op_Invalid;
+
+    for(int i = 0x00; i < 0x04; i++) // groups/LAR/LSL
+        info[i] = Op_ModRM;
+
+    info[0x06] = info[0x08] = info[0x09] = info[0x0B] = 0; // CLTS/INVD/WBINVD/UD2
+
+    for(int i = 0x20; i < 0x27; i++) // MOV CR/DR/TR
+        info[i] = Op_ModRM;
+
+    for(int i = 0x80; i < 0x90; i++) // Jcc
+        info[i] = Op_ImmOpSize;
+
+    for(int i = 0x90; i < 0xA0; i++) // SETcc
+        info[i] = Op_ModRM;
+
+    info[0xA0] = info[0xA1] = info[0xA2] = info[0xA8] = info[0xA9] = 0; // PUSH/POP FS/GS, CPUID
+
+    info[0xA3] = info[0xA5] = info[0xAB] = info[0xAD] = info[0xAF] = Op_ModRM;
+    info[0xA4] = info[0xAC] = Op_ModRM | Op_Imm8; // SHLD/SHRD imm
+
+    for(int i = 0xB0; i < 0xC2; i++) // CMPXCHG/LSS/BTx/LFS/LGS/MOVZX/MOVSX/BSF/BSR/XADD
+        info[i] = Op_ModRM;
+
+    info[0xBA] = Op_ModRM | Op_Imm8; // BTx imm
+
+    for(int i = 0xC8; i < 0xD0; i++) // BSWAP
+        info[i] = 0;
+
+    return info;
+}();
+
+// returns the next decoded op if we have one
+// (either the next one in the current block or the first one in a new block)
+const CPU::DecodedOp *CPU::getDecodedOp(uint32_t addr)
+{
+    auto block = curBlock;
+    int index;
+
+    // blocks don't cross pages
+    if(addr == blockNextAddr && (addr & 0xFFF))
+        index = curBlockOp + 1;
+    else
+    {
+        block = lookupBlock(addr);
+        if(!block)
+        {
+            invalidateDecodedBlock();
+            return nullptr;
+        }
+
+        index = 0;
+
+#ifdef CPU_JIT
+        // compile blocks that are executed frequently
+        if(!block->jitCode && block->execCount < jitThreshold && ++block->execCount == jitThreshold)
+            compileBlock(*block);
+#endif
+    }
+
+    // decode ops as they are reached
+    if(index == block->numOps)
+    {
+        if(block->complete || index == DecodedBlock::maxOps || !decodeOp(ipPtr + addr, 0x1000 - (addr & 0xFFF), block->ops[index]))
+        {
+            block->complete = true;
+            invalidateDecodedBlock();
+            return nullptr;
+        }
+
+        block->numOps++;
+    }
+
+    auto &op = block->ops[index];
+
+    // let the slow path handle the limit fault
+    if(addr + op.length - 1 > ipLimit)
+    {
+        invalidateDecodedBlock();
+        return nullptr;
+    }
+
+    curBlock = block;
+    curBlockOp = index;
+    blockNextAddr = addr + op.length;
+
+    return &op;
+}
+
+// runs the Jcc after a CMP/TEST/DEC without going through the full dispatch
+// the flags are still lazy, so this only calculates the condition it needs
+void CPU::executeFusedJcc()
+{
+    auto addr = getSegmentOffset(Reg16::CS) + reg(Reg32::EIP);
+
+    // not decoded (end of the block) or crosses the limit, leave it for the next instruction
+    auto op = getDecodedOp(addr);
+    if(!op)
+        return;
+
+    faultIP = reg(Reg32::EIP);
+
+    if(sys.isVirtualTime())
+        sys.addVirtualCycles(opcodeCycles[op->opcode]);
+
+    int cond;
+    uint32_t off;
+
+    if(op->opcode == 0x0F)
+    {
+        cond = op->opcode2 & 0xF;
+        off = codeSizeBit ? op->imm : uint32_t(int16_t(op->imm));
+    }
+    else
+    {
+        cond = op->opcode & 0xF;
+        off = int8_t(op->imm);
+    }
+
+    if(flags.getCondition(cond))
+    {
+        uint32_t newIP = reg(Reg32::EIP) + op->length + off;
+
+        if(!codeSizeBit)
+            newIP &= 0xFFFF;
+
+        reg(Reg32::EIP) = newIP;
+    }
+    else
+        reg(Reg32::EIP) += op->length;
+}
+
+// finds the block starting at addr, assumes ipPtr has already been mapped
+CPU::DecodedBlock *CPU::lookupBlock(uint32_t addr)
+{
+    uint32_t physAddr = ipPhysBase << 12 | (addr & 0xFFF);
+
+    if(!sys.getChipset().getA20())
+        physAddr &= ~(1 << 20);
+
+    // not RAM/ROM
+    if(physAddr >= uint32_t(System::getNumMemoryPages() * System::getMemoryPageSize()) || !sys.mapAddress(physAddr))
+        return nullptr;
+
+    uint32_t tag = physAddr | (codeSizeBit ? 1u << 31 : 0);
+    auto gen = sys.getCodePageGeneration(physAddr);
+
+    auto &block = blockCache[(physAddr ^ (physAddr >> 10)) % CPU_BLOCK_CACHE_SIZE];
+
+    if(block.tag == tag && block.generation == gen)
+        return &block;
+
+    // new block, ops are decoded when they are executed
+    block.tag = tag;
+    block.generation = gen;
+    block.numOps = 0;
+    block.complete = false;
+
+#ifdef CPU_JIT
+    block.execCount = 0;
+    block.jitCode = nullptr;
+#endif
+
+    setCodePage(physAddr);
+
+    return &block;
+}
+
+// decodes prefixes/opcode/mod r/m and finds the length of an instruction
+// returns false if it doesn't fit in avail bytes
+bool CPU::decodeOp(const uint8_t *ptr, int avail, DecodedOp &op)
+{
+    int i = 0;
+
+    // prefixes
+    op.prefixes = 0;
+    op.segmentOverride = static_cast<uint8_t>(Reg16::AX);
+
+    for(; i < avail; i++)
     {
-        uint8_t tmp[4];
+        auto b = ptr[i];
+
+        if((b & 0xE7) == 0x26) // segment override
+            op.segmentOverride = static_cast<int>(Reg16::ES) + ((b >> 3) & 3);
+        else if(b == 0x64)
+            op.segmentOverride = static_cast<uint8_t>(Reg16::FS);
+        else if(b == 0x65)
+            op.segmentOverride = static_cast<uint8_t>(Reg16::GS);
+        else if(b == 0x66)
+            op.prefixes |= Prefix_OperandSize;
+        else if(b == 0x67)
+            op.prefixes |= Prefix_AddressSize;
+        else if(b == 0xF0)
+            op.prefixes |= Prefix_Lock;
+        else if(b == 0xF2)
+            op.prefixes |= Prefix_RepNZ;
+        else if(b == 0xF3)
+            op.prefixes |= Prefix_Rep;
+        else
+            break;
+    }
 
-        if(!readMem8(offset, tmp[0], privileged) || !readMem8(offset + 1, tmp[1], privileged) ||
-           !readMem8(offset + 2, tmp[2], privileged) || !readMem8(offset + 3, tmp[3], privileged))
+    if(i >= avail)
+        return false;
+
+    // the last of REPNE/REP wins
+    if((op.prefixes & Prefix_Rep) && (op.prefixes & Prefix_RepNZ))
+    {
+        for(int j = i - 1; j >= 0; j--)
         {
+            if(ptr[j] == 0xF2)
+            {
+                op.prefixes &= ~Prefix_Rep;
+                break;
+            }
+            else if(ptr[j] == 0xF3)
+            {
+                op.prefixes &= ~Prefix_RepNZ;
+                break;
+            }
+        }
+    }
+
+    bool operandSize32 = codeSizeBit != !!(op.prefixes & Prefix_OperandSize);
+    bool addrSize32 = codeSizeBit != !!(op.prefixes & Prefix_AddressSize);
+
+    op.opcodeOffset = i;
+    op.opcode = ptr[i++];
+
+    uint8_t info;
+
+    if(op.opcode == 0x0F)
+    {
+        if(i >= avail)
+            return false;
+
+        op.opcode2 = ptr[i++];
+        info = opcode0FInfo[op.opcode2];
+
+        if(info == Op_Invalid)
             return false;
+    }
+    else
+    {
+        op.opcode2 = 0;
+        info = opcodeInfo[op.opcode];
+    }
+
+    op.modRMOffset = 0;
+    op.modRMLength = 0;
+
+    if(info & Op_ModRM)
+    {
+        if(i >= avail)
+            return false;
+
+        auto modRM = ptr[i];
+        op.modRMOffset = i - op.opcodeOffset;
+        i++;
+
+        int mod = modRM >> 6;
+        int rm = modRM & 7;
+
+        op.rmReg = (modRM >> 3) & 7;
+        op.baseReg = op.indexReg = 0xFF;
+        op.baseShift = op.indexShift = 0;
+        op.disp = 0;
+
+        if(mod == 3)
+            op.rmBase = rm;
+        else
+        {
+            auto segBase = Reg16::DS;
+            int dispSize = 0;
+
+            if(addrSize32)
+            {
+                if(rm == 4) // SIB
+                {
+                    if(i >= avail)
+                        return false;
+
+                    auto sib = ptr[i++];
+                    int scale = sib >> 6;
+                    int index = (sib >> 3) & 7;
+                    int base = sib & 7;
+
+                    if(mod == 0 && base == 5) // disp32 instead of base
+                        dispSize = 4;
+                    else
+                    {
+                        if(base == 4 || base == 5)
+                            segBase = Reg16::SS;
+
+                        op.baseReg = base;
+
+                        if(index == 4) // matches readModRM
+                            op.baseShift = scale;
+                    }
+
+                    if(index != 4)
+                    {
+                        op.indexReg = index;
+                        op.indexShift = scale;
+                    }
+                }
+                else if(rm == 5 && mod == 0) // direct
+                    dispSize = 4;
+                else
+                {
+                    if(rm == 5)
+                        segBase = Reg16::SS;
+
+                    op.baseReg = rm;
+                }
+
+                if(mod == 1)
+                    dispSize = 1;
+                else if(mod == 2)
+                    dispSize = 4;
+            }
+            else
+            {
+                static const uint8_t base16[]{3/*BX*/, 3/*BX*/, 5/*BP*/, 5/*BP*/, 6/*SI*/, 7/*DI*/, 5/*BP*/, 3/*BX*/};
+                static const uint8_t index16[]{6/*SI*/, 7/*DI*/, 6/*SI*/, 7/*DI*/, 0xFF, 0xFF, 0xFF, 0xFF};
+
+                if(rm == 6 && mod == 0) // direct
+                    dispSize = 2;
+                else
+                {
+                    if(rm == 2 || rm == 3 || rm == 6)
+                        segBase = Reg16::SS;
+
+                    op.baseReg = base16[rm];
+                    op.indexReg = index16[rm];
+                }
+
+                if(mod == 1)
+                    dispSize = 1;
+                else if(mod == 2)
+                    dispSize = 2;
+            }
+
+            if(i + dispSize > avail)
+                return false;
+
+            if(dispSize == 1)
+                op.disp = int8_t(ptr[i]);
+            else if(dispSize == 2)
+                op.disp = ptr[i] | ptr[i + 1] << 8;
+            else if(dispSize == 4)
+                op.disp = ptr[i] | ptr[i + 1] << 8 | ptr[i + 2] << 16 | uint32_t(ptr[i + 3]) << 24;
+
+            i += dispSize;
+
+            // apply segment override
+            if(op.segmentOverride != static_cast<uint8_t>(Reg16::AX))
+                segBase = static_cast<Reg16>(op.segmentOverride);
+
+            op.rmBase = static_cast<uint8_t>(segBase);
         }
 
-        data = tmp[0] | tmp[1] << 8 | tmp[2] << 16 | tmp[3] << 24;
+        op.modRMLength = i - (op.opcodeOffset + op.modRMOffset + 1);
+    }
+
+    int immSize = 0;
 
-        return true;
+    switch(info & Op_ImmMask)
+    {
+        case Op_Imm8:
+            immSize = 1;
+            break;
+        case Op_Imm16:
+            immSize = 2;
+            break;
+        case Op_ImmOpSize:
+            immSize = operandSize32 ? 4 : 2;
+            break;
+        case Op_ImmAddrSize:
+            immSize = addrSize32 ? 4 : 2;
+            break;
+        case Op_ImmEnter:
+            immSize = 3;
+            break;
+        case Op_ImmFarPtr:
+            immSize = operandSize32 ? 6 : 4;
+            break;
+        case Op_ImmGroup3:
+            if(op.rmReg < 2) // TEST
+                immSize = (op.opcode & 1) ? (operandSize32 ? 4 : 2) : 1;
+            break;
     }
 
-    uint32_t physAddr;
-    if(!getPhysicalAddress(offset, physAddr, false, privileged))
+    if(i + immSize > avail)
         return false;
 
-    data = sys.readMem32(physAddr + 0);
+    op.imm = 0;
+    for(int j = 0; j < immSize && j < 4; j++)
+        op.imm |= ptr[i + j] << (j * 8);
+
+    i += immSize;
+
+    // longer than any valid instruction
+    if(i > 15)
+        return false;
+
+    op.length = i;
+
+    // CMP/TEST/DEC directly followed by a Jcc (without prefixes)
+    bool canFuse = (op.opcode >= 0x38 && op.opcode <= 0x3D) // CMP
+                || op.opcode == 0x84 || op.opcode == 0x85 || op.opcode == 0xA8 || op.opcode == 0xA9 // TEST
+                || (op.opcode >= 0x48 && op.opcode <= 0x4F) // DEC reg
+                || ((op.opcode == 0x80 || op.opcode == 0x81 || op.opcode == 0x83) && op.rmReg == 7); // CMP imm
+
+    op.fuseJcc = canFuse && !(op.prefixes & Prefix_Lock) && i < avail
+              && ((ptr[i] & 0xF0) == 0x70 || (ptr[i] == 0x0F && i + 1 < avail && (ptr[i + 1] & 0xF0) == 0x80));
 
     return true;
 }
+#endif
 
-bool CPU::writeMem8(uint32_t offset, uint8_t data, bool privileged)
+void CPU::invalidateCodePage(uint32_t physAddr)
 {
-    uint32_t physAddr;
-    if(!getPhysicalAddress(offset, physAddr, true, privileged))
-        return false;
+#ifdef CPU_BLOCK_CACHE_SIZE
+    // stop executing the current block if it was modified
+    if(curBlock && ((curBlock->tag & ~(1u << 31)) >> 12) == physAddr >> 12)
+        invalidateDecodedBlock();
+#endif
+}
 
-    sys.writeMem(physAddr, data);
-    return true;
+uint8_t CPU::readMem8(uint32_t offset, Reg16 segment)
+{
+    if(getCachedSegmentDescriptor(segment).flags & SD_FlatRead)
+        return readMem8(offset);
+
+    checkSegmentAccess(segment, offset, 1, false);
+    return readMem8(offset + getSegmentOffset(segment));
+}
+
+uint16_t CPU::readMem16(uint32_t offset, Reg16 segment)
+{
+    if((getCachedSegmentDescriptor(segment).flags & SD_FlatRead) && offset <= 0xFFFFFFFF - 1)
+        return readMem16(offset);
+
+    checkSegmentAccess(segment, offset, 2, false);
+    return readMem16(offset + getSegmentOffset(segment));
+}
+
+uint32_t CPU::readMem32(uint32_t offset, Reg16 segment)
+{
+    if((getCachedSegmentDescriptor(segment).flags & SD_FlatRead) && offset <= 0xFFFFFFFF - 3)
+        return readMem32(offset);
+
+    checkSegmentAccess(segment, offset, 4, false);
+    return readMem32(offset + getSegmentOffset(segment));
 }
 
-bool CPU::writeMem16(uint32_t offset, uint16_t data, bool privileged)
+void CPU::writeMem8(uint32_t offset, Reg16 segment, uint8_t data)
+{
+    if(getCachedSegmentDescriptor(segment).flags & SD_FlatWrite)
+        return writeMem8(offset, data);
+
+    checkSegmentAccess(segment, offset, 1, true);
+    writeMem8(offset + getSegmentOffset(segment), data);
+}
+
+void CPU::writeMem16(uint32_t offset, Reg16 segment, uint16_t data)
+{
+    if((getCachedSegmentDescriptor(segment).flags & SD_FlatWrite) && offset <= 0xFFFFFFFF - 1)
+        return writeMem16(offset, data);
+
+    checkSegmentAccess(segment, offset, 2, true);
+    writeMem16(offset + getSegmentOffset(segment), data);
+}
+
+void CPU::writeMem32(uint32_t offset, Reg16 segment, uint32_t data)
+{
+    if((getCachedSegmentDescriptor(segment).flags & SD_FlatWrite) && offset <= 0xFFFFFFFF - 3)
+        return writeMem32(offset, data);
+
+    checkSegmentAccess(segment, offset, 4, true);
+    writeMem32(offset + getSegmentOffset(segment), data);
+}
+
+uint8_t CPU::readMem8(uint32_t offset, bool privileged)
+{
+    auto entry = getTLBEntry(offset, false, privileged);
+
+    if(entry->readPtr)
+        return entry->readPtr[offset & 0xFFF];
+
+    return sys.readMem(entry->physAddr | (offset & 0xFFF));
+}
+
+uint16_t CPU::readMem16(uint32_t offset, bool privileged)
 {
     // break up access if crossing page boundary
-    if((offset & 0xFFF) > 0xFFC)
+    if((offset & 0xFFF) == 0xFFF)
     {
-        // FIXME: what if the first page is valid, but the second isn't?
-        return writeMem8(offset, data & 0xFF, privileged) && writeMem8(offset + 1, data >> 8, privileged);
+        uint8_t lo = readMem8(offset, privileged);
+        return lo | readMem8(offset + 1, privileged) << 8;
     }
 
-    uint32_t physAddr;
-    if(!getPhysicalAddress(offset, physAddr, true, privileged))
-        return false;
+    auto entry = getTLBEntry(offset, false, privileged);
 
-    sys.writeMem16(physAddr, data);
-    return true;
+    if(entry->readPtr)
+        return *reinterpret_cast<uint16_t *>(entry->readPtr + (offset & 0xFFF));
+
+    return sys.readMem16(entry->physAddr | (offset & 0xFFF));
 }
 
-bool CPU::writeMem32(uint32_t offset, uint32_t data, bool privileged)
+uint32_t CPU::readMem32(uint32_t offset, bool privileged)
 {
     // break up access if crossing page boundary
     if((offset & 0xFFF) > 0xFFC)
     {
-        return writeMem8(offset    , data & 0xFF, privileged) && writeMem8(offset + 1, data >> 8 , privileged)
-            && writeMem8(offset + 2, data >> 16 , privileged) && writeMem8(offset + 3, data >> 24, privileged);
+        uint32_t data = 0;
+
+        for(int i = 0; i < 4; i++)
+            data |= uint32_t(readMem8(offset + i, privileged)) << (i * 8);
+
+        return data;
     }
 
-    uint32_t physAddr;
-    if(!getPhysicalAddress(offset, physAddr, true, privileged))
-        return false;
+    auto entry = getTLBEntry(offset, false, privileged);
 
-    sys.writeMem32(physAddr, data);
-    return true;
+    if(entry->readPtr)
+        return *reinterpret_cast<uint32_t *>(entry->readPtr + (offset & 0xFFF));
+
+    return sys.readMem32(entry->physAddr | (offset & 0xFFF));
 }
 
-bool CPU::readMemIP8(uint32_t offset, uint8_t &data)
+void CPU::writeMem8(uint32_t offset, uint8_t data, bool privileged)
 {
-    // check if we would cross a page boundary (even if not paging)
-    if(ipPtrBase != offset >> 12)
-    {
-        uint32_t physAddr;
-        if(!getPhysicalAddress(offset, physAddr))
-            return false;
+    busyWaitCount = 0; // a loop that stores something isn't just polling
+
+    auto entry = getTLBEntry(offset, true, privileged);
+
+    if(entry->writePtr)
+        entry->writePtr[offset & 0xFFF] = data;
+    else
+        sys.writeMem(entry->physAddr | (offset & 0xFFF), data);
+}
 
-        ipPtr = sys.mapAddress(physAddr) - offset;
-        ipPtrBase = offset >> 12;
+void CPU::writeMem16(uint32_t offset, uint16_t data, bool privileged)
+{
+    busyWaitCount = 0;
+
+    // break up access if crossing page boundary
+    if((offset & 0xFFF) > 0xFFC)
+    {
+        // FIXME: what if the first page is valid, but the second isn't?
+        writeMem8(offset, data & 0xFF, privileged);
+        writeMem8(offset + 1, data >> 8, privileged);
+        return;
     }
 
-    if(offset > ipLimit)
+    auto entry = getTLBEntry(offset, true, privileged);
+
+    if(entry->writePtr)
+        *reinterpret_cast<uint16_t *>(entry->writePtr + (offset & 0xFFF)) = data;
+    else
+        sys.writeMem16(entry->physAddr | (offset & 0xFFF), data);
+}
+
+void CPU::writeMem32(uint32_t offset, uint32_t data, bool privileged)
+{
+    busyWaitCount = 0;
+
+    // break up access if crossing page boundary
+    if((offset & 0xFFF) > 0xFFC)
     {
-        fault(Fault::GP, 0);
-        return false;
+        for(int i = 0; i < 4; i++)
+            writeMem8(offset + i, data >> (i * 8), privileged);
+        return;
     }
 
-    data = ipPtr[offset];
-    return true;
+    auto entry = getTLBEntry(offset, true, privileged);
+
+    if(entry->writePtr)
+        *reinterpret_cast<uint32_t *>(entry->writePtr + (offset & 0xFFF)) = data;
+    else
+        sys.writeMem32(entry->physAddr | (offset & 0xFFF), data);
 }
 
-bool CPU::readMemIP8(uint32_t offset, int32_t &data)
+void CPU::mapIPPage(uint32_t offset)
 {
-    uint8_t tmp;
-    if(!readMemIP8(offset, tmp))
-        return false;
+    uint32_t physAddr = getPhysicalAddress(offset);
 
-    data = int8_t(tmp);
-    return true;
+    ipPtr = sys.mapAddress(physAddr) - offset;
+    ipPtrBase = offset >> 12;
+    ipPhysBase = physAddr >> 12;
 }
 
-bool CPU::readMemIP16(uint32_t offset, uint16_t &data)
+uint8_t CPU::readMemIP8(uint32_t offset)
 {
-    // split if we cross a page boundary mid-read
-    if((offset & 0xFFF) > 0xFFE)
-    {
-        uint8_t tmp[2];
+    // check if we would cross a page boundary (even if not paging)
+    if(ipPtrBase != offset >> 12)
+        mapIPPage(offset);
 
-        if(!readMemIP8(offset, tmp[0]) || !readMemIP8(offset + 1, tmp[1]))
-            return false;
+    if(offset > ipLimit)
+        fault(Fault::GP, 0);
 
-        data = tmp[0] | tmp[1] << 8;
+    return ipPtr[offset];
+}
 
-        return true;
+uint16_t CPU::readMemIP16(uint32_t offset)
+{
+    // split if we cross a page boundary mid-read
+    if((offset & 0xFFF) > 0xFFE)
+    {
+        uint8_t lo = readMemIP8(offset);
+        return lo | readMemIP8(offset + 1) << 8;
     }
 
     // usual boundary check
     if(ipPtrBase != offset >> 12)
-    {
-        uint32_t physAddr;
-        if(!getPhysicalAddress(offset, physAddr))
-            return false;
-
-        ipPtr = sys.mapAddress(physAddr) - offset;
-        ipPtrBase = offset >> 12;
-    }
+        mapIPPage(offset);
 
     if(offset + 1 > ipLimit)
-    {
         fault(Fault::GP, 0);
-        return false;
-    }
-
-    data = *reinterpret_cast<const uint16_t *>(ipPtr + offset);
-    return true;
-}
-
-bool CPU::readMemIP16(uint32_t offset, uint32_t &data)
-{
-    uint16_t tmp;
-    if(!readMemIP16(offset, tmp))
-        return false;
 
-    data = tmp;
-    return true;
+    return *reinterpret_cast<const uint16_t *>(ipPtr + offset);
 }
 
-bool CPU::readMemIP32(uint32_t offset, uint32_t &data)
+uint32_t CPU::readMemIP32(uint32_t offset)
 {
     // split if we cross a page boundary mid-read
     if((offset & 0xFFF) > 0xFFC)
     {
-        uint8_t tmp[4];
-
-        if(!readMemIP8(offset    , tmp[0]) || !readMemIP8(offset + 1, tmp[1]) ||
-           !readMemIP8(offset + 2, tmp[2]) || !readMemIP8(offset + 3, tmp[3]))
-        {
-            return false;
-        }
+        uint32_t data = 0;
 
-        data = tmp[0] | tmp[1] << 8 | tmp[2] << 16 | tmp[3] << 24;
+        for(int i = 0; i < 4; i++)
+            data |= uint32_t(readMemIP8(offset + i)) << (i * 8);
 
-        return true;
+        return data;
     }
 
     // usual boundary check
     if(ipPtrBase != offset >> 12)
-    {
-        uint32_t physAddr;
-        if(!getPhysicalAddress(offset, physAddr))
-            return false;
-
-        ipPtr = sys.mapAddress(physAddr) - offset;
-        ipPtrBase = offset >> 12;
-    }
+        mapIPPage(offset);
 
     if(offset + 3 > ipLimit)
-    {
         fault(Fault::GP, 0);
-        return false;
-    }
 
-    data = *reinterpret_cast<const uint32_t *>(ipPtr + offset);
-    return true;
+    return *reinterpret_cast<const uint32_t *>(ipPtr + offset);
 }
 
-bool CPU::getPhysicalAddress(uint32_t virtAddr, uint32_t &physAddr, bool forWrite, bool privileged)
+uint32_t CPU::getPhysicalAddress(uint32_t virtAddr, bool forWrite, bool privileged)
 {
-    // paging not enabled
-    if(!(reg(Reg32::CR0) & (1 << 31)))
-    {
-        physAddr = virtAddr;
-        return true;
-    }
+    auto entry = getTLBEntry(virtAddr, forWrite, privileged);
 
-    auto pageFault = [this](bool protection, bool write, uint32_t virtAddr)
-    {
-        reg(Reg32::CR2) = virtAddr;
-        fault(Fault::PF, (protection ? 1 : 0) | (write ? 2 : 0) | (cpl == 3 ? 4 : 0));
-    };
+    return entry->physAddr | (virtAddr & 0xFFF);
+}
 
+// returns the TLB entry for an access, updating it from the page tables if needed
+// (a page fault doesn't return)
+inline CPU::TLBEntry *CPU::getTLBEntry(uint32_t virtAddr, bool forWrite, bool privileged)
+{
     // user access if CPL 3 and this isn't accessing the GDT/LDT/IDT/TSS
     // supervisor can do whatever it wants
     bool user = cpl == 3 && !privileged;
 
-    // check TLB
-    int set = (virtAddr >> 30) & 3;
-    for(int i = set * 8; i < (set + 1) * 8; i++)
-    {
-        auto &entry = tlb[i];
+    auto &entry = tlb[(virtAddr >> 12) % CPU_TLB_SIZE];
 
-        if((entry.tag >> 12) != (virtAddr >> 12))
-            continue;
-        if(!(entry.tag & Page_Present))
-            continue;
+    if(entry.tag[(forWrite ? TLB_Write : TLB_Read) | (user ? TLB_UserRead : 0)] == ((virtAddr & 0xFFFFF000) | tlbGeneration))
+        return &entry;
 
-        // okay, we have a hit, validate
-        if(user)
-        {
-            // writable
-            if(forWrite && !(entry.tag & Page_Writable))
-            {
-                pageFault(true, forWrite, virtAddr);
-                return false;
-            }
+    return fillTLBEntry(virtAddr, forWrite, user);
+}
 
-            // check user bit
-            if(!(entry.tag & Page_User))
-            {
-                pageFault(true, forWrite, virtAddr);
-                return false;
-            }
-        }
+CPU::TLBEntry *CPU::fillTLBEntry(uint32_t virtAddr, bool forWrite, bool user)
+{
+    uint32_t physAddr = virtAddr;
+    uint32_t pageFlags = Page_Writable | Page_User | Page_Dirty;
 
-        if(forWrite && !(entry.tag & Page_Dirty))
-        {
-            // fail so we can mark the page dirty
-            // also invalidate the entry
-            entry.tag &= ~Page_Present;
-            break;
-        }
+    // paging enabled
+    if(reg(Reg32::CR0) & (1 << 31))
+        physAddr = lookupPageTable(virtAddr, forWrite, user, pageFlags);
 
-        physAddr = entry.data | (virtAddr & 0xFFF);
-        return true;
+    auto &entry = tlb[(virtAddr >> 12) % CPU_TLB_SIZE];
+
+    uint32_t tag = (virtAddr & 0xFFFFF000) | tlbGeneration;
+
+    // writes to pages that aren't dirty yet need to go through lookupPageTable to set the bit
+    bool dirty = pageFlags & Page_Dirty;
+    bool userWrite = (pageFlags & Page_User) && (pageFlags & Page_Writable);
+    bool supervisorWrite = (pageFlags & Page_Writable) || !(reg(Reg32::CR0) & (1 << 16)/*WP*/);
+
+    entry.tag[TLB_Read] = tag;
+    entry.tag[TLB_Write] = dirty && supervisorWrite ? tag : 0;
+    entry.tag[TLB_UserRead] = (pageFlags & Page_User) ? tag : 0;
+    entry.tag[TLB_UserWrite] = dirty && userWrite ? tag : 0;
+
+    entry.physAddr = physAddr & 0xFFFFF000;
+
+    // cache the host pointer if this is regular memory
+    entry.readPtr = sys.mapAddress(entry.physAddr);
+
+#ifdef CPU_BLOCK_CACHE_SIZE
+    bool isCode = sys.isCodePage(entry.physAddr);
+#else
+    bool isCode = false;
+#endif
+
+#ifdef CPU_FPU
+    entry.writePtr = isCode ? nullptr : sys.mapAddressForWrite(entry.physAddr);
+#else
+    // page 0 is excluded for the coprocessor bit hack in System::writeMem16
+    entry.writePtr = isCode || entry.physAddr == 0 ? nullptr : sys.mapAddressForWrite(entry.physAddr);
+#endif
+
+    return &entry;
+}
+
+// stop writing directly to a page that now contains decoded code
+void CPU::setCodePage(uint32_t physAddr)
+{
+#ifdef CPU_BLOCK_CACHE_SIZE
+    if(sys.isCodePage(physAddr))
+        return;
+
+    sys.setCodePage(physAddr);
+
+    for(auto &entry : tlb)
+    {
+        if(entry.physAddr == (physAddr & 0xFFFFF000))
+            entry.writePtr = nullptr;
     }
 
-    return lookupPageTable(virtAddr, physAddr, forWrite, user);
+    stackWindowWritable = false;
+#endif
 }
 
-bool CPU::lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite, bool user)
+uint32_t CPU::lookupPageTable(uint32_t virtAddr, bool forWrite, bool user, uint32_t &pageFlags)
 {
     auto pageFault = [this](bool protection, bool write, uint32_t virtAddr)
     {
@@ -5890,10 +6647,7 @@ bool CPU::lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite,
 
     // not present
     if(!(dirEntry & Page_Present))
-    {
-        pageFault(false, forWrite, virtAddr);
-        return false;
-    }
+        pageFault(false, forWrite, virtAddr);
 
     // page table
     auto pageEntryAddr = (dirEntry & 0xFFFFF000) + page * 4;
@@ -5901,10 +6655,7 @@ bool CPU::lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite,
     uint32_t pageEntry = sys.readMem32(pageEntryAddr);
 
     if(!(pageEntry & Page_Present))
-    {
         pageFault(false, forWrite, virtAddr);
-        return false;
-    }
 
     auto combinedFlags = pageEntry & dirEntry;
     
@@ -5912,17 +6663,16 @@ bool CPU::lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite,
     {
         // writable
         if(forWrite && !(combinedFlags & Page_Writable))
-        {
             pageFault(true, forWrite, virtAddr);
-            return false;
-        }
 
         // check user bit
         if(!(combinedFlags & Page_User))
-        {
             pageFault(true, forWrite, virtAddr);
-            return false;
-        }
+    }
+    else if(forWrite && !(combinedFlags & Page_Writable) && (reg(Reg32::CR0) & (1 << 16)/*WP*/))
+    {
+        // 486 supervisor write protect
+        pageFault(true, forWrite, virtAddr);
     }
 
     // set dir accessed
@@ -5933,27 +6683,55 @@ bool CPU::lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite,
     if(!(pageEntry & Page_Accessed) || (forWrite && !(pageEntry & Page_Dirty)))
         sys.writeMem(pageEntryAddr, pageEntry | Page_Accessed | (forWrite ? Page_Dirty : 0));
 
-    physAddr = (pageEntry & 0xFFFFF000) | (virtAddr & 0xFFF);
-
-    // add to TLB
-    // IDK how we should allocate this so just go around
     // make sure we get the dirty bit
-    int set = (virtAddr >> 30) & 3;
-    tlb[set * 8 + tlbIndex].tag = (virtAddr & 0xFFFFF000) | (combinedFlags & 0xFFF) | (forWrite ? Page_Dirty : 0);
-    tlb[set * 8 + tlbIndex].data = pageEntry & 0xFFFFF000;
-
-    tlbIndex = (tlbIndex + 1) % 8;
+    pageFlags = (combinedFlags & ~Page_Dirty) | ((pageEntry & Page_Dirty) || forWrite ? Page_Dirty : 0);
 
-    return true;
+    return (pageEntry & 0xFFFFF000) | (virtAddr & 0xFFF);
 }
 
 // reads ModR/M, SIB and displacement, returns reg/offset and address of the next byte after the disp
 // addr is the linear address of the ModR/M byte
 CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
 {
-    uint8_t modRM;
-    if(!readMemIP8(addr, modRM))
-        return {Reg16::AX, Reg16::IP, 0}; // the invalid value
+#ifdef CPU_BLOCK_CACHE_SIZE
+    // already decoded
+    if(addr == decodedModRMAddr)
+    {
+        auto op = decodedOp;
+        auto r = static_cast<Reg16>(op->rmReg);
+        auto rmBase = static_cast<Reg16>(op->rmBase);
+
+        endAddr = addr + 1 + op->modRMLength;
+
+        if(static_cast<int>(rmBase) < static_cast<int>(Reg16::IP))
+            return {r, rmBase, 0};
+
+        reg(Reg32::EIP) += op->modRMLength;
+
+        uint32_t memAddr = op->disp;
+
+        if(addressSize32)
+        {
+            if(op->baseReg != 0xFF)
+                memAddr += reg(static_cast<Reg32>(op->baseReg)) << op->baseShift;
+            if(op->indexReg != 0xFF)
+                memAddr += reg(static_cast<Reg32>(op->indexReg)) << op->indexShift;
+        }
+        else
+        {
+            if(op->baseReg != 0xFF)
+                memAddr += reg(static_cast<Reg16>(op->baseReg));
+            if(op->indexReg != 0xFF)
+                memAddr += reg(static_cast<Reg16>(op->indexReg));
+
+            memAddr &= 0xFFFF;
+        }
+
+        return {r, rmBase, memAddr};
+    }
+#endif
+
+    uint8_t modRM = readMemIP8(addr);
 
     auto mod = modRM >> 6;
     auto r = static_cast<Reg16>((modRM >> 3) & 7);
@@ -5982,9 +6760,7 @@ CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
 
                 case 4: // SIB
                 {
-                    uint8_t sib;
-                    if(!readMemIP8(addr++, sib))
-                        return {Reg16::AX, Reg16::IP, 0};
+                    uint8_t sib = readMemIP8(addr++);
 
                     reg(Reg32::EIP)++;
 
@@ -5995,8 +6771,7 @@ CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
                     if(mod == 0 && base == Reg32::EBP)
                     {
                         // disp32 instead of base
-                        if(!readMemIP32(addr, memAddr))
-                            return {Reg16::AX, Reg16::IP, 0};
+                        memAddr = readMemIP32(addr);
 
                         reg(Reg32::EIP) += 4;
                         addr += 4;
@@ -6019,8 +6794,7 @@ CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
                 case 5: // ~the same as 6 for 16-bit
                     if(mod == 0) // direct
                     {
-                        if(!readMemIP32(addr, memAddr))
-                            return {Reg16::AX, Reg16::IP, 0};
+                        memAddr = readMemIP32(addr);
 
                         reg(Reg32::EIP) += 4;
                         addr += 4;
@@ -6061,8 +6835,7 @@ CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
                 case 6:
                     if(mod == 0) // direct
                     {
-                        if(!readMemIP16(addr, memAddr))
-                            return {Reg16::AX, Reg16::IP, 0};
+                        memAddr = readMemIP16(addr);
 
                         reg(Reg32::EIP) += 2;
                         addr += 2;
@@ -6083,9 +6856,7 @@ CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
         // add disp
         if(mod == 1)
         {
-            int32_t disp;
-            if(!readMemIP8(addr++, disp))
-                return {Reg16::AX, Reg16::IP, 0};
+            int32_t disp = int8_t(readMemIP8(addr++));
 
             reg(Reg32::EIP)++;
 
@@ -6095,9 +6866,7 @@ CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
         {
             if(addressSize32) // 32bit
             {
-                uint32_t disp;
-                if(!readMemIP32(addr, disp))
-                    return {Reg16::AX, Reg16::IP, 0};
+                uint32_t disp = readMemIP32(addr);
 
                 reg(Reg32::EIP) += 4;
                 addr += 4;
@@ -6106,9 +6875,7 @@ CPU::RM CPU::readModRM(uint32_t addr, uint32_t &endAddr)
             }
             else //16bit
             {
-                uint16_t disp;
-                if(!readMemIP16(addr, disp))
-                    return {Reg16::AX, Reg16::IP, 0};
+                uint16_t disp = readMemIP16(addr);
 
                 reg(Reg32::EIP) += 2;
                 addr += 2;
@@ -6160,11 +6927,27 @@ CPU::SegmentDescriptor CPU::loadSegmentDescriptor(uint16_t selector)
     else
         addr += gdtBase;
 
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    // the page generation catches writes to the table, and the translation is checked in case it was remapped
+    auto &cached = descriptorCache[(selector >> 2) % CPU_DESCRIPTOR_CACHE_SIZE];
+    uint32_t tag = (selector & ~3) | descriptorCacheGeneration[local ? 1 : 0] << 16;
+
+    if(cached.tag == tag && cached.pageGeneration == sys.getCodePageGeneration(cached.physAddr))
+    {
+        uint32_t physAddr = getPhysicalAddress(addr, false, true);
+
+        if(!sys.getChipset().getA20())
+            physAddr &= ~(1 << 20);
+
+        if(physAddr == cached.physAddr)
+            return cached.desc;
+    }
+#endif
+
     uint8_t descBytes[8];
 
-    // FIXME: a page fault could happen here?
     for(int i = 0; i < 8; i++)
-       readMem8(addr + i, descBytes[i], true);
+       descBytes[i] = readMem8(addr + i, true);
 
     desc.base = descBytes[2]
               | descBytes[3] <<  8
@@ -6184,9 +6967,117 @@ CPU::SegmentDescriptor CPU::loadSegmentDescriptor(uint16_t selector)
         desc.limit |= 0xFFF;
     }
 
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    // only cache descriptors in RAM that don't cross a page
+    uint32_t physAddr;
+    if((addr & 0xFFF) <= 0xFF8 && getDescriptorPhysAddr(addr, physAddr))
+    {
+        // get notified of writes
+        setCodePage(physAddr);
+
+        cached.tag = tag;
+        cached.physAddr = physAddr;
+        cached.pageGeneration = sys.getCodePageGeneration(physAddr);
+        cached.desc = desc;
+    }
+#endif
+
     return desc;
 }
 
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+// physical address of part of a descriptor table, false if it isn't in RAM (and can't be tracked)
+bool CPU::getDescriptorPhysAddr(uint32_t addr, uint32_t &physAddr)
+{
+    physAddr = getPhysicalAddress(addr, false, true);
+
+    if(!sys.getChipset().getA20())
+        physAddr &= ~(1 << 20);
+
+    return physAddr < uint32_t(System::getNumMemoryPages() * System::getMemoryPageSize()) && sys.mapAddress(physAddr);
+}
+#endif
+
+// called when the table base/limit changes, writes to the tables are handled by the page generation
+void CPU::flushDescriptorCache(bool ldtOnly)
+{
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    bool wrapped = ++descriptorCacheGeneration[1] == 0x10000;
+
+    if(!ldtOnly)
+        wrapped = ++descriptorCacheGeneration[0] == 0x10000 || wrapped;
+
+    if(wrapped)
+    {
+        for(auto &entry : descriptorCache)
+            entry.tag = 0;
+
+        descriptorCacheGeneration[0] = descriptorCacheGeneration[1] = 1;
+    }
+#endif
+}
+
+// reads a protected mode interrupt gate, the limit has already been checked
+void CPU::readIDTGate(uint8_t vector, uint32_t &offset, uint16_t &selector, uint8_t &access)
+{
+    auto addr = idtBase + vector * 8;
+
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    // same validation as the GDT/LDT cache
+    auto &cached = idtCache[vector];
+
+    if(cached.tag == idtCacheGeneration && cached.pageGeneration == sys.getCodePageGeneration(cached.physAddr))
+    {
+        uint32_t physAddr = getPhysicalAddress(addr, false, true);
+
+        if(!sys.getChipset().getA20())
+            physAddr &= ~(1 << 20);
+
+        if(physAddr == cached.physAddr)
+        {
+            offset = cached.offset;
+            selector = cached.selector;
+            access = cached.access;
+            return;
+        }
+    }
+#endif
+
+    offset = readMem16(addr, true);
+    offset |= readMem16(addr + 6, true) << 16;
+    selector = readMem16(addr + 2, true);
+    access = readMem8(addr + 5, true);
+
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    uint32_t physAddr;
+    if((addr & 0xFFF) <= 0xFF8 && getDescriptorPhysAddr(addr, physAddr))
+    {
+        setCodePage(physAddr);
+
+        cached.tag = idtCacheGeneration;
+        cached.physAddr = physAddr;
+        cached.pageGeneration = sys.getCodePageGeneration(physAddr);
+        cached.offset = offset;
+        cached.selector = selector;
+        cached.access = access;
+    }
+#endif
+}
+
+// called on LIDT
+void CPU::flushIDTCache()
+{
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    if(++idtCacheGeneration == 0)
+    {
+        for(auto &entry : idtCache)
+            entry.tag = 0;
+
+        idtCacheGeneration = 1;
+    }
+#endif
+}
+
 // if this returns false we faulted
 // gpFault is usually GP, but overridden sometimes when doing TSS-related things
 bool CPU::checkSegmentSelector(Reg16 r, uint16_t value, unsigned cpl, int flags, Fault gpFault)
@@ -6316,6 +7207,10 @@ bool CPU::checkSegmentSelector(Reg16 r, uint16_t value, unsigned cpl, int flags,
 
 bool CPU::setSegmentReg(Reg16 r, uint16_t value, bool checkFaults)
 {
+    // the stack window depends on SS and the CPL
+    if(r == Reg16::SS || r == Reg16::CS)
+        invalidateStackWindow();
+
     if(isProtectedMode() && !(flags & Flag_VM))
     {
         if(checkFaults && !checkSegmentSelector(r, value, cpl))
@@ -6325,10 +7220,16 @@ bool CPU::setSegmentReg(Reg16 r, uint16_t value, bool checkFaults)
         desc = loadSegmentDescriptor(value);
         reg(r) = value;
 
+        updateFlatSegmentFlags(desc);
+
         if(r == Reg16::CS)
         {
             cpl = value & 3;
             codeSizeBit = desc.flags & SD_Size;
+            updateExecuteMode();
+#ifdef CPU_BLOCK_CACHE_SIZE
+            invalidateDecodedBlock();
+#endif
 
             // clamp to 32bit
             if(desc.base + desc.limit < desc.base)
@@ -6345,12 +7246,23 @@ bool CPU::setSegmentReg(Reg16 r, uint16_t value, bool checkFaults)
 
         auto &desc = getCachedSegmentDescriptor(r);
         desc.base = value * 16;
+
+        // v86 mode has a fixed 64k limit
+        if(flags & Flag_VM)
+            desc.flags &= ~(SD_FlatRead | SD_FlatWrite);
+        else
+            updateFlatSegmentFlags(desc);
+
         if(r == Reg16::CS)
         {
             desc.flags &= ~SD_PrivilegeLevel; // clear privilege level
             desc.limit = 0xFFFF;
             codeSizeBit = false;
+            updateExecuteMode();
             ipLimit = desc.base + desc.limit;
+#ifdef CPU_BLOCK_CACHE_SIZE
+            invalidateDecodedBlock();
+#endif
         }
         else if(r == Reg16::SS)
             stackAddrSize32 = false;
@@ -6359,6 +7271,27 @@ bool CPU::setSegmentReg(Reg16 r, uint16_t value, bool checkFaults)
     return true;
 }
 
+// the checks skipped for flat segments must be the same as in checkSegmentAccess
+// (using the protected mode rules here is fine for real mode too, they're only more strict)
+void CPU::updateFlatSegmentFlags(SegmentDescriptor &desc)
+{
+    desc.flags &= ~(SD_FlatRead | SD_FlatWrite);
+
+    if(desc.base != 0 || desc.limit != 0xFFFFFFFF || !(desc.flags & SD_Type))
+        return;
+
+    bool isData = !(desc.flags & SD_Executable);
+
+    // expand-down with a 4G limit can't be accessed at all
+    if(isData && (desc.flags & SD_DirConform))
+        return;
+
+    desc.flags |= SD_FlatRead;
+
+    if(isData && (desc.flags & SD_ReadWrite))
+        desc.flags |= SD_FlatWrite;
+}
+
 bool CPU::setLDT(uint16_t selector)
 {
     if(selector >> 2)
@@ -6381,6 +7314,8 @@ bool CPU::setLDT(uint16_t selector)
         ldtBase = 0;
         ldtLimit = 0;
     }
+
+    flushDescriptorCache(true);
     return true;
 }
 
@@ -6403,8 +7338,16 @@ bool CPU::getTSSStackPointer(int dpl, uint32_t &newSP, uint16_t &newSS)
             return false;
         }
 
-        return readMem32(tsDesc.base + tssAddr + 0, newSP, true)  // ESP[DPL]
-            && readMem16(tsDesc.base + tssAddr + 4, newSS, true); // SS[DPL]
+        if(auto ptr = mapLinearRange(tsDesc.base + tssAddr, 6, false, true))
+        {
+            newSP = *reinterpret_cast<uint32_t *>(ptr);
+            newSS = *reinterpret_cast<uint16_t *>(ptr + 4);
+            return true;
+        }
+
+        newSP = readMem32(tsDesc.base + tssAddr + 0, true); // ESP[DPL]
+        newSS = readMem16(tsDesc.base + tssAddr + 4, true); // SS[DPL]
+        return true;
     }
     else // 16 bit
     {
@@ -6418,12 +7361,13 @@ bool CPU::getTSSStackPointer(int dpl, uint32_t &newSP, uint16_t &newSS)
             return false;
         }
 
-        return readMem16(tsDesc.base + tssAddr + 0, newSP, true)  // SP[DPL]
-            && readMem16(tsDesc.base + tssAddr + 2, newSS, true); // SS[DPL]
+        newSP = readMem16(tsDesc.base + tssAddr + 0, true); // SP[DPL]
+        newSS = readMem16(tsDesc.base + tssAddr + 2, true); // SS[DPL]
+        return true;
     }
 }
 
-bool CPU::checkIOPermission(uint16_t addr)
+bool CPU::checkIOPermission(uint16_t addr, int width)
 {
     // no IO permissions in real mode
     if(!isProtectedMode())
@@ -6443,25 +7387,26 @@ bool CPU::checkIOPermission(uint16_t addr)
 
     if(descType == SD_SysTypeTSS32 || descType == SD_SysTypeBusyTSS32) // 32 bit
     {
-        uint16_t ioMapBase;
-        readMem16(tsDesc.base + 0x66, ioMapBase, true);
+        uint32_t byteAddr = (readTSS8(0x66) | readTSS8(0x67) << 8) + addr / 8;
 
-        uint32_t byteAddr = ioMapBase + addr / 8;
+        // 16/32-bit accesses may need bits from the next byte
+        int bit = addr & 7;
+        int numBytes = bit + width > 8 ? 2 : 1;
 
         // out of bounds
-        if(byteAddr > tsDesc.limit)
+        if(byteAddr + numBytes - 1 > tsDesc.limit)
         {
             fault(Fault::GP, 0);
             return false;
         }
 
-        uint8_t mapByte;
-        readMem8(tsDesc.base + byteAddr, mapByte, true);
+        unsigned map = readTSS8(byteAddr);
 
-        // allowed if bit cleared
-        // TODO: need to check multiple bits for 16/32bit port access
-        bool allowed = !(mapByte & (1 << (addr & 7)));
+        if(numBytes == 2)
+            map |= readTSS8(byteAddr + 1) << 8;
 
+        // allowed if all bits cleared
+        bool allowed = !(map & (((1 << width) - 1) << bit));
 
         if(!allowed)
             fault(Fault::GP, 0);
@@ -6469,9 +7414,43 @@ bool CPU::checkIOPermission(uint16_t addr)
         return allowed;
     }
 
+    // no permission map in a 16-bit TSS
+    fault(Fault::GP, 0);
     return false;
 }
 
+// reads from the current TSS, caching host pointers to its pages
+// (invalidated by TLB flushes or the TSS base changing)
+uint8_t CPU::readTSS8(uint32_t offset)
+{
+    auto tssBase = getSegmentOffset(Reg16::TR);
+
+    if(tssBase != tssPageBase)
+    {
+        for(auto &ptr : tssPagePtrs)
+            ptr = nullptr;
+
+        tssPageBase = tssBase;
+    }
+
+    auto addr = tssBase + offset;
+    unsigned page = ((tssBase & 0xFFF) + offset) >> 12;
+
+    if(page < std::size(tssPagePtrs))
+    {
+        auto &ptr = tssPagePtrs[page];
+
+        if(!ptr)
+            ptr = getTLBEntry(addr, false, true)->readPtr;
+
+        // still null if not RAM
+        if(ptr)
+            return ptr[addr & 0xFFF];
+    }
+
+    return readMem8(addr, true);
+}
+
 bool CPU::checkSegmentLimit(const SegmentDescriptor &desc, uint32_t offset, int width, bool isSS)
 {
     if(flags & Flag_VM)
@@ -6512,6 +7491,10 @@ bool CPU::checkSegmentAccess(Reg16 segment, uint32_t offset, int width, bool wri
 {
     auto &desc = getCachedSegmentDescriptor(segment);
 
+    // flat segments can only fail by wrapping around
+    if((desc.flags & (write ? SD_FlatWrite : SD_FlatRead)) && offset <= 0xFFFFFFFF - (width - 1))
+        return true;
+
     if(!checkSegmentLimit(desc, offset, width, segment == Reg16::SS))
         return false;
 
@@ -6591,13 +7574,14 @@ bool CPU::checkStackSpace(uint32_t sp, const SegmentDescriptor &ssDesc, int word
     // now check for page fault
     sp += ssDesc.base;
 
-    uint32_t temp;
-    if(!getPhysicalAddress(sp, temp, true))
-        return false;
+    getPhysicalAddress(sp, true);
 
     // check again if we crossed a page boundary
     endSP += ssDesc.base;
-    return (endSP >> 12 == sp >> 12) || getPhysicalAddress(endSP, temp, true);
+    if(endSP >> 12 != sp >> 12)
+        getPhysicalAddress(endSP, true);
+
+    return true;
 }
 
 void CPU::validateSegmentsForReturn()
@@ -6623,21 +7607,19 @@ bool CPU::validateLOCKPrefix(uint8_t opcode, uint32_t addr)
     if(opcode == 0x0F)
     {
         // prefixed opcode
-        uint8_t opcode2;
-        if(!readMemIP8(addr + 1, opcode2))
-            return false;
+        uint8_t opcode2 = readMemIP8(addr + 1);
 
-        // only bit testing ops
-        if(opcode2 != 0xAB && opcode2 != 0xB3 && opcode2 != 0xBA && opcode2 != 0xBB)
+        // only bit testing ops (and CMPXCHG/XADD on a 486)
+        bool is486Op = model == Model::i486 && (opcode2 == 0xB0 || opcode2 == 0xB1 || opcode2 == 0xC0 || opcode2 == 0xC1);
+
+        if(opcode2 != 0xAB && opcode2 != 0xB3 && opcode2 != 0xBA && opcode2 != 0xBB && !is486Op)
         {
             fault(Fault::UD);
             return false;
         }
 
         // now we need to check the r/m
-        uint8_t modRM;
-        if(!readMemIP8(addr + 2, modRM))
-            return false; // give up if we faulted early
+        uint8_t modRM = readMemIP8(addr + 2);
 
         // don't allow BT (doesn't write)
         if(opcode2 == 0xBA && ((modRM >> 3) & 7) == 4)
@@ -6672,9 +7654,7 @@ bool CPU::validateLOCKPrefix(uint8_t opcode, uint32_t addr)
     }
 
     // now we need to check the r/m
-    uint8_t modRM;
-    if(!readMemIP8(addr + 1, modRM))
-        return false; // give up if we faulted early
+    uint8_t modRM = readMemIP8(addr + 1);
 
     // not a memory operand, can't lock a register
     if((modRM >> 6) == 3)
@@ -6716,78 +7696,58 @@ bool CPU::isOperandSize32(bool override)
     return codeSizeBit != override;
 }
 
-bool CPU::readRM8(const RM &rm, uint8_t &v)
+uint8_t CPU::readRM8(const RM &rm)
 {
     if(rm.isReg())
-    {
-        v = reg(rm.rmBase8());
-        return true;
-    }
+        return reg(rm.rmBase8());
     else
-        return readMem8(rm.offset, rm.rmBase, v);
+        return readMem8(rm.offset, rm.rmBase);
 }
 
-bool CPU::readRM16(const RM &rm, uint16_t &v)
+uint16_t CPU::readRM16(const RM &rm)
 {
     if(rm.isReg())
-    {
-        v = reg(rm.rmBase16());
-        return true;
-    }
+        return reg(rm.rmBase16());
     else
-        return readMem16(rm.offset, rm.rmBase, v);
+        return readMem16(rm.offset, rm.rmBase);
 }
 
-bool CPU::readRM32(const RM &rm, uint32_t &v)
+uint32_t CPU::readRM32(const RM &rm)
 {
     if(rm.isReg())
-    {
-        v = reg(rm.rmBase32());
-        return true;
-    }
+        return reg(rm.rmBase32());
     else
-        return readMem32(rm.offset, rm.rmBase, v);
+        return readMem32(rm.offset, rm.rmBase);
 }
 
-bool CPU::writeRM8(const RM &rm, uint8_t v)
+void CPU::writeRM8(const RM &rm, uint8_t v)
 {
     if(rm.isReg())
-    {
         reg(rm.rmBase8()) = v;
-        return true;
-    }
     else
-        return writeMem8(rm.offset, rm.rmBase, v);
+        writeMem8(rm.offset, rm.rmBase, v);
 }
 
-bool CPU::writeRM16(const RM &rm, uint16_t v)
+void CPU::writeRM16(const RM &rm, uint16_t v)
 {
     if(rm.isReg())
-    {
         reg(rm.rmBase16()) = v;
-        return true;
-    }
     else
-        return writeMem16(rm.offset, rm.rmBase, v);
+        writeMem16(rm.offset, rm.rmBase, v);
 }
 
-bool CPU::writeRM32(const RM &rm, uint32_t v)
+void CPU::writeRM32(const RM &rm, uint32_t v)
 {
     if(rm.isReg())
-    {
         reg(rm.rmBase32()) = v;
-        return true;
-    }
     else
-        return writeMem32(rm.offset, rm.rmBase, v);
+        writeMem32(rm.offset, rm.rmBase, v);
 }
 
 template <CPU::ALUOp8 op, bool d>
 void CPU::doALU8(uint32_t addr)
 {
     auto rm = readModRM(addr + 1);
-    if(!rm.isValid())
-        return;
 
     reg(Reg32::EIP)++;
 
@@ -6795,8 +7755,7 @@ void CPU::doALU8(uint32_t addr)
 
     if(d)
     {
-        if(!readRM8(rm, src))
-            return;
+        src = readRM8(rm);
 
         dest = reg(rm.reg8());
 
@@ -6806,8 +7765,7 @@ void CPU::doALU8(uint32_t addr)
     {
         src = reg(rm.reg8());
 
-        if(!readRM8(rm, dest))
-            return;
+        dest = readRM8(rm);
 
         writeRM8(rm, op(dest, src, flags));
     }
@@ -6817,8 +7775,6 @@ template <CPU::ALUOp16 op, bool d>
 void CPU::doALU16(uint32_t addr)
 {
     auto rm = readModRM(addr + 1);
-    if(!rm.isValid())
-        return;
 
     reg(Reg32::EIP)++;
 
@@ -6826,8 +7782,7 @@ void CPU::doALU16(uint32_t addr)
 
     if(d)
     {
-        if(!readRM16(rm, src))
-            return;
+        src = readRM16(rm);
 
         dest = reg(rm.reg16());
 
@@ -6837,8 +7792,7 @@ void CPU::doALU16(uint32_t addr)
     {
         src = reg(rm.reg16());
 
-        if(!readRM16(rm, dest))
-            return;
+        dest = readRM16(rm);
 
         writeRM16(rm, op(dest, src, flags));
     }
@@ -6848,8 +7802,6 @@ template <CPU::ALUOp32 op, bool d>
 void CPU::doALU32(uint32_t addr)
 {
     auto rm = readModRM(addr + 1);
-    if(!rm.isValid())
-        return;
 
     reg(Reg32::EIP)++;
 
@@ -6857,8 +7809,7 @@ void CPU::doALU32(uint32_t addr)
 
     if(d)
     {
-        if(!readRM32(rm, src))
-            return;
+        src = readRM32(rm);
 
         dest = reg(rm.reg32());
 
@@ -6868,8 +7819,7 @@ void CPU::doALU32(uint32_t addr)
     {
         src = reg(rm.reg32());
 
-        if(!readRM32(rm, dest))
-            return;
+        dest = readRM32(rm);
 
         writeRM32(rm, op(dest, src, flags));
     }
@@ -6880,8 +7830,7 @@ void CPU::doALU8AImm(uint32_t addr)
 {
     uint8_t imm;
     
-    if(!readMemIP8(addr + 1, imm))
-        return;
+    imm = readMemIP8(addr + 1);
 
     reg(Reg8::AL) = op(reg(Reg8::AL), imm, flags);
 
@@ -6893,8 +7842,7 @@ void CPU::doALU16AImm(uint32_t addr)
 {
     uint16_t imm;
     
-    if(!readMemIP16(addr + 1, imm))
-        return;
+    imm = readMemIP16(addr + 1);
 
     reg(Reg16::AX) = op(reg(Reg16::AX), imm, flags);
 
@@ -6906,8 +7854,7 @@ void CPU::doALU32AImm(uint32_t addr)
 {
     uint32_t imm;
     
-    if(!readMemIP32(addr + 1, imm))
-        return;
+    imm = readMemIP32(addr + 1);
 
     reg(Reg32::EAX) = op(reg(Reg32::EAX), imm, flags);
 
@@ -6951,10 +7898,35 @@ void CPU::doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep)
     if(useSI) srcSeg = getCachedSegmentDescriptor(segment);
     if(useDI) dstSeg = getCachedSegmentDescriptor(Reg16::ES);
 
+    auto updateRegs = [&]()
+    {
+        if(addressSize32)
+        {
+            if(useSI) reg(Reg32::ESI) = si;
+            if(useDI) reg(Reg32::EDI) = di;
+            if(rep) reg(Reg32::ECX) = count;
+        }
+        else
+        {
+            if(useSI) reg(Reg16::SI) = si;
+            if(useDI) reg(Reg16::DI) = di;
+            if(rep) reg(Reg16::CX) = count;
+        }
+    };
+
+    // everything except INS/OUTS can be done in bulk
+    constexpr bool isIO = op == &CPU::doINS8 || op == &CPU::doINS16 || op == &CPU::doINS32
+                       || op == &CPU::doOUTS8 || op == &CPU::doOUTS16 || op == &CPU::doOUTS32;
+
     if(rep)
     {
+        uint32_t startCount = count;
+
         while(count)
         {
+            if(repIterationStart(count == startCount, count, si, di, useSI, useDI, addressSize32))
+                break;
+
             // check limits
             if(useSI && !checkSegmentLimit(srcSeg, si, wordSize, segment == Reg16::SS))
                 break;
@@ -6962,9 +7934,27 @@ void CPU::doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep)
             if(useDI && !checkSegmentLimit(dstSeg, di, wordSize))
                 break;
 
-            // TODO: interrupt
-            if(!(this->*op)(useSI ? si + srcSeg.base : 0, useDI ? di + dstSeg.base : 0))
-                break;
+            if constexpr(!isIO)
+            {
+                int done = doStringOpBulk<op, useSI, useDI, wordSize>(segment, si, di, count, addressSize32);
+
+                if(done)
+                {
+                    if(useSI) si += step * done;
+                    if(useDI) di += step * done;
+
+                    if(!addressSize32)
+                    {
+                        if(useSI) si &= 0xFFFF;
+                        if(useDI) di &= 0xFFFF;
+                    }
+
+                    count -= done;
+                    continue;
+                }
+            }
+
+            (this->*op)(useSI ? si + srcSeg.base : 0, useDI ? di + dstSeg.base : 0);
 
             if(useSI) si += step;
             if(useDI) di += step;
@@ -6977,133 +7967,286 @@ void CPU::doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep)
 
             count--;
         }
-
-        if(addressSize32)
-            reg(Reg32::ECX) = count;
-        else
-            reg(Reg16::CX) = count;
     }
     else
     {
         // the only fault we can get from the op is a page fault
-        if(!(this->*op)(useSI ? si + srcSeg.base : 0, useDI ? di + dstSeg.base : 0))
-            return;
+        (this->*op)(useSI ? si + srcSeg.base : 0, useDI ? di + dstSeg.base : 0);
 
         if(useSI) si += step;
         if(useDI) di += step;
     }
 
-    if(addressSize32)
+    updateRegs();
+}
+
+// finds how many elements (up to count) of a REP string op starting at offset can be accessed directly on host memory
+// stays within the page and the segment limit, the first element must have already passed the limit checks
+// returns the host pointer to the first element, or null with count set to 0 if the per-element path should be used
+template<int wordSize>
+uint8_t *CPU::getStringOpRun(Reg16 segment, uint32_t offset, bool addressSize32, bool write, uint32_t &count)
+{
+    auto &desc = getCachedSegmentDescriptor(segment);
+    bool backwards = flags & Flag_D;
+    uint32_t addrMask = addressSize32 ? 0xFFFFFFFF : 0xFFFF;
+
+    uint32_t linAddr = desc.base + offset;
+    uint32_t pageOffset = linAddr & 0xFFF;
+
+    // element crosses a page
+    if(pageOffset > 0x1000 - wordSize)
+    {
+        count = 0;
+        return nullptr;
+    }
+
+    // don't cross the page or wrap the offset
+    uint64_t maxCount;
+    if(backwards)
+        maxCount = std::min(pageOffset, offset) / wordSize + 1;
+    else
+        maxCount = std::min(uint64_t(0x1000 - pageOffset), uint64_t(addrMask) - offset + 1) / wordSize;
+
+    if(count > maxCount)
+        count = maxCount;
+
+    // lowest/highest byte accessed
+    uint64_t lo = backwards ? offset - (count - 1) * wordSize : offset;
+    uint64_t hi = backwards ? uint64_t(offset) + wordSize - 1 : uint64_t(offset) + count * wordSize - 1;
+
+    bool inLimit;
+    if(flags & Flag_VM)
+        inLimit = hi <= 0xFFFF;
+    else if(!(desc.flags & SD_Executable) && (desc.flags & SD_DirConform)) // expand down
+        inLimit = lo > desc.limit && hi <= addrMask;
+    else
+        inLimit = hi <= desc.limit && hi <= addrMask;
+
+    if(!count || !inLimit)
+    {
+        count = 0;
+        return nullptr;
+    }
+
+    auto entry = getTLBEntry(linAddr, write, false);
+    auto ptr = write ? entry->writePtr : entry->readPtr;
+
+    // MMIO or code
+    if(!ptr)
+    {
+        count = 0;
+        return nullptr;
+    }
+
+    return ptr + pageOffset;
+}
+
+// REP MOVS/STOS/LODS on host memory
+// returns the number of elements done, 0 to use the per-element path
+template<CPU::StringOp op, bool useSI, bool useDI, int wordSize>
+int CPU::doStringOpBulk(Reg16 segment, uint32_t si, uint32_t di, uint32_t count, bool addressSize32)
+{
+    uint8_t *srcPtr = nullptr, *dstPtr = nullptr;
+
+    // same order as the element would be read/written in
+    if(useSI)
+        srcPtr = getStringOpRun<wordSize>(segment, si, addressSize32, false, count);
+
+    if(useDI && count)
+    {
+        busyWaitCount = 0;
+        dstPtr = getStringOpRun<wordSize>(Reg16::ES, di, addressSize32, true, count);
+    }
+
+    if(!count)
+        return 0;
+
+    int bytes = count * wordSize;
+    bool backwards = flags & Flag_D;
+
+    // point to the lowest element
+    if(backwards)
+    {
+        if(useSI) srcPtr -= bytes - wordSize;
+        if(useDI) dstPtr -= bytes - wordSize;
+    }
+
+    if constexpr(useSI && useDI) // MOVS
+    {
+        if(srcPtr + bytes <= dstPtr || dstPtr + bytes <= srcPtr)
+            memcpy(dstPtr, srcPtr, bytes);
+        else if(backwards)
+        {
+            // overlapping, copy in the same order as the CPU would
+            for(int i = bytes - wordSize; i >= 0; i -= wordSize)
+                memmove(dstPtr + i, srcPtr + i, wordSize);
+        }
+        else
+        {
+            for(int i = 0; i < bytes; i += wordSize)
+                memmove(dstPtr + i, srcPtr + i, wordSize);
+        }
+    }
+    else if constexpr(useDI) // STOS
+    {
+        if(wordSize == 1)
+            memset(dstPtr, reg(Reg8::AL), bytes);
+        else
+        {
+            for(int i = 0; i < bytes; i += wordSize)
+                memcpy(dstPtr + i, &reg(Reg32::EAX), wordSize);
+        }
+    }
+    else // LODS, only the last element matters
+    {
+        auto lastPtr = backwards ? srcPtr : srcPtr + bytes - wordSize;
+        memcpy(&reg(Reg32::EAX), lastPtr, wordSize);
+    }
+
+    return count;
+}
+
+// REPE/REPNE CMPS/SCAS on host memory, stops after the first element where the comparison doesn't match repZ
+// returns the number of elements compared, 0 to use the per-element path
+template<class T, bool isCMPS>
+int CPU::doCompareStringBulk(Reg16 segment, uint32_t si, uint32_t di, uint32_t count, bool addressSize32, bool repZ)
+{
+    const int wordSize = sizeof(T);
+    uint8_t *srcPtr = nullptr, *dstPtr = nullptr;
+
+    if(isCMPS)
+    {
+        checkSegmentAccess(segment, si, wordSize, false);
+        srcPtr = getStringOpRun<wordSize>(segment, si, addressSize32, false, count);
+    }
+
+    if(count)
+    {
+        checkSegmentAccess(Reg16::ES, di, wordSize, false);
+        dstPtr = getStringOpRun<wordSize>(Reg16::ES, di, addressSize32, false, count);
+    }
+
+    if(!count)
+        return 0;
+
+    int step = (flags & Flag_D) ? -wordSize : wordSize;
+
+    T src = reg(Reg32::EAX), dest;
+    uint32_t i = 0;
+
+    // REPNE SCASB forwards (strlen/memchr)
+    if(!isCMPS && wordSize == 1 && !repZ && step > 0)
     {
-        if(useSI) reg(Reg32::ESI) = si;
-        if(useDI) reg(Reg32::EDI) = di;
+        auto found = static_cast<uint8_t *>(memchr(dstPtr, src, count));
+        i = found ? found - dstPtr : count - 1;
+        dstPtr += i;
     }
-    else
+
+    while(true)
     {
-        if(useSI) reg(Reg16::SI) = si;
-        if(useDI) reg(Reg16::DI) = di;
+        if(isCMPS)
+            memcpy(&src, srcPtr, wordSize);
+        memcpy(&dest, dstPtr, wordSize);
+
+        i++;
+
+        if((src == dest) != repZ || i == count)
+            break;
+
+        if(isCMPS)
+            srcPtr += step;
+        dstPtr += step;
     }
+
+    doSub(src, dest, flags);
+
+    return i;
 }
 
 // maybe could reduce these with even more templates, but...
-bool CPU::doINS8(uint32_t si, uint32_t di)
+void CPU::doINS8(uint32_t si, uint32_t di)
 {
-    return writeMem8(di, sys.readIOPort(reg(Reg16::DX)));
+    writeMem8(di, sys.readIOPort(reg(Reg16::DX)));
 }
 
-bool CPU::doINS16(uint32_t si, uint32_t di)
+void CPU::doINS16(uint32_t si, uint32_t di)
 {
-    return writeMem16(di, sys.readIOPort16(reg(Reg16::DX)));
+    writeMem16(di, sys.readIOPort16(reg(Reg16::DX)));
 }
 
-bool CPU::doINS32(uint32_t si, uint32_t di)
+void CPU::doINS32(uint32_t si, uint32_t di)
 {
     auto v = sys.readIOPort16(reg(Reg16::DX)) | sys.readIOPort16(reg(Reg16::DX) + 2) << 16;
-    return writeMem32(di, v);
+    writeMem32(di, v);
 }
 
-bool CPU::doOUTS8(uint32_t si, uint32_t di)
+void CPU::doOUTS8(uint32_t si, uint32_t di)
 {
-    uint8_t v;
-    if(!readMem8(si, v))
-        return false;
-
-    sys.writeIOPort(reg(Reg16::DX), v);
-    return true;
+    busyWaitCount = 0;
+    sys.writeIOPort(reg(Reg16::DX), readMem8(si));
 }
 
-bool CPU::doOUTS16(uint32_t si, uint32_t di)
+void CPU::doOUTS16(uint32_t si, uint32_t di)
 {
-    uint16_t v;
-    if(!readMem16(si, v))
-        return false;
-
-    sys.writeIOPort16(reg(Reg16::DX), v);
-
-    return true;
+    busyWaitCount = 0;
+    sys.writeIOPort16(reg(Reg16::DX), readMem16(si));
 }
 
-bool CPU::doOUTS32(uint32_t si, uint32_t di)
+void CPU::doOUTS32(uint32_t si, uint32_t di)
 {
-    uint32_t v;
-    if(!readMem32(si, v))
-        return false;
+    uint32_t v = readMem32(si);
 
+    busyWaitCount = 0;
     sys.writeIOPort16(reg(Reg16::DX), v);
     sys.writeIOPort16(reg(Reg16::DX) + 2, v >> 16);
-
-    return true;
 }
 
-bool CPU::doMOVS8(uint32_t si, uint32_t di)
+void CPU::doMOVS8(uint32_t si, uint32_t di)
 {
-    uint8_t v;
-    return readMem8(si, v) && writeMem8(di, v);
+    writeMem8(di, readMem8(si));
 }
 
-bool CPU::doMOVS16(uint32_t si, uint32_t di)
+void CPU::doMOVS16(uint32_t si, uint32_t di)
 {
-    uint16_t v;
-    return readMem16(si, v) && writeMem16(di, v);
+    writeMem16(di, readMem16(si));
 }
 
-bool CPU::doMOVS32(uint32_t si, uint32_t di)
+void CPU::doMOVS32(uint32_t si, uint32_t di)
 {
-    uint32_t v;
-    return readMem32(si, v) && writeMem32(di, v);
+    writeMem32(di, readMem32(si));
 }
 
-bool CPU::doSTOS8(uint32_t si, uint32_t di)
+void CPU::doSTOS8(uint32_t si, uint32_t di)
 {
-    return writeMem8(di, reg(Reg8::AL));
+    writeMem8(di, reg(Reg8::AL));
 }
 
-bool CPU::doSTOS16(uint32_t si, uint32_t di)
+void CPU::doSTOS16(uint32_t si, uint32_t di)
 {
-    return writeMem16(di, reg(Reg16::AX));
+    writeMem16(di, reg(Reg16::AX));
 }
 
-bool CPU::doSTOS32(uint32_t si, uint32_t di)
+void CPU::doSTOS32(uint32_t si, uint32_t di)
 {
-    return writeMem32(di, reg(Reg32::EAX));
+    writeMem32(di, reg(Reg32::EAX));
 }
 
-bool CPU::doLODS8(uint32_t si, uint32_t di)
+void CPU::doLODS8(uint32_t si, uint32_t di)
 {
-    return readMem8(si, reg(Reg8::AL));
+    reg(Reg8::AL) = readMem8(si);
 }
 
-bool CPU::doLODS16(uint32_t si, uint32_t di)
+void CPU::doLODS16(uint32_t si, uint32_t di)
 {
-    return readMem16(si, reg(Reg16::AX));
+    reg(Reg16::AX) = readMem16(si);
 }
 
-bool CPU::doLODS32(uint32_t si, uint32_t di)
+void CPU::doLODS32(uint32_t si, uint32_t di)
 {
-    return readMem32(si, reg(Reg32::EAX));
+    reg(Reg32::EAX) = readMem32(si);
 }
 
-bool CPU::doPush(uint32_t val, bool op32, bool addr32, bool isSegmentReg)
+void CPU::doPush(uint32_t val, bool op32, bool addr32, bool isSegmentReg)
 {
     uint32_t sp = addr32 ? reg(Reg32::ESP) : reg(Reg16::SP);
     if(sp == 0 && !addr32)
@@ -7111,22 +8254,37 @@ bool CPU::doPush(uint32_t val, bool op32, bool addr32, bool isSegmentReg)
     else
         sp -= op32 ? 4 : 2;
 
+    // pushing a segment register with a 32bit operand size only writes 16 bits
+    bool write32 = op32 && !isSegmentReg;
+
+    if(auto ptr = getStackWindowPtr(sp, write32 ? 4 : 2, true))
+    {
+        busyWaitCount = 0;
+
+        if(write32)
+            *reinterpret_cast<uint32_t *>(ptr) = val;
+        else
+            *reinterpret_cast<uint16_t *>(ptr) = val;
+
+        if(addr32)
+            reg(Reg32::ESP) = sp;
+        else
+            reg(Reg16::SP) = sp;
+
+        return;
+    }
+
     auto &ssDesc = getCachedSegmentDescriptor(Reg16::SS);
 
-    // pushing a segment register with a 32bit operand size only writes 16 bits
-    if(op32 && !isSegmentReg)
+    if(write32)
     {
-        if(!checkSegmentLimit(ssDesc, sp, 4, true))
-            return false;
-        if(!writeMem32(sp + ssDesc.base, val))
-            return false;
+        checkSegmentLimit(ssDesc, sp, 4, true);
+        writeMem32(sp + ssDesc.base, val);
     }
     else
     {
-        if(!checkSegmentLimit(ssDesc, sp, 2, true))
-            return false;
-        if(!writeMem16(sp + ssDesc.base, val))
-            return false;
+        checkSegmentLimit(ssDesc, sp, 2, true);
+        writeMem16(sp + ssDesc.base, val);
     }
 
     if(addr32)
@@ -7134,75 +8292,167 @@ bool CPU::doPush(uint32_t val, bool op32, bool addr32, bool isSegmentReg)
     else
         reg(Reg16::SP) = sp;
 
-    return true;
+    updateStackWindow(sp);
 }
 
-bool CPU::doPop(uint32_t &val, bool op32, bool addr32, bool isSegmentReg)
+// pushes a whole interrupt frame (vals in push order) with one limit check and translation
+void CPU::pushFrame(const uint32_t *vals, int count, uint32_t segmentRegMask, bool op32)
 {
+    int width = op32 ? 4 : 2;
+    uint32_t size = count * width;
     uint32_t sp = stackAddrSize32 ? reg(Reg32::ESP) : reg(Reg16::SP);
 
-    auto &ssDesc = getCachedSegmentDescriptor(Reg16::SS);
+    uint8_t *ptr = nullptr;
+
+    busyWaitCount = 0;
 
-    if(op32 && !isSegmentReg)
+    // 16-bit SP wrapping is left to the slow path
+    if(stackAddrSize32 || sp >= size)
     {
-        if(!checkSegmentLimit(ssDesc, sp, 4, true))
-            return false;
-        if(!readMem32(sp + ssDesc.base, val))
-            return false;
+        sp -= size;
+
+        checkSegmentLimit(getCachedSegmentDescriptor(Reg16::SS), sp, size, true);
+        ptr = mapLinearRange(getSegmentOffset(Reg16::SS) + sp, size, true, false);
     }
-    else
+
+    // crosses a page, MMIO or code
+    if(!ptr)
     {
-        if(!checkSegmentLimit(ssDesc, sp, 2, true))
-            return false;
+        for(int i = 0; i < count; i++)
+            doPush(vals[i], op32, stackAddrSize32, segmentRegMask & (1 << i));
 
-        uint16_t tmp;
-        if(!readMem16(sp + ssDesc.base, tmp))
-            return false;
-        val = tmp;
+        return;
     }
 
-    sp += op32 ? 4 : 2;
+    // first value at the top
+    ptr += size;
+
+    for(int i = 0; i < count; i++)
+    {
+        ptr -= width;
+
+        // pushing a segment register with a 32bit operand size only writes 16 bits
+        if(op32 && !(segmentRegMask & (1 << i)))
+            *reinterpret_cast<uint32_t *>(ptr) = vals[i];
+        else
+            *reinterpret_cast<uint16_t *>(ptr) = vals[i];
+    }
 
     if(stackAddrSize32)
         reg(Reg32::ESP) = sp;
     else
         reg(Reg16::SP) = sp;
-
-    return true;
 }
 
-// sometimes we need to check values (segments) before affecting SP
-// offset is in words, byteOffset is for far RET to outer (with stack adjustment)
-bool CPU::doPeek(uint32_t &val, bool op32, bool addr32, int offset, int byteOffset)
+uint32_t CPU::doPop(bool op32, bool addr32, bool isSegmentReg)
 {
     uint32_t sp = stackAddrSize32 ? reg(Reg32::ESP) : reg(Reg16::SP);
 
-    sp += offset * (op32 ? 4 : 2) + byteOffset;
+    uint32_t val = readStack(sp, op32 && !isSegmentReg);
 
-    if(!stackAddrSize32)
-        sp &= 0xFFFF;
+    sp += op32 ? 4 : 2;
+
+    if(stackAddrSize32)
+        reg(Reg32::ESP) = sp;
+    else
+        reg(Reg16::SP) = sp;
+
+    return val;
+}
+
+// shared by pop/peek
+uint32_t CPU::readStack(uint32_t sp, bool op32)
+{
+    if(auto ptr = getStackWindowPtr(sp, op32 ? 4 : 2, false))
+    {
+        if(op32)
+            return *reinterpret_cast<uint32_t *>(ptr);
+        else
+            return *reinterpret_cast<uint16_t *>(ptr);
+    }
 
     auto &ssDesc = getCachedSegmentDescriptor(Reg16::SS);
+    uint32_t val;
 
     if(op32)
     {
-        if(!checkSegmentLimit(ssDesc, sp, 4, true))
-            return false;
-        if(!readMem32(sp + ssDesc.base, val))
-            return false;
+        checkSegmentLimit(ssDesc, sp, 4, true);
+        val = readMem32(sp + ssDesc.base);
     }
     else
     {
-        if(!checkSegmentLimit(ssDesc, sp, 2, true))
-            return false;
+        checkSegmentLimit(ssDesc, sp, 2, true);
+        val = readMem16(sp + ssDesc.base);
+    }
 
-        uint16_t tmp;
-        if(!readMem16(sp + ssDesc.base, tmp))
-            return false;
-        val = tmp;
+    updateStackWindow(sp);
+
+    return val;
+}
+
+// returns a host pointer if the access is inside the stack window
+inline uint8_t *CPU::getStackWindowPtr(uint32_t sp, int width, bool write)
+{
+    uint32_t offset = sp - stackWindowStart;
+
+    if(offset >= stackWindowSize || stackWindowSize - offset < unsigned(width) || (write && !stackWindowWritable))
+        return nullptr;
+
+    return stackWindowPtr + offset;
+}
+
+// caches a host pointer for the part of the stack segment in the same page as sp
+// called after a slow path stack access, which has filled the TLB entry
+void CPU::updateStackWindow(uint32_t sp)
+{
+    stackWindowSize = 0;
+
+    auto &ssDesc = getCachedSegmentDescriptor(Reg16::SS);
+    uint32_t addr = ssDesc.base + sp;
+
+    auto &entry = tlb[(addr >> 12) % CPU_TLB_SIZE];
+    uint32_t tag = (addr & 0xFFFFF000) | tlbGeneration;
+    int user = cpl == 3 ? TLB_UserRead : 0;
+
+    if(entry.tag[TLB_Read | user] != tag || !entry.readPtr)
+        return;
+
+    // valid offsets, same as checkSegmentLimit
+    int64_t minOffset = 0, maxOffset = ssDesc.limit;
+
+    if(flags & Flag_VM)
+        maxOffset = 0xFFFF;
+    else if(!(ssDesc.flags & SD_Executable) && (ssDesc.flags & SD_DirConform))
+    {
+        minOffset = int64_t(ssDesc.limit) + 1;
+        maxOffset = 0xFFFFFFFF;
     }
 
-    return true;
+    // offsets in this page
+    int64_t start = std::max(int64_t(sp) - (addr & 0xFFF), minOffset);
+    int64_t end = std::min(int64_t(sp) - (addr & 0xFFF) + 0xFFF, maxOffset);
+
+    if(end < start)
+        return;
+
+    stackWindowStart = start;
+    stackWindowSize = end - start + 1;
+    stackWindowPtr = entry.readPtr + (addr & 0xFFF) - (sp - stackWindowStart);
+    stackWindowWritable = entry.writePtr && entry.tag[TLB_Write | user] == tag;
+}
+
+// sometimes we need to check values (segments) before affecting SP
+// offset is in words, byteOffset is for far RET to outer (with stack adjustment)
+uint32_t CPU::doPeek(bool op32, bool addr32, int offset, int byteOffset)
+{
+    uint32_t sp = stackAddrSize32 ? reg(Reg32::ESP) : reg(Reg16::SP);
+
+    sp += offset * (op32 ? 4 : 2) + byteOffset;
+
+    if(!stackAddrSize32)
+        sp &= 0xFFFF;
+
+    return readStack(sp, op32);
 }
 
 void CPU::farCall(uint32_t newCS, uint32_t newIP, uint32_t retAddr, bool operandSize32, bool stackAddress32)
@@ -7317,6 +8567,7 @@ void CPU::farCall(uint32_t newCS, uint32_t newIP, uint32_t retAddr, bool operand
                         // setup new stack
                         getCachedSegmentDescriptor(Reg16::SS) = newSSDesc;
                         reg(Reg16::SS) = newSS;
+                        invalidateStackWindow();
                         stackAddrSize32 = stackAddress32 = newSSDesc.flags & SD_Size;
 
                         if(stackAddress32)
@@ -7341,12 +8592,12 @@ void CPU::farCall(uint32_t newCS, uint32_t newIP, uint32_t retAddr, bool operand
                             uint32_t v = 0;
                             if(is32)
                             {
-                                readMem32(oldSSBase + copySP, v);
+                                v = readMem32(oldSSBase + copySP);
                                 copySP -= 4;
                             }
                             else
                             {
-                                readMem16(oldSSBase + copySP, v);
+                                v = readMem16(oldSSBase + copySP);
                                 copySP -= 2;
                             }
 
@@ -7361,6 +8612,7 @@ void CPU::farCall(uint32_t newCS, uint32_t newIP, uint32_t retAddr, bool operand
 
                         reg(Reg16::CS) = (newDesc.base & 0xFFFC) | newCPL;
                         cpl = newCPL;
+                        invalidateStackWindow();
 
                         getCachedSegmentDescriptor(Reg16::CS) = codeSegDesc;
                         reg(Reg32::EIP) = codeSegOffset;
@@ -7410,6 +8662,20 @@ void CPU::farCall(uint32_t newCS, uint32_t newIP, uint32_t retAddr, bool operand
                     taskSwitch(tssSelector, retAddr, TaskSwitchSource::Call);
                     break;
                 }
+                case SD_SysTypeTSS16:
+                case SD_SysTypeTSS32:
+                {
+                    unsigned dpl = (newDesc.flags & SD_PrivilegeLevel) >> 21;
+
+                    if(dpl < cpl || dpl < rpl)
+                    {
+                        fault(Fault::GP, newCS & ~3);
+                        return;
+                    }
+
+                    taskSwitch(newCS, retAddr, TaskSwitchSource::Call);
+                    break;
+                }
                 default:
                     printf("protected call (sys desc %x)\n", (newDesc.flags & SD_SysType) >> 16);
                     exit(1);
@@ -7470,6 +8736,18 @@ void CPU::farJump(uint32_t newCS, uint32_t newIP, uint32_t retAddr)
 
                     break;
                 }
+                case SD_SysTypeTSS16:
+                case SD_SysTypeTSS32:
+                {
+                    if(dpl < cpl || dpl < rpl)
+                    {
+                        fault(Fault::GP, newCS & ~3);
+                        return;
+                    }
+
+                    taskSwitch(newCS, retAddr, TaskSwitchSource::Jump);
+                    break;
+                }
                 default:
                     printf("jmp gate\n");
                     exit(1);
@@ -7497,10 +8775,9 @@ void CPU::interruptReturn(bool operandSize32)
     };
 
     // copied here until we actually have a function to skip the checks...
-    auto popPreChecked = [this](bool is32, uint32_t &v)
+    auto popPreChecked = [this](bool is32)
     {
-        [[maybe_unused]] bool ok = doPop(v, is32, stackAddrSize32);
-        assert(ok);
+        return doPop(is32, stackAddrSize32);
     };
 
     delayInterrupt = true;
@@ -7510,10 +8787,8 @@ void CPU::interruptReturn(bool operandSize32)
     // need to validate CS BEFORE popping anything...
     if(isProtectedMode() && !(flags & Flag_VM) && !(flags & Flag_NT))
     {
-        if(!doPeek(newCS, operandSize32, stackAddrSize32, 1) || !doPeek(newFlags, operandSize32, stackAddrSize32, 2))
-            return; // whoops stack fault
-
-        uint32_t tmp;
+        newCS = doPeek(operandSize32, stackAddrSize32, 1);
+        newFlags = doPeek(operandSize32, stackAddrSize32, 2);
 
         // not a segment selector if we're switching to virtual-8086 mode
         if(!(newFlags & Flag_VM) && !checkSegmentSelector(Reg16::CS, newCS, newCS & 3))
@@ -7522,31 +8797,29 @@ void CPU::interruptReturn(bool operandSize32)
         {
             // check extra pops
             // IP, CS, FLAGS, SP, SS, ES, DS, FS, GS
-            if(!doPeek(tmp, operandSize32, stackAddrSize32, 8))
-                return;
+            doPeek(operandSize32, stackAddrSize32, 8);
         }
         else if((newCS & 3) > cpl)
         {
             // check extra pops
             // IP, CS, FLAGS, SP, SS
-            if(!doPeek(tmp, operandSize32, stackAddrSize32, 4))
-                return;
+            doPeek(operandSize32, stackAddrSize32, 4);
         }
     }
     // check we can pop the first three anyway, except for task returns, which don't do any
-    else if(!(flags & Flag_NT) && !doPeek(newFlags, operandSize32, stackAddrSize32, 2))
-        return;
+    else if(!(flags & Flag_NT))
+        doPeek(operandSize32, stackAddrSize32, 2);
 
     if(!isProtectedMode()) // real mode
     {
         // pop IP
-        popPreChecked(operandSize32, newIP);
+        newIP = popPreChecked(operandSize32);
 
         // pop CS
-        popPreChecked(operandSize32, newCS);
+        newCS = popPreChecked(operandSize32);
 
         // pop flags
-        popPreChecked(operandSize32, newFlags);
+        newFlags = popPreChecked(operandSize32);
 
         // real mode
         uint32_t flagMask = Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_T | Flag_I | Flag_D | Flag_O | Flag_IOPL | Flag_NT | Flag_R;
@@ -7562,13 +8835,13 @@ void CPU::interruptReturn(bool operandSize32)
         if(iopl == 3)
         {
             // pop IP
-            popPreChecked(operandSize32, newIP);
+            newIP = popPreChecked(operandSize32);
 
             // pop CS
-            popPreChecked(operandSize32, newCS);
+            newCS = popPreChecked(operandSize32);
 
             // pop flags
-            popPreChecked(operandSize32, newFlags);
+            newFlags = popPreChecked(operandSize32);
 
             setSegmentReg(Reg16::CS, newCS);
             setIP(newIP);
@@ -7584,8 +8857,7 @@ void CPU::interruptReturn(bool operandSize32)
     else if(flags & Flag_NT) // task return
     {
         auto &curTSSDesc = getCachedSegmentDescriptor(Reg16::TR);
-        uint16_t prevTSS;
-        readMem16(curTSSDesc.base, prevTSS, true);
+        uint16_t prevTSS = readMem16(curTSSDesc.base, true);
 
         // NULL or local descriptor
         // TODO: also check GDT limit, descriptor type and present
@@ -7601,13 +8873,13 @@ void CPU::interruptReturn(bool operandSize32)
     {
         // we know that these aren't going to fault as we've already read them
         // pop IP
-        popPreChecked(operandSize32, newIP);
+        newIP = popPreChecked(operandSize32);
 
         // pop CS
-        popPreChecked(operandSize32, newCS);
+        newCS = popPreChecked(operandSize32);
 
         // pop flags
-        popPreChecked(operandSize32, newFlags);
+        newFlags = popPreChecked(operandSize32);
 
         unsigned newCSRPL = newCS & 3;
 
@@ -7620,15 +8892,15 @@ void CPU::interruptReturn(bool operandSize32)
 
             // prepare new stack
             uint32_t newESP, newSS;
-            popPreChecked(operandSize32, newESP);
-            popPreChecked(operandSize32, newSS);
+            newESP = popPreChecked(operandSize32);
+            newSS = popPreChecked(operandSize32);
 
             // pop segments
             uint32_t newES, newDS, newFS, newGS;
-            popPreChecked(operandSize32, newES);
-            popPreChecked(operandSize32, newDS);
-            popPreChecked(operandSize32, newFS);
-            popPreChecked(operandSize32, newGS);
+            newES = popPreChecked(operandSize32);
+            newDS = popPreChecked(operandSize32);
+            newFS = popPreChecked(operandSize32);
+            newGS = popPreChecked(operandSize32);
 
             // set new flags and CS (we're now in v86 mode at the new privilege level)
             // I/IOPL are always allowed here as CPL must be 0
@@ -7650,8 +8922,8 @@ void CPU::interruptReturn(bool operandSize32)
         else if(newCSRPL > cpl) // return to outer privilege
         {
             uint32_t newESP, newSS;
-            popPreChecked(operandSize32, newESP);
-            popPreChecked(operandSize32, newSS);
+            newESP = popPreChecked(operandSize32);
+            newSS = popPreChecked(operandSize32);
 
             // flags
             unsigned iopl = (flags & Flag_IOPL) >> 12;
@@ -7699,8 +8971,6 @@ void CPU::interruptReturn(bool operandSize32)
 void CPU::loadFarPointer(uint32_t addr, Reg16 segmentReg, bool operandSize32)
 {
     auto rm = readModRM(addr + 1);
-    if(!rm.isValid())
-        return;
 
     if(rm.isReg())
     {
@@ -7710,18 +8980,18 @@ void CPU::loadFarPointer(uint32_t addr, Reg16 segmentReg, bool operandSize32)
 
     if(operandSize32)
     {
-        uint32_t v;
-        uint16_t segV;
-        if(!readMem32(rm.offset, rm.rmBase, v) || !readMem16(rm.offset + 4, rm.rmBase, segV) || !setSegmentReg(segmentReg, segV))
+        uint32_t v = readMem32(rm.offset, rm.rmBase);
+        uint16_t segV = readMem16(rm.offset + 4, rm.rmBase);
+        if(!setSegmentReg(segmentReg, segV))
             return;
 
         reg(rm.reg32()) = v;
     }
     else
     {
-        uint16_t v;
-        uint16_t segV;
-        if(!readMem16(rm.offset, rm.rmBase, v) || !readMem16(rm.offset + 2, rm.rmBase, segV) || !setSegmentReg(segmentReg, segV))
+        uint16_t v = readMem16(rm.offset, rm.rmBase);
+        uint16_t segV = readMem16(rm.offset + 2, rm.rmBase);
+        if(!setSegmentReg(segmentReg, segV))
             return;
 
         reg(rm.reg16()) = v;
@@ -7754,43 +9024,75 @@ bool CPU::taskSwitch(uint16_t selector, uint32_t retAddr, TaskSwitchSource sourc
         return false;
     }
 
-    // switch tasks
+    bool newTSS32 = sysType == SD_SysTypeTSS32;
+    uint32_t newTSSSize = newTSS32 ? 0x68 : 0x2C;
 
-    if(source == TaskSwitchSource::IntRet)
-        flags &= ~Flag_NT;
+    if(tssDesc.limit < newTSSSize - 1)
+    {
+        fault(Fault::TS, selector & ~3);
+        return false;
+    }
 
-    // save registers to current task
     auto &curTSSDesc = getCachedSegmentDescriptor(Reg16::TR);
 
     int curTSSType = (curTSSDesc.flags & SD_SysType);
 
     assert(!(curTSSDesc.flags & SD_Type));
     assert(curTSSType == SD_SysTypeBusyTSS16 || curTSSType == SD_SysTypeBusyTSS32); // the current TSS should be busy?
-    
-    if(curTSSType == SD_SysTypeBusyTSS32 || curTSSType == SD_SysTypeTSS32 || sysType == SD_SysTypeTSS32)
+
+    bool curTSS32 = curTSSType == SD_SysTypeBusyTSS32 || curTSSType == SD_SysTypeTSS32;
+
+    // the part of the current TSS that gets saved (IP to the last segment)
+    uint32_t saveStart = curTSS32 ? 0x20 : 0x0E;
+    uint32_t saveEnd = curTSS32 ? 0x60 : 0x2A;
+
+    // translate both TSSs first so that page faults happen before anything is modified
+    // the pointers are null if we need to go through the slow path
+    auto curPtr = mapLinearRange(curTSSDesc.base + saveStart, saveEnd - saveStart, true, true);
+    auto newPtr = mapLinearRange(tssDesc.base, newTSSSize, source == TaskSwitchSource::Call, true);
+
+    // switch tasks
+
+    if(source == TaskSwitchSource::IntRet)
+        flags &= ~Flag_NT;
+
+    // save registers to current task
+    uint8_t saveBuf[0x40];
+    auto savePtr = curPtr ? curPtr - saveStart : saveBuf - saveStart;
+
+    if(!curPtr)
     {
-        printf("task switch 32\n");
-        exit(1);
+        for(auto i = saveStart; i < saveEnd; i++)
+            savePtr[i] = readMem8(curTSSDesc.base + i, true);
     }
 
-    if(curTSSType == SD_SysTypeTSS16 || curTSSType == SD_SysTypeBusyTSS16)
+    if(curTSS32)
+    {
+        uint32_t eflags = flags.get();
+        memcpy(savePtr + 0x20, &retAddr, 4);
+        memcpy(savePtr + 0x24, &eflags, 4);
+        memcpy(savePtr + 0x28, regs, 8 * 4); // EAX-EDI are in the same order
+
+        for(int i = 0; i < 6; i++)
+            memcpy(savePtr + 0x48 + i * 4, &reg(static_cast<Reg16>(static_cast<int>(Reg16::ES) + i)), 2);
+    }
+    else
     {
-        writeMem16(curTSSDesc.base + 0x0e, retAddr, true); // IP
-        writeMem16(curTSSDesc.base + 0x10, flags, true);
+        uint16_t ip = retAddr, flags16 = flags.get();
+        memcpy(savePtr + 0x0E, &ip, 2);
+        memcpy(savePtr + 0x10, &flags16, 2);
+
+        for(int i = 0; i < 8; i++)
+            memcpy(savePtr + 0x12 + i * 2, &reg(static_cast<Reg16>(i)), 2);
 
-        writeMem16(curTSSDesc.base + 0x12, reg(Reg16::AX), true);
-        writeMem16(curTSSDesc.base + 0x14, reg(Reg16::CX), true);
-        writeMem16(curTSSDesc.base + 0x16, reg(Reg16::DX), true);
-        writeMem16(curTSSDesc.base + 0x18, reg(Reg16::BX), true);
-        writeMem16(curTSSDesc.base + 0x1a, reg(Reg16::SP), true);
-        writeMem16(curTSSDesc.base + 0x1c, reg(Reg16::BP), true);
-        writeMem16(curTSSDesc.base + 0x1e, reg(Reg16::SI), true);
-        writeMem16(curTSSDesc.base + 0x20, reg(Reg16::DI), true);
+        for(int i = 0; i < 4; i++)
+            memcpy(savePtr + 0x22 + i * 2, &reg(static_cast<Reg16>(static_cast<int>(Reg16::ES) + i)), 2);
+    }
 
-        writeMem16(curTSSDesc.base + 0x22, reg(Reg16::ES), true);
-        writeMem16(curTSSDesc.base + 0x24, reg(Reg16::CS), true);
-        writeMem16(curTSSDesc.base + 0x26, reg(Reg16::SS), true);
-        writeMem16(curTSSDesc.base + 0x28, reg(Reg16::DS), true);
+    if(!curPtr)
+    {
+        for(auto i = saveStart; i < saveEnd; i++)
+            writeMem8(curTSSDesc.base + i, savePtr[i], true);
     }
 
     // save old TR for later
@@ -7800,8 +9102,7 @@ bool CPU::taskSwitch(uint16_t selector, uint32_t retAddr, TaskSwitchSource sourc
     if(source != TaskSwitchSource::IntRet)
     {
         tssDesc.flags |= 2 << 16; // in the cache too
-        auto addr = (selector >> 3) * 8 + gdtBase;
-        writeMem8(addr + 5, tssDesc.flags >> 16, true);
+        writeDescriptorAccess(selector, tssDesc.flags >> 16);
     }
 
     // load new TSS
@@ -7814,44 +9115,90 @@ bool CPU::taskSwitch(uint16_t selector, uint32_t retAddr, TaskSwitchSource sourc
     if(source != TaskSwitchSource::Call)
     {
         auto addr = (oldTR >> 3) * 8 + gdtBase;
-        uint8_t access;
-        readMem8(addr + 5, access, true);
-        writeMem8(addr + 5, access & ~2, true);
+        uint8_t access = readMem8(addr + 5, true);
+        writeDescriptorAccess(oldTR, access & ~2);
+    }
+
+    // copy the new TSS, loading CR3 may change the mapping
+    uint8_t tss[0x68];
+
+    if(newPtr)
+        memcpy(tss, newPtr, newTSSSize);
+    else
+    {
+        for(uint32_t i = 0; i < newTSSSize; i++)
+            tss[i] = readMem8(tssDesc.base + i, true);
+    }
+
+    // set the back-link (same offset/size in 16/32bit TSS)
+    if(source == TaskSwitchSource::Call)
+    {
+        if(newPtr)
+            memcpy(newPtr, &oldTR, 2);
+        else
+            writeMem16(tssDesc.base + 0, oldTR, true);
     }
-    else // otherwise set the back-link (same offset/size in 16/32bit TSS)
-        writeMem16(tssDesc.base + 0, oldTR);
+
+    auto get16 = [&tss](int offset) {uint16_t v; memcpy(&v, tss + offset, 2); return v;};
+    auto get32 = [&tss](int offset) {uint32_t v; memcpy(&v, tss + offset, 4); return v;};
 
     // load registers from new task
-    if(sysType == SD_SysTypeTSS16)
+    // flags before the segments, VM changes how they're loaded
+    uint16_t ldt;
+    uint16_t segs[6];
+    int numSegs;
+
+    if(newTSS32)
     {
-        uint16_t tmp;
-        readMem16(tssDesc.base + 0x10, tmp, true);
-        flags = (flags & 0xFFFF0000) | tmp;
+        if(reg(Reg32::CR0) & (1 << 31)/*PG*/)
+        {
+            reg(Reg32::CR3) = get32(0x1C);
+            flushTLB();
+        }
 
-        readMem16(tssDesc.base + 0x12, reg(Reg16::AX), true);
-        readMem16(tssDesc.base + 0x14, reg(Reg16::CX), true);
-        readMem16(tssDesc.base + 0x16, reg(Reg16::DX), true);
-        readMem16(tssDesc.base + 0x18, reg(Reg16::BX), true);
-        readMem16(tssDesc.base + 0x1a, reg(Reg16::SP), true);
-        readMem16(tssDesc.base + 0x1c, reg(Reg16::BP), true);
-        readMem16(tssDesc.base + 0x1e, reg(Reg16::SI), true);
-        readMem16(tssDesc.base + 0x20, reg(Reg16::DI), true);
+        reg(Reg32::EIP) = get32(0x20);
 
-        readMem16(tssDesc.base + 0x0e, tmp, true);
-        reg(Reg32::EIP) = tmp;
+        uint32_t flagMask = Flag_C | Flag_P | Flag_A | Flag_Z | Flag_S | Flag_T | Flag_I | Flag_D | Flag_O | Flag_IOPL | Flag_NT | Flag_R | Flag_VM;
+        updateFlags(get32(0x24), flagMask, true);
 
+        memcpy(regs, tss + 0x28, 8 * 4);
 
-        // load LDT before the segment selectors so local selectors use the correct table
-        if(!readMem16(tssDesc.base + 0x2a, tmp) || !setLDT(tmp))
-            return false;
+        for(int i = 0; i < 6; i++)
+            segs[i] = get16(0x48 + i * 4);
 
-        if(!readMem16(tssDesc.base + 0x22, tmp, true) || !setSegmentReg(Reg16::ES, tmp))
-            return false;
-        if(!readMem16(tssDesc.base + 0x24, tmp, true) || !setSegmentReg(Reg16::CS, tmp))
-            return false;
-        if(!readMem16(tssDesc.base + 0x26, tmp, true) || !setSegmentReg(Reg16::SS, tmp))
-            return false;
-        if(!readMem16(tssDesc.base + 0x28, tmp, true) || !setSegmentReg(Reg16::DS, tmp))
+        numSegs = 6;
+        ldt = get16(0x60);
+    }
+    else
+    {
+        reg(Reg32::EIP) = get16(0x0E);
+        flags = (flags & 0xFFFF0000) | get16(0x10);
+
+        for(int i = 0; i < 8; i++)
+            reg(static_cast<Reg16>(i)) = get16(0x12 + i * 2);
+
+        for(int i = 0; i < 4; i++)
+            segs[i] = get16(0x22 + i * 2);
+
+        numSegs = 4;
+        ldt = get16(0x2A);
+    }
+
+    // load LDT before the segment selectors so local selectors use the correct table
+    if(!setLDT(ldt))
+        return false;
+
+    // CS first to get the new CPL for the checks
+    if(!setSegmentReg(Reg16::CS, segs[1]))
+        return false;
+
+    if(flags & Flag_VM)
+        cpl = 3;
+
+    for(int i = 0; i < numSegs; i++)
+    {
+        auto r = static_cast<Reg16>(static_cast<int>(Reg16::ES) + i);
+        if(r != Reg16::CS && !setSegmentReg(r, segs[i]))
             return false;
     }
 
@@ -7869,19 +9216,80 @@ bool CPU::taskSwitch(uint16_t selector, uint32_t retAddr, TaskSwitchSource sourc
     return true;
 }
 
-void CPU::serviceInterrupt(uint8_t vector, bool isInt)
+// validates the translation of a range of linear memory for a supervisor access
+// returns the host memory if it's all in one page of RAM, null otherwise
+uint8_t *CPU::mapLinearRange(uint32_t addr, uint32_t len, bool forWrite, bool privileged)
 {
-    auto push = [this](uint32_t val, bool is32)
+    auto entry = getTLBEntry(addr, forWrite, privileged);
+
+    // crosses a page, check the other one too
+    if((addr & 0xFFF) + len > 0x1000)
     {
-        doPush(val, is32, stackAddrSize32);
+        getPhysicalAddress(addr + len - 1, forWrite, privileged);
+        return nullptr;
+    }
+
+    auto ptr = forWrite ? entry->writePtr : entry->readPtr;
+
+    return ptr ? ptr + (addr & 0xFFF) : nullptr;
+}
+
+// writes the access byte of a GDT descriptor (TSS busy bit)
+void CPU::writeDescriptorAccess(uint16_t selector, uint8_t access)
+{
+    auto addr = (selector >> 3) * 8 + gdtBase + 5;
+
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    // the write invalidates the page, but the other cached descriptors in it are still valid
+    uint32_t physAddr;
+    if(getDescriptorPhysAddr(addr, physAddr))
+    {
+        auto oldGen = sys.getCodePageGeneration(physAddr);
+        writeMem8(addr, access, true);
+        auto newGen = sys.getCodePageGeneration(physAddr);
+
+        if(newGen != oldGen)
+        {
+            for(auto &entry : descriptorCache)
+            {
+                if((entry.physAddr >> 12) == (physAddr >> 12) && entry.pageGeneration == oldGen)
+                    entry.pageGeneration = newGen;
+            }
+
+            setCodePage(physAddr);
+        }
+
+        // ... and update this one
+        auto &cached = descriptorCache[(selector >> 2) % CPU_DESCRIPTOR_CACHE_SIZE];
+        if(cached.tag == ((selector & ~7) | descriptorCacheGeneration[0] << 16))
+            cached.desc.flags = (cached.desc.flags & ~(0xFF << 16)) | access << 16;
+
+        return;
+    }
+#endif
+
+    writeMem8(addr, access, true);
+}
+
+void CPU::serviceInterrupt(uint8_t vector, bool isInt, int errorCode)
+{
+    // the frame is collected and written in one go once the new stack is set up
+    uint32_t frame[10];
+    uint32_t frameSegmentRegs = 0;
+    int frameLen = 0;
+
+    auto push = [&frame, &frameLen](uint32_t val)
+    {
+        frame[frameLen++] = val;
     };
 
-    auto pushSeg = [this](uint32_t val, bool is32)
+    auto pushSeg = [&frame, &frameLen, &frameSegmentRegs](uint32_t val)
     {
-        doPush(val, is32, stackAddrSize32, true);
+        frameSegmentRegs |= 1 << frameLen;
+        frame[frameLen++] = val;
     };
 
-    auto tempFlags = flags;
+    auto tempFlags = flags.get();
 
     uint16_t newCS;
     uint32_t newIP;
@@ -7910,19 +9318,11 @@ void CPU::serviceInterrupt(uint8_t vector, bool isInt)
             return;
         }
 
-        addr += idtBase;
-
         uint32_t offset;
-        uint16_t tmp;
         uint16_t selector;
         uint8_t access;
 
-        readMem16(addr, offset, true);
-        readMem16(addr + 6, tmp, true);
-        readMem16(addr + 2, selector, true);
-        readMem8(addr + 5, access, true);
-
-        offset |= tmp << 16;
+        readIDTGate(vector, offset, selector, access);
 
         assert(access & (1 << 7)); // present
 
@@ -7979,10 +9379,10 @@ void CPU::serviceInterrupt(uint8_t vector, bool isInt)
                     reg(Reg16::SP) = newSP;
 
                 // big pile of extra pushes
-                pushSeg(reg(Reg16::GS), true);
-                pushSeg(reg(Reg16::FS), true);
-                pushSeg(reg(Reg16::DS), true);
-                pushSeg(reg(Reg16::ES), true);
+                pushSeg(reg(Reg16::GS));
+                pushSeg(reg(Reg16::FS));
+                pushSeg(reg(Reg16::DS));
+                pushSeg(reg(Reg16::ES));
 
                 // reset segments
                 setSegmentReg(Reg16::GS, 0);
@@ -7990,8 +9390,8 @@ void CPU::serviceInterrupt(uint8_t vector, bool isInt)
                 setSegmentReg(Reg16::DS, 0);
                 setSegmentReg(Reg16::ES, 0);
 
-                pushSeg(tmpSS, true);
-                push(tmpSP, true);
+                pushSeg(tmpSS);
+                push(tmpSP);
 
                 // continue to the usual pushes
                 newCS = selector;
@@ -8022,8 +9422,8 @@ void CPU::serviceInterrupt(uint8_t vector, bool isInt)
                 else
                     reg(Reg16::SP) = newSP;
 
-                push(tmpSS, gate32);
-                push(tmpSP, gate32);
+                push(tmpSS);
+                push(tmpSP);
 
                 // continue to the usual pushes
                 newCS = selector;
@@ -8060,26 +9460,32 @@ void CPU::serviceInterrupt(uint8_t vector, bool isInt)
 
         auto addr = idtBase + vector * 4;
 
-        readMem16(addr, newIP);
-        readMem16(addr + 2, newCS);
+        newIP = readMem16(addr);
+        newCS = readMem16(addr + 2);
 
         push32 = false; //?
         clearFlags |= Flag_I;
     }
 
     // push flags
-    push(tempFlags, push32);
-
-    // clear I/T
-    flags &= ~clearFlags;
+    push(tempFlags);
 
     // inter-segment indirect call
 
     // push CS
-    pushSeg(reg(Reg16::CS), push32);
+    pushSeg(reg(Reg16::CS));
 
     // push IP
-    push(reg(Reg32::EIP), push32);
+    push(reg(Reg32::EIP));
+
+    // exceptions with an error code, only in protected mode
+    if(errorCode >= 0 && isProtectedMode())
+        push(errorCode);
+
+    pushFrame(frame, frameLen, frameSegmentRegs, push32);
+
+    // clear I/T
+    flags &= ~clearFlags;
 
     setSegmentReg(Reg16::CS, newCS);
     reg(Reg32::EIP) = newIP;
@@ -8091,12 +9497,25 @@ void CPU::fault(Fault fault)
 {
     reg(Reg32::EIP) = faultIP; // return address should be at the start of the instruction
     serviceInterrupt(static_cast<int>(fault));
+    leaveInstruction();
 }
 
 void CPU::fault(Fault fault, uint32_t code)
 {
-    this->fault(fault);
-    // might have changed the stack address size
-    if(isProtectedMode())
-        doPush(code, isOperandSize32(false), stackAddrSize32);
+    reg(Reg32::EIP) = faultIP;
+    serviceInterrupt(static_cast<int>(fault), false, code);
+    leaveInstruction();
+}
+
+// abandons the rest of the faulting instruction, unwinding back to run()/executeInstruction()
+void CPU::leaveInstruction()
+{
+    assert(faultJmpBuf);
+
+#ifdef CPU_BLOCK_CACHE_SIZE
+    // CS:EIP has changed
+    invalidateDecodedBlock();
+#endif
+
+    longjmp(*faultJmpBuf, 1);
 }
\ No newline at end of file
@@ -1,21 +1,85 @@
 #pragma once
+#include <csetjmp>
 #include <cstdint>
 #include <tuple>
 
+#include "CPUFlags.h"
 #include "CPUTrace.h"
 
+// number of decoded blocks to cache, not enabled by default on the embedded builds to save RAM
+#if !defined(CPU_BLOCK_CACHE_SIZE) && !defined(PICO_BUILD) && !defined(ESP_BUILD)
+#define CPU_BLOCK_CACHE_SIZE 1024
+#endif
+
+// number of TLB entries, direct-mapped so must be a power of two
+#ifndef CPU_TLB_SIZE
+#if defined(PICO_BUILD) || defined(ESP_BUILD)
+#define CPU_TLB_SIZE 32
+#else
+#define CPU_TLB_SIZE 256
+#endif
+#endif
+
+// number of cached GDT/LDT descriptors, relies on the code page write tracking of the block cache
+// (IDT gates are also cached when this is enabled)
+#if !defined(CPU_DESCRIPTOR_CACHE_SIZE) && defined(CPU_BLOCK_CACHE_SIZE)
+#define CPU_DESCRIPTOR_CACHE_SIZE 256
+#endif
+
+// 387 FPU, not enabled by default on the embedded builds as they don't have fast long doubles
+#if !defined(CPU_FPU) && !defined(PICO_BUILD) && !defined(ESP_BUILD)
+#define CPU_FPU
+#endif
+
+// x86-64 dynamic recompiler for hot blocks, enabled by the ENABLE_JIT cmake option
+#if defined(CPU_JIT) && !defined(CPU_BLOCK_CACHE_SIZE)
+#error "CPU_JIT requires CPU_BLOCK_CACHE_SIZE"
+#endif
+
+#if defined(CPU_DESCRIPTOR_CACHE_SIZE) && !defined(CPU_BLOCK_CACHE_SIZE)
+#error "CPU_DESCRIPTOR_CACHE_SIZE requires CPU_BLOCK_CACHE_SIZE"
+#endif
+
+#if defined(CPU_JIT) && !(defined(__x86_64__) && defined(__linux__))
+#error "CPU_JIT is only supported on x86-64 Linux"
+#endif
+
 class System;
+#ifdef CPU_JIT
+class JITEmitter;
+#endif
 
 class CPU final
 {
 public:
 
+    // 486 adds INVLPG, CMPXCHG, XADD, CPUID and the AC/ID flags and CR0.WP/AM bits
+    enum class Model
+    {
+        i386,
+        i486,
+    };
+
     CPU(System &sys);
+#ifdef CPU_JIT
+    ~CPU();
+#endif
+
+    // takes effect on the next reset
+    void setModel(Model model) {this->model = model;}
+    Model getModel() const {return model;}
 
     void reset();
 
     void run(int ms);
 
+    // waiting for an interrupt, run() returns early when there is nothing to do
+    bool isHalted() const {return halted;}
+
+    // polling a port that won't change before getBusyWaitEndCycle(), run() also returns early for this
+    bool isBusyWaiting() const {return busyWaiting;}
+    uint32_t getBusyWaitEndCycle() const {return busyWaitEndCycle;}
+
     enum class Reg8
     {
         AL = 0,
@@ -86,12 +150,15 @@ public:
     uint32_t reg(Reg32 r) const {return regs[static_cast<int>(r)];}
     uint32_t &reg(Reg32 r) {return regs[static_cast<int>(r)];}
 
-    uint16_t getFlags() const {return flags;}
+    uint16_t getFlags() const {return flags.get();}
     void setFlags(uint16_t flags) {this->flags = flags;}
     void updateFlags(uint32_t newFlags, uint32_t mask, bool is32);
 
     void updateSegmentDescriptorCache();
 
+    // called when the memory map, A20 or paging changes
+    void flushTLB();
+
     void executeInstruction();
 
     // returns CS, IP, virt addr
@@ -99,6 +166,9 @@ public:
 
     void dumpTrace();
 
+    // called by System on writes to a page containing decoded code
+    void invalidateCodePage(uint32_t physAddr);
+
 private:
     enum class Fault
     {
@@ -137,7 +207,6 @@ private:
         Reg16 rmBase; // register if direct, segment if indirect
         uint32_t offset; // indirect displacement
 
-        bool isValid() const {return rmBase != Reg16::IP;}
         bool isReg() const {return static_cast<int>(rmBase) < static_cast<int>(Reg16::IP);}
 
         Reg8  reg8 () const {return static_cast<Reg8 >(reg);}
@@ -160,44 +229,162 @@ private:
         uint32_t limit;
     };
 
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    struct CachedDescriptor
+    {
+        uint32_t tag; // selector (without RPL) | generation << 16
+        uint32_t physAddr; // where it was loaded from
+        uint32_t pageGeneration; // System code page generation when loaded
+        SegmentDescriptor desc;
+    };
+
+    struct CachedGate
+    {
+        uint32_t tag; // IDT generation, 0 if invalid
+        uint32_t physAddr;
+        uint32_t pageGeneration;
+        uint32_t offset;
+        uint16_t selector;
+        uint8_t access;
+    };
+#endif
+
+    // index into TLBEntry::tag
+    enum TLBAccess
+    {
+        TLB_Read = 0,
+        TLB_Write,
+        TLB_UserRead,
+        TLB_UserWrite,
+    };
+
     struct TLBEntry
     {
-        uint32_t tag;
-        uint32_t data;
+        uint32_t tag[4]; // virtual page | generation, for each allowed access type
+        uint32_t physAddr; // page
+        uint8_t *readPtr; // host pointer to the page, null for MMIO
+        uint8_t *writePtr; // ... also null if writes need to go through System (ROM, code pages)
+    };
+
+#ifdef CPU_BLOCK_CACHE_SIZE
+    enum DecodedPrefixes
+    {
+        Prefix_Lock         = 1 << 0,
+        Prefix_Rep          = 1 << 1,
+        Prefix_RepNZ        = 1 << 2,
+        Prefix_OperandSize  = 1 << 3,
+        Prefix_AddressSize  = 1 << 4,
+    };
+
+    // prefixes/opcode/mod r/m for a single instruction
+    struct DecodedOp
+    {
+        uint8_t length; // including prefixes
+        uint8_t opcodeOffset; // number of prefix bytes
+        uint8_t opcode;
+        uint8_t opcode2; // second byte if opcode is 0F
+        uint8_t prefixes;
+        uint8_t segmentOverride;
+        bool fuseJcc; // a CMP/TEST/DEC followed by a Jcc, both are executed together
+
+        uint8_t modRMOffset; // from the opcode, 0 if there isn't one
+        uint8_t modRMLength; // SIB/displacement bytes following the mod r/m byte
+        uint8_t rmReg;
+        uint8_t rmBase; // register if direct, segment if indirect
+
+        // memory operand, offset = base << baseShift + index << indexShift + disp
+        uint8_t baseReg; // 0xFF if none
+        uint8_t indexReg; // 0xFF if none
+        uint8_t baseShift;
+        uint8_t indexShift;
+
+        uint32_t disp;
+        uint32_t imm;
     };
 
+    // a run of sequential instructions within a single physical page
+    struct DecodedBlock
+    {
+        static const int maxOps = 16;
+
+        uint32_t tag; // physical address | code size
+        uint32_t generation; // System code page generation at decode time
+        uint8_t numOps;
+        bool complete; // hit something we can't decode, don't try to extend
+
+#ifdef CPU_JIT
+        uint16_t execCount;
+        uint8_t jitOps; // number of ops covered by jitCode
+        uint8_t jitLength; // ... and their length in bytes
+        void (*jitCode)();
+#endif
+
+        DecodedOp ops[maxOps];
+    };
+#endif
+
+    // instantiated for each combination of CR0.PE and CS size, so the checks fold away
+    template<bool protectedMode, bool codeSize32>
     void doExecuteInstruction();
+    void updateExecuteMode();
     void executeInstruction0F(uint32_t addr, bool operandSize32);
 
-    bool readMem8(uint32_t offset, Reg16 segment, uint8_t &data);
-    bool readMem16(uint32_t offset, Reg16 segment, uint16_t &data);
-    bool readMem32(uint32_t offset, Reg16 segment, uint32_t &data);
-    bool writeMem8(uint32_t offset, Reg16 segment, uint8_t data);
-    bool writeMem16(uint32_t offset, Reg16 segment, uint16_t data);
-    bool writeMem32(uint32_t offset, Reg16 segment, uint32_t data);
+#ifdef CPU_BLOCK_CACHE_SIZE
+    const DecodedOp *getDecodedOp(uint32_t addr);
+    DecodedBlock *lookupBlock(uint32_t addr);
+    bool decodeOp(const uint8_t *ptr, int avail, DecodedOp &op);
+    void executeFusedJcc();
+    void invalidateDecodedBlock() {curBlock = nullptr; blockNextAddr = ~0u;}
+#endif
+
+#ifdef CPU_JIT
+    bool runCompiledBlock(uint32_t addr);
+    void compileBlock(DecodedBlock &block);
+    bool getJITOpInfo(const DecodedOp &op, uint16_t &flagsRead, uint16_t &flagsWritten, bool &endsBlock);
+    void compileOp(JITEmitter &emit, const DecodedOp &op, uint32_t offset, uint16_t liveFlags);
+    void flushCompiledBlocks();
+
+    // called from compiled code
+    static uint32_t jitRead8(CPU *cpu, uint32_t offset, int segment);
+    static uint32_t jitRead16(CPU *cpu, uint32_t offset, int segment);
+    static uint32_t jitRead32(CPU *cpu, uint32_t offset, int segment);
+    static int jitWrite8(CPU *cpu, uint32_t offset, int segment, uint32_t data);
+    static int jitWrite16(CPU *cpu, uint32_t offset, int segment, uint32_t data);
+    static int jitWrite32(CPU *cpu, uint32_t offset, int segment, uint32_t data);
+    static int jitPush(CPU *cpu, uint32_t val, int op32);
+    static uint32_t jitPop(CPU *cpu, int op32);
+    static void jitReturn(CPU *cpu, int op32);
+#endif
+
+    // memory access helpers don't return on a fault, see fault()
+    uint8_t readMem8(uint32_t offset, Reg16 segment);
+    uint16_t readMem16(uint32_t offset, Reg16 segment);
+    uint32_t readMem32(uint32_t offset, Reg16 segment);
+    void writeMem8(uint32_t offset, Reg16 segment, uint8_t data);
+    void writeMem16(uint32_t offset, Reg16 segment, uint16_t data);
+    void writeMem32(uint32_t offset, Reg16 segment, uint32_t data);
 
     // some internal stuff that already has a linear address
-    bool readMem8(uint32_t offset, uint8_t &data, bool privileged = false);
-    bool readMem16(uint32_t offset, uint16_t &data, bool privileged = false);
-    bool readMem32(uint32_t offset, uint32_t &data, bool privileged = false);
-    bool writeMem8(uint32_t offset, uint8_t data, bool privileged = false);
-    bool writeMem16(uint32_t offset, uint16_t data, bool privileged = false);
-    bool writeMem32(uint32_t offset, uint32_t data, bool privileged = false);
+    uint8_t readMem8(uint32_t offset, bool privileged = false);
+    uint16_t readMem16(uint32_t offset, bool privileged = false);
+    uint32_t readMem32(uint32_t offset, bool privileged = false);
+    void writeMem8(uint32_t offset, uint8_t data, bool privileged = false);
+    void writeMem16(uint32_t offset, uint16_t data, bool privileged = false);
+    void writeMem32(uint32_t offset, uint32_t data, bool privileged = false);
 
     // fast path for opcode/immediate fetch
-    bool readMemIP8(uint32_t offset, uint8_t &data);
-    bool readMemIP8(uint32_t offset, int32_t &data); // sign extended
-    bool readMemIP16(uint32_t offset, uint16_t &data);
-    bool readMemIP16(uint32_t offset, uint32_t &data); // zero extended
-    bool readMemIP32(uint32_t offset, uint32_t &data);
+    void mapIPPage(uint32_t offset);
+    uint8_t readMemIP8(uint32_t offset);
+    uint16_t readMemIP16(uint32_t offset);
+    uint32_t readMemIP32(uint32_t offset);
 
-    // extra helpers
-    // getTSSStackPointer uses this one
-    bool readMem16(uint32_t offset, uint32_t &data, bool privileged = false) {uint16_t tmp; if(!readMem16(offset, tmp, privileged)) return false; data = tmp; return true;}
+    uint32_t getPhysicalAddress(uint32_t virtAddr, bool forWrite = false, bool privileged = false);
 
-    bool getPhysicalAddress(uint32_t virtAddr, uint32_t &physAddr, bool forWrite = false, bool privileged = false);
+    TLBEntry *getTLBEntry(uint32_t virtAddr, bool forWrite, bool privileged);
+    TLBEntry *fillTLBEntry(uint32_t virtAddr, bool forWrite, bool user);
+    void setCodePage(uint32_t physAddr);
 
-    bool lookupPageTable(uint32_t virtAddr, uint32_t &physAddr, bool forWrite, bool user);
+    uint32_t lookupPageTable(uint32_t virtAddr, bool forWrite, bool user, uint32_t &pageFlags);
 
     RM readModRM(uint32_t addr, uint32_t &endAddr);
     RM readModRM(uint32_t addr) {uint32_t tmp; return readModRM(addr, tmp);}
@@ -205,15 +392,24 @@ private:
     SegmentDescriptor &getCachedSegmentDescriptor(Reg16 r) {return segmentDescriptorCache[static_cast<int>(r) - static_cast<int>(Reg16::ES)];}
     uint32_t getSegmentOffset(Reg16 r) {return getCachedSegmentDescriptor(r).base;}
     SegmentDescriptor loadSegmentDescriptor(uint16_t selector);
+    void flushDescriptorCache(bool ldtOnly = false);
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    bool getDescriptorPhysAddr(uint32_t addr, uint32_t &physAddr);
+#endif
+    void writeDescriptorAccess(uint16_t selector, uint8_t access);
+    void readIDTGate(uint8_t vector, uint32_t &offset, uint16_t &selector, uint8_t &access);
+    void flushIDTCache();
     bool checkSegmentSelector(Reg16 r, uint16_t value, unsigned cpl, int flags = 0, Fault gpFault = Fault::GP);
     bool setSegmentReg(Reg16 r, uint16_t value, bool checkFaults = true);
+    void updateFlatSegmentFlags(SegmentDescriptor &desc);
 
     bool setLDT(uint16_t selector);
 
     bool getTSSStackPointer(int dpl, uint32_t &newSP, uint16_t &newSS);
 
     // validation/privilege stuff
-    bool checkIOPermission(uint16_t addr);
+    bool checkIOPermission(uint16_t addr, int width = 1);
+    uint8_t readTSS8(uint32_t offset);
     bool checkSegmentLimit(const SegmentDescriptor &desc, uint32_t offset, int width, bool isSS = false);
     bool checkSegmentAccess(Reg16 segment, uint32_t offset, int width, bool write);
 
@@ -228,18 +424,18 @@ private:
     bool isOperandSize32(bool override);
 
     // R/M helpers
-    bool readRM8 (const RM &rm, uint8_t  &v);
-    bool readRM16(const RM &rm, uint16_t &v);
-    bool readRM32(const RM &rm, uint32_t &v);
+    uint8_t  readRM8 (const RM &rm);
+    uint16_t readRM16(const RM &rm);
+    uint32_t readRM32(const RM &rm);
 
-    bool writeRM8 (const RM &rm, uint8_t  v);
-    bool writeRM16(const RM &rm, uint16_t v);
-    bool writeRM32(const RM &rm, uint32_t v);
+    void writeRM8 (const RM &rm, uint8_t  v);
+    void writeRM16(const RM &rm, uint16_t v);
+    void writeRM32(const RM &rm, uint32_t v);
 
     // ALU helpers
-    using ALUOp8 = uint8_t(*)(uint8_t, uint8_t, uint32_t &);
-    using ALUOp16 = uint16_t(*)(uint16_t, uint16_t, uint32_t &);
-    using ALUOp32 = uint32_t(*)(uint32_t, uint32_t, uint32_t &);
+    using ALUOp8 = uint8_t(*)(uint8_t, uint8_t, CPUFlags &);
+    using ALUOp16 = uint16_t(*)(uint16_t, uint16_t, CPUFlags &);
+    using ALUOp32 = uint32_t(*)(uint32_t, uint32_t, CPUFlags &);
 
     template<ALUOp8 op, bool d>
     void doALU8(uint32_t addr);
@@ -256,52 +452,120 @@ private:
     void doALU32AImm(uint32_t addr);
 
     // string ops
-    using StringOp = bool (CPU::*)(uint32_t si, uint32_t di);
+    using StringOp = void (CPU::*)(uint32_t si, uint32_t di);
 
     template<StringOp op, bool useSI, bool useDI, int wordSize>
     void doStringOp(bool addressSize32, Reg16 segmentOverride, bool rep);
 
-    bool doINS8(uint32_t si, uint32_t di);
-    bool doINS16(uint32_t si, uint32_t di);
-    bool doINS32(uint32_t si, uint32_t di);
-
-    bool doOUTS8(uint32_t si, uint32_t di);
-    bool doOUTS16(uint32_t si, uint32_t di);
-    bool doOUTS32(uint32_t si, uint32_t di);
-
-    bool doMOVS8(uint32_t si, uint32_t di);
-    bool doMOVS16(uint32_t si, uint32_t di);
-    bool doMOVS32(uint32_t si, uint32_t di);
-
-    bool doSTOS8(uint32_t si, uint32_t di);
-    bool doSTOS16(uint32_t si, uint32_t di);
-    bool doSTOS32(uint32_t si, uint32_t di);
-
-    bool doLODS8(uint32_t si, uint32_t di);
-    bool doLODS16(uint32_t si, uint32_t di);
-    bool doLODS32(uint32_t si, uint32_t di);
+    // REP fast paths working directly on host memory
+    template<int wordSize>
+    uint8_t *getStringOpRun(Reg16 segment, uint32_t offset, bool addressSize32, bool write, uint32_t &count);
+    template<StringOp op, bool useSI, bool useDI, int wordSize>
+    int doStringOpBulk(Reg16 segment, uint32_t si, uint32_t di, uint32_t count, bool addressSize32);
+    template<class T, bool isCMPS>
+    int doCompareStringBulk(Reg16 segment, uint32_t si, uint32_t di, uint32_t count, bool addressSize32, bool repZ);
+    bool repIterationStart(bool first, uint32_t count, uint32_t si, uint32_t di, bool useSI, bool useDI, bool addressSize32);
+    bool shouldInterruptRep();
+    void sampleHostClock();
+    void checkBusyWait(uint16_t port, uint32_t value);
+    void skipVirtualTime(uint32_t target);
+
+    void doINS8(uint32_t si, uint32_t di);
+    void doINS16(uint32_t si, uint32_t di);
+    void doINS32(uint32_t si, uint32_t di);
+
+    void doOUTS8(uint32_t si, uint32_t di);
+    void doOUTS16(uint32_t si, uint32_t di);
+    void doOUTS32(uint32_t si, uint32_t di);
+
+    void doMOVS8(uint32_t si, uint32_t di);
+    void doMOVS16(uint32_t si, uint32_t di);
+    void doMOVS32(uint32_t si, uint32_t di);
+
+    void doSTOS8(uint32_t si, uint32_t di);
+    void doSTOS16(uint32_t si, uint32_t di);
+    void doSTOS32(uint32_t si, uint32_t di);
+
+    void doLODS8(uint32_t si, uint32_t di);
+    void doLODS16(uint32_t si, uint32_t di);
+    void doLODS32(uint32_t si, uint32_t di);
 
     // misc op helpers
-    bool doPush(uint32_t val, bool op32, bool addr32, bool isSegmentReg = false);
-    bool doPop(uint32_t &val, bool op32, bool addr32, bool isSegmentReg = false);
-    bool doPeek(uint32_t &val, bool op32, bool addr32, int offset, int byteOffset = 0);
+    void doPush(uint32_t val, bool op32, bool addr32, bool isSegmentReg = false);
+    void pushFrame(const uint32_t *vals, int count, uint32_t segmentRegMask, bool op32);
+    uint32_t doPop(bool op32, bool addr32, bool isSegmentReg = false);
+    uint32_t doPeek(bool op32, bool addr32, int offset, int byteOffset = 0);
+    uint32_t readStack(uint32_t sp, bool op32);
+    uint8_t *getStackWindowPtr(uint32_t sp, int width, bool write);
+    void updateStackWindow(uint32_t sp);
+    void invalidateStackWindow() {stackWindowSize = 0;}
     void farCall(uint32_t newCS, uint32_t newIP, uint32_t retAddr, bool operandSize32, bool stackAddress32);
     void farJump(uint32_t newCS, uint32_t newIP, uint32_t retAddr);
     void interruptReturn(bool operandSize32);
     void loadFarPointer(uint32_t addr, Reg16 segmentReg, bool operandSize32);
 
     bool taskSwitch(uint16_t selector, uint32_t retAddr, TaskSwitchSource source);
+    uint8_t *mapLinearRange(uint32_t addr, uint32_t len, bool forWrite, bool privileged);
 
-    void serviceInterrupt(uint8_t vector, bool isInt = false);
+#ifdef CPU_FPU
+    // x87 helpers, see CPUFPU.cpp
+    enum class FPUFormat
+    {
+        Real32,
+        Real64,
+        Real80,
+        Int16,
+        Int32,
+        Int64,
+        BCD,
+    };
 
-    void fault(Fault fault);
-    void fault(Fault fault, uint32_t code);
+    void resetFPU();
+    void executeFPU(uint8_t opcode, uint32_t addr, bool operandSize32);
+    bool executeFPUArith(int op, long double &dest, long double src);
+    void executeFPUMisc(int index);
+    bool checkFPUError();
+    void updateFPUError();
+    bool raiseFPUException(uint16_t exceptions);
+
+    int getFPUTop() const {return (fpuStatus >> 11) & 7;}
+    void setFPUTop(int top) {fpuStatus = (fpuStatus & ~(7 << 11)) | (top & 7) << 11;}
+    long double &fpuST(int i) {return fpuRegs[(getFPUTop() + i) & 7];}
+    bool isFPURegEmpty(int i) const {return ((fpuTag >> (((getFPUTop() + i) & 7) * 2)) & 3) == 3;}
+    void setFPURegEmpty(int i, bool empty);
+
+    bool fpuRead(int i, long double &v);
+    bool fpuPush(long double v);
+    void fpuPop();
+    bool fpuCompare(long double a, long double b, bool unordered);
+
+    void fpuReadMem(FPUFormat format, const RM &rm, long double &v);
+    bool fpuWriteMem(FPUFormat format, const RM &rm, long double v);
+    void fpuReadBytes(const RM &rm, uint8_t *data, int len);
+    void fpuWriteBytes(const RM &rm, const uint8_t *data, int len);
+
+    uint16_t getFPUTagWord();
+    int fpuStoreEnv(uint8_t *data, bool operandSize32);
+    int fpuLoadEnv(const uint8_t *data, bool operandSize32);
+#endif
+
+    void serviceInterrupt(uint8_t vector, bool isInt = false, int errorCode = -1);
+
+    // these don't return, they unwind to the instruction loop
+    [[noreturn]] void fault(Fault fault);
+    [[noreturn]] void fault(Fault fault, uint32_t code);
+    [[noreturn]] void leaveInstruction();
+
+    uint16_t getSignature() const; // DX at reset, CPUID 1 EAX
+    void invalidateTLBEntry(uint32_t virtAddr);
 
     // internal state
 
+    Model model = Model::i386;
+
     // registers
     uint32_t regs[20]; // segment regs are only 16-bit...
-    uint32_t flags;
+    CPUFlags flags;
 
     SegmentDescriptor segmentDescriptorCache[7];
 
@@ -309,8 +573,26 @@ private:
     uint16_t gdtLimit, ldtLimit, idtLimit;
     uint16_t ldtSelector;
 
-    TLBEntry tlb[4 * 8];
-    uint8_t tlbIndex;
+    TLBEntry tlb[CPU_TLB_SIZE];
+    uint32_t tlbGeneration = 1; // in the low bits of the tags, incremented to flush
+
+    // host pointers to the first pages of the TSS, for I/O permission checks
+    uint32_t tssPageBase = 0;
+    const uint8_t *tssPagePtrs[4] = {};
+
+    // host pointer for part of the current stack page, for SS offsets stackWindowStart to + stackWindowSize
+    // invalidated on SS/CPL changes and TLB flushes
+    uint8_t *stackWindowPtr = nullptr;
+    uint32_t stackWindowStart = 0, stackWindowSize = 0;
+    bool stackWindowWritable = false;
+
+#ifdef CPU_DESCRIPTOR_CACHE_SIZE
+    CachedDescriptor descriptorCache[CPU_DESCRIPTOR_CACHE_SIZE];
+    uint32_t descriptorCacheGeneration[2] = {1, 1}; // GDT, LDT
+
+    CachedGate idtCache[256];
+    uint32_t idtCacheGeneration = 1;
+#endif
 
     uint8_t cpl;
 
@@ -319,17 +601,73 @@ private:
     
     bool halted = false;
 
+    // busy-wait detection, the same IN reading the same value in a short loop
+    // with no memory writes or OUTs in between (those reset busyWaitCount)
+    static const int busyWaitMaxLoop = 32; // instructions between reads
+    static const int busyWaitThreshold = 16; // reads before giving up the rest of run()
+
+    uint32_t busyWaitAddr = ~0u; // linear address of the IN
+    uint32_t busyWaitValue;
+    uint16_t busyWaitPort;
+    uint8_t busyWaitCount = 0;
+    uint32_t busyWaitInsns = 0; // since the last read
+    bool busyWaiting = false;
+    uint32_t busyWaitEndCycle;
+
+    using ExecuteFunc = void (CPU::*)();
+    ExecuteFunc executeFunc = &CPU::doExecuteInstruction<false, false>; // for the current mode
+
+    uint32_t runEndCycle = 0; // when the current run() call should return
+
+    // virtual time for the current REP string op, charged between iterations
+    uint32_t repChargedCount = 0; // CX/ECX when last charged
+    uint32_t repIterationCycles = 0;
+
+#ifdef USE_HOST_CLOCK
+    static const unsigned hostClockSampleInterval = 256; // instructions/REP iterations, must be a power of two
+    unsigned hostClockSampleCount = 0;
+#endif
+
+#ifdef CPU_FPU
+    long double fpuRegs[8]; // physical registers, ST(i) is fpuRegs[(top + i) & 7]
+    uint16_t fpuControl, fpuStatus; // TOP is in the status word
+    uint16_t fpuTag; // only valid (0) or empty (3), the rest is calculated when stored
+    uint16_t fpuOpcode; // last non-control instruction and its operand
+    uint16_t fpuIPSel, fpuDPSel;
+    uint32_t fpuIP, fpuDP;
+#endif
+
     Reg16 segmentOverride;
     bool addressSize32;
     bool stackAddrSize32;
     bool codeSizeBit; // used to calculate operand/address size
 
     uint32_t faultIP;
+    std::jmp_buf *faultJmpBuf = nullptr; // set while executing, fault() jumps back here
 
-    uint32_t ipPtrBase = 0; // the top 20 bits of the linear IP that was used to map ipPtr
+    uint32_t ipPtrBase = ~0u; // the top 20 bits of the linear IP that was used to map ipPtr
+    uint32_t ipPhysBase; // ... and the physical address it mapped to
     uint32_t ipLimit; // CS base+limit
     const uint8_t *ipPtr = nullptr;
 
+#ifdef CPU_BLOCK_CACHE_SIZE
+    DecodedBlock blockCache[CPU_BLOCK_CACHE_SIZE];
+    DecodedBlock *curBlock = nullptr;
+    int curBlockOp;
+    uint32_t blockNextAddr = ~0u; // linear address of the next op in curBlock
+
+    uint32_t decodedModRMAddr = ~0u; // set if the current op's mod r/m has been decoded
+    const DecodedOp *decodedOp;
+#endif
+
+#ifdef CPU_JIT
+    static const int jitThreshold = 32; // executions before compiling a block
+
+    uint8_t *jitBuffer = nullptr;
+    uint8_t *jitBufferPtr = nullptr;
+    bool jitDisabled = false; // failed to allocate the buffer
+#endif
+
     // RAM
     System &sys;
 
@@ -0,0 +1,1353 @@
+// x87 floating point unit (387)
+// registers are host long doubles, which are the same 80-bit format on x86 hosts
+// precision control and the rounding mode of arithmetic aren't emulated, RC only applies to integer conversions
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "CPU.h"
+#include "System.h"
+
+#ifdef CPU_FPU
+
+enum FPUStatusFlags
+{
+    FPU_IE = 1 << 0, // invalid operation
+    FPU_DE = 1 << 1, // denormal operand
+    FPU_ZE = 1 << 2, // zero divide
+    FPU_OE = 1 << 3, // overflow
+    FPU_UE = 1 << 4, // underflow
+    FPU_PE = 1 << 5, // precision
+    FPU_SF = 1 << 6, // stack fault
+    FPU_ES = 1 << 7, // error summary
+    FPU_C0 = 1 << 8,
+    FPU_C1 = 1 << 9,
+    FPU_C2 = 1 << 10,
+    FPU_C3 = 1 << 14,
+    FPU_B  = 1 << 15, // busy
+
+    FPU_Exceptions = 0x3F, // also the mask bits in the control word
+    FPU_CondCodes = FPU_C0 | FPU_C1 | FPU_C2 | FPU_C3,
+};
+
+enum FPUControlFlags
+{
+    FPUCtl_RC = 3 << 10, // rounding control
+};
+
+// the "real indefinite" QNaN
+static const long double fpuIndefinite = -std::numeric_limits<long double>::quiet_NaN();
+
+// FSIN/FCOS/FPTAN/FSINCOS leave the operand alone outside of this range
+static const long double fpuTrigLimit = 9223372036854775808.0L; // 2^63
+
+static const long double fpuLN2 = 0.693147180559945309417232121458176568L;
+
+static long double loadExtended(const uint8_t *data)
+{
+    uint64_t mantissa;
+    uint16_t signExp;
+    memcpy(&mantissa, data, 8);
+    memcpy(&signExp, data + 8, 2);
+
+    int exp = signExp & 0x7FFF;
+    long double v;
+
+    if(exp == 0x7FFF)
+        v = (mantissa << 1) ? std::numeric_limits<long double>::quiet_NaN() : std::numeric_limits<long double>::infinity();
+    else
+        v = std::ldexp(static_cast<long double>(mantissa), (exp ? exp : 1) - 16383 - 63); // denormals have the same exponent as 1
+
+    return (signExp & 0x8000) ? -v : v;
+}
+
+static void storeExtended(long double v, uint8_t *data)
+{
+    uint64_t mantissa;
+    uint16_t signExp = std::signbit(v) ? 0x8000 : 0;
+
+    if(std::isnan(v))
+    {
+        mantissa = 0xC000000000000000;
+        signExp |= 0x7FFF;
+    }
+    else if(std::isinf(v))
+    {
+        mantissa = 0x8000000000000000;
+        signExp |= 0x7FFF;
+    }
+    else if(v == 0)
+        mantissa = 0;
+    else
+    {
+        // frexp gives [0.5, 1), which is where the explicit integer bit goes
+        int exp;
+        auto m = std::frexp(std::fabs(v), &exp);
+        exp += 16382;
+
+        if(exp > 0)
+            mantissa = static_cast<uint64_t>(std::ldexp(m, 64));
+        else
+        {
+            mantissa = static_cast<uint64_t>(std::ldexp(m, 63 + exp)); // denormal
+            exp = 0;
+        }
+
+        signExp |= exp;
+    }
+
+    memcpy(data, &mantissa, 8);
+    memcpy(data + 8, &signExp, 2);
+}
+
+static long double loadBCD(const uint8_t *data)
+{
+    uint64_t v = 0;
+    for(int i = 8; i >= 0; i--)
+        v = v * 100 + (data[i] >> 4) * 10 + (data[i] & 0xF);
+
+    return (data[9] & 0x80) ? -static_cast<long double>(v) : v;
+}
+
+static long double roundFPU(long double v, uint16_t control)
+{
+    switch(control & FPUCtl_RC)
+    {
+        case 0 << 10: // nearest (even), assumes the host is in the default mode
+            return std::nearbyint(v);
+        case 1 << 10: // down
+            return std::floor(v);
+        case 2 << 10: // up
+            return std::ceil(v);
+        default: // towards zero
+            return std::trunc(v);
+    }
+}
+
+// false if out of range
+template<class T>
+static bool toInt(long double v, T &out)
+{
+    // min is always a power of two, so this works with doubles too
+    const long double min = std::numeric_limits<T>::min();
+
+    if(!(v >= min && v < -min))
+        return false;
+
+    out = static_cast<T>(v);
+    return true;
+}
+
+void CPU::resetFPU()
+{
+    fpuControl = 0x37F;
+    fpuStatus = 0;
+    fpuTag = 0xFFFF;
+    fpuOpcode = 0;
+    fpuIPSel = fpuDPSel = 0;
+    fpuIP = fpuDP = 0;
+}
+
+void CPU::executeFPU(uint8_t opcode, uint32_t addr, bool operandSize32)
+{
+    uint8_t modRM = readMemIP8(addr + 1);
+
+    auto rm = readModRM(addr + 1);
+
+    reg(Reg32::EIP)++;
+
+    int op = rm.op();
+    int i = modRM & 7; // ST(i) for register forms
+    bool isReg = rm.isReg();
+
+    // control instructions don't check for errors or update the instruction/operand pointers
+    bool isControl;
+    if(isReg)
+        isControl = (opcode == 0xDB && (modRM & 0xF8) == 0xE0) || (opcode == 0xDF && modRM == 0xE0);
+    else
+        isControl = (opcode == 0xD9 && op >= 4) || (opcode == 0xDD && op >= 4);
+
+    if(!isControl)
+    {
+        if(!checkFPUError())
+            return;
+
+        fpuIP = faultIP;
+        fpuIPSel = reg(Reg16::CS);
+        fpuOpcode = (opcode & 7) << 8 | modRM;
+
+        if(!isReg)
+        {
+            fpuDP = rm.offset;
+            fpuDPSel = reg(rm.rmBase);
+        }
+    }
+
+    // FLD/FILD/FBLD
+    auto load = [this, &rm](FPUFormat format)
+    {
+        long double v;
+        fpuReadMem(format, rm, v);
+        fpuPush(v);
+    };
+
+    // FST/FIST/FBSTP (+P)
+    auto store = [this, &rm](FPUFormat format, bool pop)
+    {
+        long double v;
+        if(fpuRead(0, v) && fpuWriteMem(format, rm, v) && pop)
+            fpuPop();
+    };
+
+    // FST/FSTP ST(i)
+    auto storeReg = [this](int i, bool pop)
+    {
+        long double v;
+        if(!fpuRead(0, v))
+            return;
+
+        fpuST(i) = v;
+        setFPURegEmpty(i, false);
+
+        if(pop)
+            fpuPop();
+    };
+
+    auto exchange = [this](int i)
+    {
+        long double a, b;
+        if(!fpuRead(0, a) || !fpuRead(i, b))
+            return;
+
+        fpuST(0) = b;
+        fpuST(i) = a;
+        setFPURegEmpty(0, false);
+        setFPURegEmpty(i, false);
+        fpuStatus &= ~FPU_C1;
+    };
+
+    auto compare = [this](int i, bool unordered, int pops)
+    {
+        long double a, b;
+        if(!fpuRead(0, a) || !fpuRead(i, b) || !fpuCompare(a, b, unordered))
+            return;
+
+        while(pops--)
+            fpuPop();
+    };
+
+    switch(opcode)
+    {
+        case 0xD8: // arithmetic ST(0) = ST(0) op m32real/ST(i)
+        case 0xDA: // ... m32int
+        case 0xDC: // ... m64real, or ST(i) = ST(i) op ST(0)
+        case 0xDE: // ... m16int, or ST(i) = ST(i) op ST(0) and pop
+        {
+            if(!isReg)
+            {
+                FPUFormat format;
+                if(opcode == 0xD8)
+                    format = FPUFormat::Real32;
+                else if(opcode == 0xDA)
+                    format = FPUFormat::Int32;
+                else if(opcode == 0xDC)
+                    format = FPUFormat::Real64;
+                else
+                    format = FPUFormat::Int16;
+
+                long double src, st0;
+                fpuReadMem(format, rm, src);
+
+                if(!fpuRead(0, st0))
+                    break;
+
+                if(op == 2 || op == 3) // FCOM/FCOMP
+                {
+                    if(fpuCompare(st0, src, false) && op == 3)
+                        fpuPop();
+                }
+                else if(executeFPUArith(op, st0, src))
+                {
+                    fpuST(0) = st0;
+                    setFPURegEmpty(0, false);
+                }
+                break;
+            }
+
+            if(opcode == 0xDA)
+            {
+                if(modRM == 0xE9) // FUCOMPP
+                    compare(1, true, 2);
+                else
+                    fault(Fault::UD);
+                break;
+            }
+
+            if(opcode == 0xDE && op == 3)
+            {
+                if(i == 1) // FCOMPP
+                    compare(1, false, 2);
+                else
+                    fault(Fault::UD);
+                break;
+            }
+
+            if(op == 2 || op == 3) // FCOM/FCOMP (DC/DE are aliases)
+            {
+                compare(i, false, op == 3 || opcode == 0xDE ? 1 : 0);
+                break;
+            }
+
+            long double st0, sti;
+            if(!fpuRead(0, st0) || !fpuRead(i, sti))
+                break;
+
+            if(opcode == 0xD8)
+            {
+                if(executeFPUArith(op, st0, sti))
+                {
+                    fpuST(0) = st0;
+                    setFPURegEmpty(0, false);
+                }
+            }
+            else
+            {
+                // the destination is ST(i), which also swaps SUB/SUBR and DIV/DIVR
+                if(executeFPUArith(op >= 4 ? op ^ 1 : op, sti, st0))
+                {
+                    fpuST(i) = sti;
+                    setFPURegEmpty(i, false);
+
+                    if(opcode == 0xDE)
+                        fpuPop();
+                }
+            }
+            break;
+        }
+
+        case 0xD9:
+        {
+            if(isReg)
+            {
+                switch(op)
+                {
+                    case 0: // FLD ST(i)
+                    {
+                        long double v;
+                        if(fpuRead(i, v))
+                            fpuPush(v);
+                        break;
+                    }
+                    case 1: // FXCH
+                        exchange(i);
+                        break;
+                    case 2: // FNOP
+                        if(i != 0)
+                            fault(Fault::UD);
+                        break;
+                    case 3: // FSTP1 (undocumented alias)
+                        storeReg(i, true);
+                        break;
+                    default:
+                        executeFPUMisc(modRM & 0x1F);
+                        break;
+                }
+                break;
+            }
+
+            switch(op)
+            {
+                case 0: // FLD m32real
+                    load(FPUFormat::Real32);
+                    break;
+                case 2: // FST m32real
+                case 3: // FSTP m32real
+                    store(FPUFormat::Real32, op == 3);
+                    break;
+                case 4: // FLDENV
+                {
+                    uint8_t data[28];
+                    fpuReadBytes(rm, data, operandSize32 ? 28 : 14);
+                    fpuLoadEnv(data, operandSize32);
+                    break;
+                }
+                case 5: // FLDCW
+                {
+                    uint16_t v = readMem16(rm.offset, rm.rmBase);
+
+                    fpuControl = v;
+                    updateFPUError(); // might have unmasked something
+                    break;
+                }
+                case 6: // FNSTENV
+                {
+                    uint8_t data[28];
+                    int len = fpuStoreEnv(data, operandSize32);
+                    fpuWriteBytes(rm, data, len);
+                    fpuControl |= FPU_Exceptions;
+                    break;
+                }
+                case 7: // FNSTCW
+                    writeMem16(rm.offset, rm.rmBase, fpuControl);
+                    break;
+                default:
+                    fault(Fault::UD);
+            }
+            break;
+        }
+
+        case 0xDB:
+        {
+            if(isReg)
+            {
+                switch(modRM)
+                {
+                    case 0xE0: // FENI (8087)
+                    case 0xE1: // FDISI (8087)
+                    case 0xE4: // FSETPM (287)
+                        break;
+                    case 0xE2: // FNCLEX
+                        fpuStatus &= ~(FPU_Exceptions | FPU_SF | FPU_ES | FPU_B);
+                        break;
+                    case 0xE3: // FNINIT
+                        resetFPU();
+                        break;
+                    default:
+                        fault(Fault::UD);
+                }
+                break;
+            }
+
+            switch(op)
+            {
+                case 0: // FILD m32int
+                    load(FPUFormat::Int32);
+                    break;
+                case 2: // FIST m32int
+                case 3: // FISTP m32int
+                    store(FPUFormat::Int32, op == 3);
+                    break;
+                case 5: // FLD m80real
+                    load(FPUFormat::Real80);
+                    break;
+                case 7: // FSTP m80real
+                    store(FPUFormat::Real80, true);
+                    break;
+                default:
+                    fault(Fault::UD);
+            }
+            break;
+        }
+
+        case 0xDD:
+        {
+            if(isReg)
+            {
+                switch(op)
+                {
+                    case 0: // FFREE
+                        setFPURegEmpty(i, true);
+                        break;
+                    case 1: // FXCH4 (undocumented alias)
+                        exchange(i);
+                        break;
+                    case 2: // FST ST(i)
+                    case 3: // FSTP ST(i)
+                        storeReg(i, op == 3);
+                        break;
+                    case 4: // FUCOM
+                    case 5: // FUCOMP
+                        compare(i, true, op == 5 ? 1 : 0);
+                        break;
+                    default:
+                        fault(Fault::UD);
+                }
+                break;
+            }
+
+            switch(op)
+            {
+                case 0: // FLD m64real
+                    load(FPUFormat::Real64);
+                    break;
+                case 2: // FST m64real
+                case 3: // FSTP m64real
+                    store(FPUFormat::Real64, op == 3);
+                    break;
+                case 4: // FRSTOR
+                {
+                    uint8_t data[108];
+                    int envLen = operandSize32 ? 28 : 14;
+
+                    fpuReadBytes(rm, data, envLen + 80);
+                    fpuLoadEnv(data, operandSize32);
+
+                    for(int r = 0; r < 8; r++)
+                        fpuST(r) = loadExtended(data + envLen + r * 10);
+                    break;
+                }
+                case 6: // FNSAVE
+                {
+                    uint8_t data[108];
+                    int envLen = fpuStoreEnv(data, operandSize32);
+
+                    for(int r = 0; r < 8; r++)
+                        storeExtended(fpuST(r), data + envLen + r * 10);
+
+                    fpuWriteBytes(rm, data, envLen + 80);
+                    resetFPU();
+                    break;
+                }
+                case 7: // FNSTSW m16
+                    writeMem16(rm.offset, rm.rmBase, fpuStatus);
+                    break;
+                default:
+                    fault(Fault::UD);
+            }
+            break;
+        }
+
+        case 0xDF:
+        {
+            if(isReg)
+            {
+                switch(op)
+                {
+                    case 0: // FFREEP (undocumented)
+                        setFPURegEmpty(i, true);
+                        fpuPop();
+                        break;
+                    case 1: // FXCH7 (undocumented alias)
+                        exchange(i);
+                        break;
+                    case 2: // FSTP8/9 (undocumented aliases)
+                    case 3:
+                        storeReg(i, true);
+                        break;
+                    case 4:
+                        if(i == 0) // FNSTSW AX
+                        {
+                            reg(Reg16::AX) = fpuStatus;
+                            break;
+                        }
+                        [[fallthrough]];
+                    default:
+                        fault(Fault::UD);
+                }
+                break;
+            }
+
+            switch(op)
+            {
+                case 0: // FILD m16int
+                    load(FPUFormat::Int16);
+                    break;
+                case 2: // FIST m16int
+                case 3: // FISTP m16int
+                    store(FPUFormat::Int16, op == 3);
+                    break;
+                case 4: // FBLD
+                    load(FPUFormat::BCD);
+                    break;
+                case 5: // FILD m64int
+                    load(FPUFormat::Int64);
+                    break;
+                case 6: // FBSTP
+                    store(FPUFormat::BCD, true);
+                    break;
+                case 7: // FISTP m64int
+                    store(FPUFormat::Int64, true);
+                    break;
+                default:
+                    fault(Fault::UD);
+            }
+            break;
+        }
+    }
+}
+
+// dest = dest op src, op is the usual D8 reg field (but not the compares)
+// returns false if there was an unmasked exception and the result shouldn't be stored
+bool CPU::executeFPUArith(int op, long double &dest, long double src)
+{
+    long double res;
+    uint16_t exceptions = 0;
+
+    switch(op)
+    {
+        case 0: // FADD
+            res = dest + src;
+            break;
+        case 1: // FMUL
+            res = dest * src;
+            break;
+        case 4: // FSUB
+            res = dest - src;
+            break;
+        case 5: // FSUBR
+            res = src - dest;
+            break;
+        default: // FDIV/FDIVR
+        {
+            auto dividend = op == 6 ? dest : src;
+            auto divisor = op == 6 ? src : dest;
+
+            // 0/0 is invalid instead
+            if(divisor == 0 && dividend != 0 && std::isfinite(dividend))
+                exceptions |= FPU_ZE;
+
+            res = dividend / divisor;
+            break;
+        }
+    }
+
+    if(std::isnan(res) && !std::isnan(dest) && !std::isnan(src))
+        exceptions |= FPU_IE; // inf - inf, 0 * inf, 0 / 0...
+    else if(std::isinf(res) && std::isfinite(dest) && std::isfinite(src) && !(exceptions & FPU_ZE))
+        exceptions |= FPU_OE | FPU_PE;
+    else if(res != 0 && std::fabs(res) < std::numeric_limits<long double>::min())
+        exceptions |= FPU_UE | FPU_PE;
+
+    if(exceptions && !raiseFPUException(exceptions))
+        return false;
+
+    dest = res;
+    return true;
+}
+
+// D9 E0-FF
+void CPU::executeFPUMisc(int index)
+{
+    // a NaN from non-NaN operands is invalid
+    auto setResult = [this](int i, long double res, long double a, long double b = 0)
+    {
+        if(std::isnan(res) && !std::isnan(a) && !std::isnan(b) && !raiseFPUException(FPU_IE))
+            return false;
+
+        fpuST(i) = res;
+        setFPURegEmpty(i, false);
+        return true;
+    };
+
+    // C2 is set if the operand is out of range
+    auto checkTrigRange = [this](long double v)
+    {
+        if(std::fabs(v) < fpuTrigLimit || std::isnan(v) || std::isinf(v))
+        {
+            fpuStatus &= ~FPU_C2;
+            return true;
+        }
+
+        fpuStatus |= FPU_C2;
+        return false;
+    };
+
+    long double v, v1;
+
+    switch(index)
+    {
+        case 0x00: // FCHS
+        case 0x01: // FABS
+            if(fpuRead(0, v))
+            {
+                fpuST(0) = index == 0 ? -v : std::fabs(v);
+                setFPURegEmpty(0, false);
+                fpuStatus &= ~FPU_C1;
+            }
+            break;
+
+        case 0x04: // FTST
+            if(fpuRead(0, v))
+                fpuCompare(v, 0.0L, false);
+            break;
+
+        case 0x05: // FXAM
+        {
+            v = fpuST(0);
+            fpuStatus &= ~FPU_CondCodes;
+
+            if(std::signbit(v))
+                fpuStatus |= FPU_C1;
+
+            if(isFPURegEmpty(0))
+                fpuStatus |= FPU_C3 | FPU_C0;
+            else
+            {
+                switch(std::fpclassify(v))
+                {
+                    case FP_NAN:
+                        fpuStatus |= FPU_C0;
+                        break;
+                    case FP_INFINITE:
+                        fpuStatus |= FPU_C2 | FPU_C0;
+                        break;
+                    case FP_ZERO:
+                        fpuStatus |= FPU_C3;
+                        break;
+                    case FP_SUBNORMAL:
+                        fpuStatus |= FPU_C3 | FPU_C2;
+                        break;
+                    default: // normal
+                        fpuStatus |= FPU_C2;
+                }
+            }
+            break;
+        }
+
+        case 0x08: // FLD1
+            fpuPush(1.0L);
+            break;
+        case 0x09: // FLDL2T
+            fpuPush(3.321928094887362347870319429489390175L);
+            break;
+        case 0x0A: // FLDL2E
+            fpuPush(1.442695040888963407359924681001892137L);
+            break;
+        case 0x0B: // FLDPI
+            fpuPush(3.141592653589793238462643383279502884L);
+            break;
+        case 0x0C: // FLDLG2
+            fpuPush(0.301029995663981195213738894724493026L);
+            break;
+        case 0x0D: // FLDLN2
+            fpuPush(fpuLN2);
+            break;
+        case 0x0E: // FLDZ
+            fpuPush(0.0L);
+            break;
+
+        case 0x10: // F2XM1
+            if(fpuRead(0, v))
+                setResult(0, std::expm1(v * fpuLN2), v);
+            break;
+
+        case 0x11: // FYL2X
+        case 0x19: // FYL2XP1
+        {
+            if(!fpuRead(0, v) || !fpuRead(1, v1))
+                break;
+
+            if(index == 0x11 && v == 0 && v1 != 0 && std::isfinite(v1) && !raiseFPUException(FPU_ZE))
+                break;
+
+            auto res = index == 0x11 ? v1 * std::log2(v) : v1 * (std::log1p(v) / fpuLN2);
+
+            if(setResult(1, res, v, v1))
+                fpuPop();
+            break;
+        }
+
+        case 0x12: // FPTAN
+            if(fpuRead(0, v) && checkTrigRange(v) && setResult(0, std::tan(v), v))
+                fpuPush(1.0L);
+            break;
+
+        case 0x13: // FPATAN
+            if(fpuRead(0, v) && fpuRead(1, v1) && setResult(1, std::atan2(v1, v), v, v1))
+                fpuPop();
+            break;
+
+        case 0x14: // FXTRACT
+        {
+            if(!fpuRead(0, v))
+                break;
+
+            long double exponent, significand = v;
+
+            if(v == 0)
+            {
+                if(!raiseFPUException(FPU_ZE))
+                    break;
+                exponent = -std::numeric_limits<long double>::infinity();
+            }
+            else if(std::isinf(v))
+                exponent = std::numeric_limits<long double>::infinity();
+            else if(std::isnan(v))
+                exponent = v;
+            else
+            {
+                int exp;
+                significand = std::frexp(v, &exp) * 2;
+                exponent = exp - 1;
+            }
+
+            fpuST(0) = exponent;
+            setFPURegEmpty(0, false);
+            fpuPush(significand);
+            break;
+        }
+
+        case 0x15: // FPREM1
+        case 0x18: // FPREM
+        {
+            if(!fpuRead(0, v) || !fpuRead(1, v1))
+                break;
+
+            // always calculates the complete remainder, so C2 (incomplete) is never set
+            long double res;
+            int quotient;
+
+            if(index == 0x15)
+                res = std::remquo(v, v1, &quotient); // rounds to nearest
+            else
+            {
+                res = std::fmod(v, v1);
+                quotient = std::isfinite(res) ? static_cast<int>(std::fmod(std::fabs(std::trunc((v - res) / v1)), 8.0L)) : 0;
+            }
+
+            if(!setResult(0, res, v, v1))
+                break;
+
+            // the low three bits of the quotient go in C0, C3, C1
+            quotient = std::abs(quotient);
+            fpuStatus &= ~FPU_CondCodes;
+            if(quotient & 4)
+                fpuStatus |= FPU_C0;
+            if(quotient & 2)
+                fpuStatus |= FPU_C3;
+            if(quotient & 1)
+                fpuStatus |= FPU_C1;
+            break;
+        }
+
+        case 0x16: // FDECSTP
+            setFPUTop(getFPUTop() - 1);
+            fpuStatus &= ~FPU_C1;
+            break;
+        case 0x17: // FINCSTP
+            setFPUTop(getFPUTop() + 1);
+            fpuStatus &= ~FPU_C1;
+            break;
+
+        case 0x1A: // FSQRT
+            if(fpuRead(0, v))
+                setResult(0, std::sqrt(v), v);
+            break;
+
+        case 0x1B: // FSINCOS
+            if(fpuRead(0, v) && checkTrigRange(v) && setResult(0, std::sin(v), v))
+                fpuPush(std::cos(v));
+            break;
+
+        case 0x1C: // FRNDINT
+        {
+            if(!fpuRead(0, v))
+                break;
+
+            auto res = roundFPU(v, fpuControl);
+            if(res != v && !std::isnan(v))
+                raiseFPUException(FPU_PE);
+
+            setResult(0, res, v);
+            break;
+        }
+
+        case 0x1D: // FSCALE
+        {
+            if(!fpuRead(0, v) || !fpuRead(1, v1))
+                break;
+
+            // anything outside of this range is going to overflow/underflow anyway
+            auto scale = std::trunc(v1);
+            if(scale > 65536)
+                scale = 65536;
+            else if(scale < -65536)
+                scale = -65536;
+
+            auto res = std::isnan(v1) ? v1 : std::ldexp(v, static_cast<int>(scale));
+
+            if(std::isinf(res) && std::isfinite(v) && !raiseFPUException(FPU_OE | FPU_PE))
+                break;
+
+            setResult(0, res, v, v1);
+            break;
+        }
+
+        case 0x1E: // FSIN
+        case 0x1F: // FCOS
+            if(fpuRead(0, v) && checkTrigRange(v))
+                setResult(0, index == 0x1E ? std::sin(v) : std::cos(v), v);
+            break;
+
+        default:
+            fault(Fault::UD);
+    }
+}
+
+// waiting instructions fault on a pending error if CR0.NE is set
+bool CPU::checkFPUError()
+{
+    if((fpuStatus & FPU_ES) && (reg(Reg32::CR0) & (1 << 5)/*NE*/))
+    {
+        fault(Fault::MF);
+        return false;
+    }
+
+    return true;
+}
+
+// ES/B follow the unmasked exception flags
+// errors are reported through IRQ13 (cleared by writing port F0) unless CR0.NE is set
+void CPU::updateFPUError()
+{
+    if(!(fpuStatus & ~fpuControl & FPU_Exceptions))
+    {
+        fpuStatus &= ~(FPU_ES | FPU_B);
+        return;
+    }
+
+    if(fpuStatus & FPU_ES)
+        return;
+
+    fpuStatus |= FPU_ES | FPU_B;
+
+    if(!(reg(Reg32::CR0) & (1 << 5)/*NE*/))
+        sys.getChipset().setPICInput(13, true);
+}
+
+// sets exception flags, returns false if the instruction shouldn't complete because one was unmasked
+// (an unmasked precision exception still stores the result)
+bool CPU::raiseFPUException(uint16_t exceptions)
+{
+    fpuStatus |= exceptions;
+
+    auto unmasked = exceptions & ~fpuControl & FPU_Exceptions;
+    if(!unmasked)
+        return true;
+
+    updateFPUError();
+    return !(unmasked & ~FPU_PE);
+}
+
+void CPU::setFPURegEmpty(int i, bool empty)
+{
+    int shift = ((getFPUTop() + i) & 7) * 2;
+    fpuTag = (fpuTag & ~(3 << shift)) | (empty ? 3 << shift : 0);
+}
+
+// reads ST(i), an empty register is a stack underflow
+bool CPU::fpuRead(int i, long double &v)
+{
+    if(!isFPURegEmpty(i))
+    {
+        v = fpuST(i);
+        return true;
+    }
+
+    fpuStatus &= ~FPU_C1;
+    if(!raiseFPUException(FPU_IE | FPU_SF))
+        return false;
+
+    v = fpuIndefinite;
+    return true;
+}
+
+bool CPU::fpuPush(long double v)
+{
+    // overflow if the register we're pushing into is in use
+    if(!isFPURegEmpty(7))
+    {
+        fpuStatus |= FPU_C1;
+        if(!raiseFPUException(FPU_IE | FPU_SF))
+            return false;
+
+        v = fpuIndefinite;
+    }
+
+    setFPUTop(getFPUTop() - 1);
+    fpuST(0) = v;
+    setFPURegEmpty(0, false);
+    return true;
+}
+
+void CPU::fpuPop()
+{
+    setFPURegEmpty(0, true);
+    setFPUTop(getFPUTop() + 1);
+}
+
+// sets C0/C2/C3, FUCOM doesn't raise invalid for QNaNs (which are the only kind we have)
+bool CPU::fpuCompare(long double a, long double b, bool unordered)
+{
+    fpuStatus &= ~FPU_CondCodes;
+
+    if(std::isnan(a) || std::isnan(b))
+    {
+        if(!unordered && !raiseFPUException(FPU_IE))
+            return false;
+
+        fpuStatus |= FPU_C3 | FPU_C2 | FPU_C0;
+    }
+    else if(a < b)
+        fpuStatus |= FPU_C0;
+    else if(a == b)
+        fpuStatus |= FPU_C3;
+
+    return true;
+}
+
+void CPU::fpuReadMem(FPUFormat format, const RM &rm, long double &v)
+{
+    uint8_t data[10];
+
+    switch(format)
+    {
+        case FPUFormat::Real32:
+        {
+            float f;
+            fpuReadBytes(rm, data, 4);
+
+            memcpy(&f, data, 4);
+            v = f;
+            break;
+        }
+        case FPUFormat::Real64:
+        {
+            double d;
+            fpuReadBytes(rm, data, 8);
+
+            memcpy(&d, data, 8);
+            v = d;
+            break;
+        }
+        case FPUFormat::Real80:
+            fpuReadBytes(rm, data, 10);
+
+            v = loadExtended(data);
+            break;
+
+        case FPUFormat::Int16:
+        {
+            int16_t i;
+            fpuReadBytes(rm, data, 2);
+
+            memcpy(&i, data, 2);
+            v = i;
+            break;
+        }
+        case FPUFormat::Int32:
+        {
+            int32_t i;
+            fpuReadBytes(rm, data, 4);
+
+            memcpy(&i, data, 4);
+            v = i;
+            break;
+        }
+        case FPUFormat::Int64:
+        {
+            int64_t i;
+            fpuReadBytes(rm, data, 8);
+
+            memcpy(&i, data, 8);
+            v = i;
+            break;
+        }
+        case FPUFormat::BCD:
+            fpuReadBytes(rm, data, 10);
+
+            v = loadBCD(data);
+            break;
+    }
+}
+
+bool CPU::fpuWriteMem(FPUFormat format, const RM &rm, long double v)
+{
+    uint8_t data[10] = {};
+    int len = 0;
+    uint16_t exceptions = 0;
+
+    // converts to an integer of the same size as T, or the "integer indefinite" value
+    auto convertInt = [this, &data, &len, &exceptions, v](auto zero)
+    {
+        using T = decltype(zero);
+
+        auto rounded = roundFPU(v, fpuControl);
+        if(rounded != v && !std::isnan(v))
+            exceptions |= FPU_PE;
+
+        T i;
+        if(!toInt(rounded, i))
+        {
+            exceptions = FPU_IE;
+            i = std::numeric_limits<T>::min();
+        }
+
+        memcpy(data, &i, sizeof(T));
+        len = sizeof(T);
+    };
+
+    switch(format)
+    {
+        case FPUFormat::Real32:
+        {
+            float f = v;
+            if(std::isinf(f) && std::isfinite(v))
+                exceptions |= FPU_OE | FPU_PE;
+            else if(f != v && !std::isnan(v))
+                exceptions |= FPU_PE;
+
+            memcpy(data, &f, 4);
+            len = 4;
+            break;
+        }
+        case FPUFormat::Real64:
+        {
+            double d = v;
+            if(std::isinf(d) && std::isfinite(v))
+                exceptions |= FPU_OE | FPU_PE;
+            else if(d != v && !std::isnan(v))
+                exceptions |= FPU_PE;
+
+            memcpy(data, &d, 8);
+            len = 8;
+            break;
+        }
+        case FPUFormat::Real80:
+            storeExtended(v, data);
+            len = 10;
+            break;
+
+        case FPUFormat::Int16:
+            convertInt(int16_t(0));
+            break;
+        case FPUFormat::Int32:
+            convertInt(int32_t(0));
+            break;
+        case FPUFormat::Int64:
+            convertInt(int64_t(0));
+            break;
+
+        case FPUFormat::BCD:
+        {
+            auto rounded = roundFPU(v, fpuControl);
+            if(rounded != v && !std::isnan(v))
+                exceptions |= FPU_PE;
+
+            len = 10;
+
+            if(!(std::fabs(rounded) < 1e18L))
+            {
+                // "packed BCD indefinite"
+                exceptions = FPU_IE;
+                memset(data, 0, 7);
+                data[7] = 0xC0;
+                data[8] = data[9] = 0xFF;
+                break;
+            }
+
+            auto n = static_cast<uint64_t>(std::fabs(rounded));
+            for(int i = 0; i < 9; i++, n /= 100)
+                data[i] = (n % 10) | (n / 10 % 10) << 4;
+
+            data[9] = std::signbit(rounded) ? 0x80 : 0;
+            break;
+        }
+    }
+
+    // nothing is stored if there's an unmasked exception (other than precision)
+    if(exceptions & ~fpuControl & FPU_Exceptions & ~FPU_PE)
+        return raiseFPUException(exceptions);
+
+    fpuWriteBytes(rm, data, len);
+
+    if(exceptions)
+        raiseFPUException(exceptions);
+
+    return true;
+}
+
+void CPU::fpuReadBytes(const RM &rm, uint8_t *data, int len)
+{
+    for(int i = 0; i < len;)
+    {
+        if(len - i >= 4)
+        {
+            uint32_t v = readMem32(rm.offset + i, rm.rmBase);
+
+            memcpy(data + i, &v, 4);
+            i += 4;
+        }
+        else
+        {
+            uint16_t v = readMem16(rm.offset + i, rm.rmBase);
+
+            memcpy(data + i, &v, 2);
+            i += 2;
+        }
+    }
+}
+
+void CPU::fpuWriteBytes(const RM &rm, const uint8_t *data, int len)
+{
+    // check the whole thing first so that a fault doesn't leave it partially written
+    // (len < page size, so the first write checks the other page)
+    checkSegmentAccess(rm.rmBase, rm.offset, len, true);
+    getPhysicalAddress(getSegmentOffset(rm.rmBase) + rm.offset + len - 1, true);
+
+    for(int i = 0; i < len;)
+    {
+        if(len - i >= 4)
+        {
+            uint32_t v;
+            memcpy(&v, data + i, 4);
+            writeMem32(rm.offset + i, rm.rmBase, v);
+            i += 4;
+        }
+        else
+        {
+            uint16_t v;
+            memcpy(&v, data + i, 2);
+            writeMem16(rm.offset + i, rm.rmBase, v);
+            i += 2;
+        }
+    }
+}
+
+// calculates the full tag word from the values
+uint16_t CPU::getFPUTagWord()
+{
+    uint16_t tag = 0;
+
+    for(int i = 0; i < 8; i++)
+    {
+        int t;
+        if(((fpuTag >> (i * 2)) & 3) == 3)
+            t = 3; // empty
+        else if(fpuRegs[i] == 0)
+            t = 1; // zero
+        else if(!std::isnormal(fpuRegs[i]))
+            t = 2; // special (NaN/inf/denormal)
+        else
+            t = 0; // valid
+
+        tag |= t << (i * 2);
+    }
+
+    return tag;
+}
+
+// FSTENV/FSAVE layout, depends on the operand size and mode, returns the size
+int CPU::fpuStoreEnv(uint8_t *data, bool operandSize32)
+{
+    auto put16 = [data](int offset, uint16_t v) {memcpy(data + offset, &v, 2);};
+    auto put32 = [data](int offset, uint32_t v) {memcpy(data + offset, &v, 4);};
+
+    // real/v86 mode stores linear addresses
+    bool realMode = !isProtectedMode() || (flags & (1 << 17)/*VM*/);
+    uint32_t ip = fpuIP, dp = fpuDP;
+
+    if(realMode)
+    {
+        ip += fpuIPSel << 4;
+        dp += fpuDPSel << 4;
+    }
+
+    if(operandSize32)
+    {
+        put32(0, 0xFFFF0000 | fpuControl);
+        put32(4, 0xFFFF0000 | fpuStatus);
+        put32(8, 0xFFFF0000 | getFPUTagWord());
+
+        if(realMode)
+        {
+            put32(12, 0xFFFF0000 | (ip & 0xFFFF));
+            put32(16, (ip & 0xFFFF0000) >> 4 | fpuOpcode);
+            put32(20, 0xFFFF0000 | (dp & 0xFFFF));
+            put32(24, (dp & 0xFFFF0000) >> 4);
+        }
+        else
+        {
+            put32(12, fpuIP);
+            put32(16, fpuOpcode << 16 | fpuIPSel);
+            put32(20, fpuDP);
+            put32(24, 0xFFFF0000 | fpuDPSel);
+        }
+
+        return 28;
+    }
+
+    put16(0, fpuControl);
+    put16(2, fpuStatus);
+    put16(4, getFPUTagWord());
+
+    if(realMode)
+    {
+        put16(6, ip);
+        put16(8, (ip >> 4 & 0xF000) | fpuOpcode);
+        put16(10, dp);
+        put16(12, dp >> 4 & 0xF000);
+    }
+    else
+    {
+        put16(6, fpuIP);
+        put16(8, fpuIPSel);
+        put16(10, fpuDP);
+        put16(12, fpuDPSel);
+    }
+
+    return 14;
+}
+
+int CPU::fpuLoadEnv(const uint8_t *data, bool operandSize32)
+{
+    auto get16 = [data](int offset) {uint16_t v; memcpy(&v, data + offset, 2); return v;};
+    auto get32 = [data](int offset) {uint32_t v; memcpy(&v, data + offset, 4); return v;};
+
+    bool realMode = !isProtectedMode() || (flags & (1 << 17)/*VM*/);
+    int step = operandSize32 ? 4 : 2;
+
+    fpuControl = get16(0);
+    fpuStatus = get16(step);
+
+    // only empty or not matters
+    auto tag = get16(step * 2);
+    fpuTag = 0;
+    for(int i = 0; i < 8; i++)
+    {
+        if(((tag >> (i * 2)) & 3) == 3)
+            fpuTag |= 3 << (i * 2);
+    }
+
+    if(operandSize32)
+    {
+        if(realMode)
+        {
+            fpuIP = get16(12) | (get32(16) & 0x0FFFF000) << 4;
+            fpuOpcode = get32(16) & 0x7FF;
+            fpuDP = get16(20) | (get32(24) & 0x0FFFF000) << 4;
+            fpuIPSel = fpuDPSel = 0;
+        }
+        else
+        {
+            fpuIP = get32(12);
+            fpuIPSel = get16(16);
+            fpuOpcode = get16(18) & 0x7FF;
+            fpuDP = get32(20);
+            fpuDPSel = get16(24);
+        }
+    }
+    else
+    {
+        if(realMode)
+        {
+            fpuIP = get16(6) | (get16(8) & 0xF000) << 4;
+            fpuOpcode = get16(8) & 0x7FF;
+            fpuDP = get16(10) | (get16(12) & 0xF000) << 4;
+            fpuIPSel = fpuDPSel = 0;
+        }
+        else
+        {
+            fpuIP = get16(6);
+            fpuIPSel = get16(8);
+            fpuDP = get16(10);
+            fpuDPSel = get16(12);
+        }
+    }
+
+    updateFPUError();
+
+    return operandSize32 ? 28 : 14;
+}
+
+#endif
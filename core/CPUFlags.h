@@ -0,0 +1,113 @@
+#pragma once
+#include <cstdint>
+
+// EFLAGS with lazily evaluated arithmetic flags
+// the common ALU ops only record their operands and result, C/P/A/Z/S/O are calculated when something reads them
+class CPUFlags
+{
+public:
+    enum class Op : uint8_t
+    {
+        None = 0, // value is up to date
+
+        Add,
+        AddWithCarry,
+        Sub,
+        SubWithBorrow,
+        Logic, // and/or/xor/test
+        Inc,
+        Dec,
+    };
+
+    template<class T>
+    void setLazy(Op op, T dest, T src, T res)
+    {
+        // logic ops keep A and inc/dec keep C, get them from the previous op
+        if(lazyOp != Op::None)
+        {
+            if(op == Op::Logic)
+                value = (value & ~auxCarryFlag) | (calculateAuxCarry() ? auxCarryFlag : 0);
+            else if(op == Op::Inc || op == Op::Dec)
+                value = (value & ~carryFlag) | (calculateCarry() ? carryFlag : 0);
+        }
+
+        lazyOp = op;
+        lazySize = sizeof(T);
+        this->dest = dest;
+        this->src = src;
+        this->res = res;
+    }
+
+    // reading or modifying any of the arithmetic flags evaluates them first
+    uint32_t operator&(uint32_t mask)
+    {
+        if(mask & arithMask)
+            evaluate();
+        return value & mask;
+    }
+
+    CPUFlags &operator=(uint32_t v)
+    {
+        value = v;
+        lazyOp = Op::None;
+        return *this;
+    }
+
+    CPUFlags &operator|=(uint32_t mask)
+    {
+        if(mask & arithMask)
+            evaluate();
+        value |= mask;
+        return *this;
+    }
+
+    CPUFlags &operator&=(uint32_t mask)
+    {
+        if(~mask & arithMask)
+            evaluate();
+        value &= mask;
+        return *this;
+    }
+
+    CPUFlags &operator^=(uint32_t mask)
+    {
+        if(mask & arithMask)
+            evaluate();
+        value ^= mask;
+        return *this;
+    }
+
+    uint32_t get() {evaluate(); return value;}
+
+    // checks a Jcc/SETcc condition, only calculating the flags it uses
+    bool getCondition(int cond) const;
+    uint32_t get() const {return lazyOp == Op::None ? value : calculate();}
+
+    void evaluate()
+    {
+        if(lazyOp != Op::None)
+        {
+            value = calculate();
+            lazyOp = Op::None;
+        }
+    }
+
+    // direct access for the recompiler, evaluate() must have been called
+    uint32_t &getValue() {return value;}
+
+private:
+    static const uint32_t arithMask = 0x8D5; // C/P/A/Z/S/O
+    static const uint32_t carryFlag = 0x1;
+    static const uint32_t auxCarryFlag = 0x10;
+
+    uint32_t calculate() const;
+    bool calculateCarry() const;
+    bool calculateOverflow() const;
+    bool calculateAuxCarry() const;
+
+    uint32_t value = 2;
+
+    Op lazyOp = Op::None;
+    uint8_t lazySize; // in bytes
+    uint32_t dest, src, res;
+};
@@ -0,0 +1,1366 @@
+// x86-64 dynamic recompiler for hot decoded blocks
+// compiles simple register/memory ALU ops, moves, push/pop and near branches
+// everything else (and anything that faults) is left to the interpreter
+#ifdef CPU_JIT
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "CPU.h"
+#include "System.h"
+
+// guest EFLAGS bits
+enum JITFlags
+{
+    JITFlag_C = (1 << 0),
+    JITFlag_P = (1 << 2),
+    JITFlag_A = (1 << 4),
+    JITFlag_Z = (1 << 6),
+    JITFlag_S = (1 << 7),
+    JITFlag_O = (1 << 11),
+
+    JITFlags_Arith = JITFlag_C | JITFlag_P | JITFlag_A | JITFlag_Z | JITFlag_S | JITFlag_O,
+    JITFlags_Logic = JITFlag_C | JITFlag_P | JITFlag_Z | JITFlag_S | JITFlag_O, // A is unchanged
+    JITFlags_IncDec = JITFlag_P | JITFlag_A | JITFlag_Z | JITFlag_S | JITFlag_O, // C is unchanged
+};
+
+enum HostReg
+{
+    RAX = 0,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+};
+
+enum HostCond
+{
+    Cond_B  = 0x2,
+    Cond_AE = 0x3,
+    Cond_Z  = 0x4,
+    Cond_NZ = 0x5,
+    Cond_A  = 0x7,
+};
+
+// same order as the guest ALU ops (opcode >> 3), TEST is ours
+enum ALUOp
+{
+    ALU_ADD = 0,
+    ALU_OR,
+    ALU_ADC,
+    ALU_SBB,
+    ALU_AND,
+    ALU_SUB,
+    ALU_XOR,
+    ALU_CMP,
+    ALU_TEST,
+};
+
+static const size_t jitBufferSize = 4 * 1024 * 1024;
+static const int maxBlockCodeSize = 8 * 1024; // well over the worst case for maxOps
+
+// register usage in compiled code:
+// RBX = &regs[0], R15 = this
+// R12 = effective address, R13 = source operand, R14 = value to write
+// RAX/RCX/RDX scratch
+class JITEmitter final
+{
+public:
+    JITEmitter(uint8_t *ptr, int flagsOffset, int faultIPOffset) : ptr(ptr), flagsOffset(flagsOffset), faultIPOffset(faultIPOffset) {}
+
+    uint8_t *getPtr() const {return ptr;}
+
+    void emit8(uint8_t v) {*ptr++ = v;}
+    void emit16(uint16_t v) {memcpy(ptr, &v, 2); ptr += 2;}
+    void emit32(uint32_t v) {memcpy(ptr, &v, 4); ptr += 4;}
+    void emit64(uint64_t v) {memcpy(ptr, &v, 8); ptr += 8;}
+
+    void emitImm(int width, uint32_t imm)
+    {
+        if(width == 8)
+            emit8(imm);
+        else if(width == 16)
+            emit16(imm);
+        else
+            emit32(imm);
+    }
+
+    // operand size/REX prefixes
+    void prefix(int width, int reg, int rm, bool rmIsReg)
+    {
+        if(width == 16)
+            emit8(0x66);
+
+        uint8_t rex = 0x40 | (width == 64 ? 8 : 0) | (reg & 8 ? 4 : 0) | (rmIsReg && (rm & 8) ? 1 : 0);
+
+        // SPL/BPL/SIL/DIL instead of AH/CH/DH/BH
+        bool byteRegs = width == 8 && ((reg >= RSP && reg <= RDI) || (rmIsReg && rm >= RSP && rm <= RDI));
+
+        if(rex != 0x40 || byteRegs)
+            emit8(rex);
+    }
+
+    void opcode(int op)
+    {
+        if(op > 0xFF)
+            emit8(op >> 8);
+        emit8(op);
+    }
+
+    // op reg, [rbx + disp]
+    void memOp(int width, int op, int reg, int32_t disp)
+    {
+        prefix(width, reg, 0, false);
+        opcode(op);
+
+        if(disp >= -128 && disp < 128)
+        {
+            emit8(0x40 | (reg & 7) << 3 | RBX);
+            emit8(disp);
+        }
+        else
+        {
+            emit8(0x80 | (reg & 7) << 3 | RBX);
+            emit32(disp);
+        }
+    }
+
+    // op reg, rm
+    void regOp(int width, int op, int reg, int rm)
+    {
+        prefix(width, reg, rm, true);
+        opcode(op);
+        emit8(0xC0 | (reg & 7) << 3 | (rm & 7));
+    }
+
+    static int sized(int width, int op8, int op)
+    {
+        return width == 8 ? op8 : op;
+    }
+
+    // loads are zero extended to 32 bits
+    void load(int width, int reg, int32_t disp)
+    {
+        if(width == 32)
+            memOp(32, 0x8B, reg, disp);
+        else
+            memOp(32, width == 8 ? 0x0FB6 : 0x0FB7, reg, disp);
+    }
+
+    void store(int width, int32_t disp, int reg)
+    {
+        memOp(width, sized(width, 0x88, 0x89), reg, disp);
+    }
+
+    void storeImm(int width, int32_t disp, uint32_t imm)
+    {
+        memOp(width, sized(width, 0xC6, 0xC7), 0, disp);
+        emitImm(width, imm);
+    }
+
+    void movRegReg(int width, int dst, int src)
+    {
+        regOp(width, 0x89, src, dst);
+    }
+
+    void movRegImm(int reg, uint32_t imm)
+    {
+        if(reg & 8)
+            emit8(0x41);
+        emit8(0xB8 | (reg & 7));
+        emit32(imm);
+    }
+
+    void movRegImm64(int reg, uint64_t imm)
+    {
+        emit8(reg & 8 ? 0x49 : 0x48);
+        emit8(0xB8 | (reg & 7));
+        emit64(imm);
+    }
+
+    void extend(bool sign, int srcWidth, int dst, int src)
+    {
+        if(sign)
+            regOp(32, srcWidth == 8 ? 0x0FBE : 0x0FBF, dst, src);
+        else
+            regOp(32, srcWidth == 8 ? 0x0FB6 : 0x0FB7, dst, src);
+    }
+
+    // ALU ops, these also handle TEST
+    void aluMemReg(int op, int width, int32_t disp, int reg)
+    {
+        if(op == ALU_TEST)
+            memOp(width, sized(width, 0x84, 0x85), reg, disp);
+        else
+            memOp(width, sized(width, op << 3, op << 3 | 1), reg, disp);
+    }
+
+    void aluRegReg(int op, int width, int dst, int src)
+    {
+        if(op == ALU_TEST)
+            regOp(width, sized(width, 0x84, 0x85), src, dst);
+        else
+            regOp(width, sized(width, op << 3, op << 3 | 1), src, dst);
+    }
+
+    void aluMemImm(int op, int width, int32_t disp, uint32_t imm)
+    {
+        if(op == ALU_TEST)
+        {
+            memOp(width, sized(width, 0xF6, 0xF7), 0, disp);
+            emitImm(width, imm);
+        }
+        else if(width == 8)
+        {
+            memOp(width, 0x80, op, disp);
+            emit8(imm);
+        }
+        else if(fitsImm8(width, imm))
+        {
+            memOp(width, 0x83, op, disp);
+            emit8(imm);
+        }
+        else
+        {
+            memOp(width, 0x81, op, disp);
+            emitImm(width, imm);
+        }
+    }
+
+    void aluRegImm(int op, int width, int reg, uint32_t imm)
+    {
+        if(op == ALU_TEST)
+        {
+            regOp(width, sized(width, 0xF6, 0xF7), 0, reg);
+            emitImm(width, imm);
+        }
+        else if(width == 8)
+        {
+            regOp(width, 0x80, op, reg);
+            emit8(imm);
+        }
+        else if(fitsImm8(width, imm))
+        {
+            regOp(width, 0x83, op, reg);
+            emit8(imm);
+        }
+        else
+        {
+            regOp(width, 0x81, op, reg);
+            emitImm(width, imm);
+        }
+    }
+
+    void incDecMem(int width, int32_t disp, bool dec)
+    {
+        memOp(width, sized(width, 0xFE, 0xFF), dec ? 1 : 0, disp);
+    }
+
+    void incDecReg(int width, int reg, bool dec)
+    {
+        regOp(width, sized(width, 0xFE, 0xFF), dec ? 1 : 0, reg);
+    }
+
+    void shiftRegImm(int op, int reg, int count)
+    {
+        regOp(32, 0xC1, op, reg);
+        emit8(count);
+    }
+
+    void push(int reg)
+    {
+        if(reg & 8)
+            emit8(0x41);
+        emit8(0x50 | (reg & 7));
+    }
+
+    void pop(int reg)
+    {
+        if(reg & 8)
+            emit8(0x41);
+        emit8(0x58 | (reg & 7));
+    }
+
+    // returns the location of the offset to patch
+    uint8_t *jcc(int cond)
+    {
+        emit8(0x0F);
+        emit8(0x80 | cond);
+        emit32(0);
+        return ptr - 4;
+    }
+
+    uint8_t *jmp()
+    {
+        emit8(0xE9);
+        emit32(0);
+        return ptr - 4;
+    }
+
+    static void patch(uint8_t *rel, const uint8_t *target)
+    {
+        int32_t off = target - (rel + 4);
+        memcpy(rel, &off, 4);
+    }
+
+    // guest state
+    int32_t regOffset(int width, int r) const
+    {
+        if(width == 8)
+            return ((r & 3) << 2) + (r >> 2);
+
+        return r * 4;
+    }
+
+    // copies host flags to the guest flags
+    void storeFlags(uint32_t mask)
+    {
+        if(!mask)
+            return;
+
+        emit8(0x9C); // PUSHFQ
+        pop(RDX);
+        aluRegImm(ALU_AND, 32, RDX, mask);
+        aluMemImm(ALU_AND, 32, flagsOffset, ~mask);
+        aluMemReg(ALU_OR, 32, flagsOffset, RDX);
+    }
+
+    // copies the guest carry flag to the host
+    void loadCarry()
+    {
+        memOp(32, 0x0FBA, 4, flagsOffset); // BT
+        emit8(0);
+    }
+
+    // sets host Z if the guest condition (even numbered) is false
+    void testCondition(int cond)
+    {
+        static const uint16_t condMasks[]
+        {
+            JITFlag_O,
+            JITFlag_C,
+            JITFlag_Z,
+            JITFlag_C | JITFlag_Z,
+            JITFlag_S,
+            JITFlag_P,
+        };
+
+        cond >>= 1;
+
+        if(cond < 6)
+        {
+            aluMemImm(ALU_TEST, 32, flagsOffset, condMasks[cond]);
+            return;
+        }
+
+        // S != O
+        load(32, RAX, flagsOffset);
+        movRegReg(32, RCX, RAX);
+        shiftRegImm(5 /*SHR*/, RCX, 4); // O -> S
+        aluRegReg(ALU_XOR, 32, RAX, RCX);
+        aluRegImm(ALU_AND, 32, RAX, JITFlag_S);
+
+        // ... || Z
+        if(cond == 7)
+        {
+            load(32, RCX, flagsOffset);
+            aluRegImm(ALU_AND, 32, RCX, JITFlag_Z);
+            aluRegReg(ALU_OR, 32, RAX, RCX);
+        }
+    }
+
+    // guest IP/fault tracking
+    // ipOffset is the amount that has been added to EIP so far
+
+    void commitIP(uint32_t offset)
+    {
+        if(offset != ipOffset)
+            aluMemImm(ALU_ADD, 32, eipOffset, offset - ipOffset);
+
+        ipOffset = offset;
+    }
+
+    // the helper has already set EIP
+    void setIPCommitted(uint32_t offset)
+    {
+        ipOffset = offset;
+    }
+
+    void setFaultIP(uint32_t offset)
+    {
+        commitIP(offset);
+        load(32, RAX, eipOffset);
+        store(32, faultIPOffset, RAX);
+    }
+
+    // EIP = EIP + off, relative to the current IP
+    void jumpRelative(uint32_t off, bool operandSize32)
+    {
+        load(32, RAX, eipOffset);
+        aluRegImm(ALU_ADD, 32, RAX, off);
+        if(!operandSize32)
+            extend(false, 16, RAX, RAX);
+        store(32, eipOffset, RAX);
+    }
+
+    // helper calls
+    void callHelper(const void *func)
+    {
+        movRegImm64(RAX, reinterpret_cast<uintptr_t>(func));
+        emit8(0xFF); // CALL RAX
+        emit8(0xD0);
+    }
+
+    // result in EAX
+    void callRead(const void *func, int segment)
+    {
+        movRegReg(64, RDI, R15);
+        movRegReg(32, RSI, R12);
+        movRegImm(RDX, segment);
+        callHelper(func);
+    }
+
+    // writes R14
+    void callWrite(const void *func, int segment, uint32_t nextOffset)
+    {
+        movRegReg(64, RDI, R15);
+        movRegReg(32, RSI, R12);
+        movRegImm(RDX, segment);
+        movRegReg(32, RCX, R14);
+        callHelper(func);
+        checkWriteResult(nextOffset);
+    }
+
+    // 1 = continue, 2 = modified code in this block
+    void checkWriteResult(uint32_t nextOffset)
+    {
+        aluRegImm(ALU_CMP, 32, RAX, 1);
+        stubs.push_back({jcc(Cond_A), nextOffset - ipOffset});
+    }
+
+    void prologue(const void *regs, const void *cpu)
+    {
+        // five pushes + return address keeps the stack aligned
+        push(RBX);
+        push(R12);
+        push(R13);
+        push(R14);
+        push(R15);
+        movRegImm64(RBX, reinterpret_cast<uintptr_t>(regs));
+        movRegImm64(R15, reinterpret_cast<uintptr_t>(cpu));
+    }
+
+    void epilogue(uint32_t endOffset)
+    {
+        commitIP(endOffset);
+
+        auto exit = ptr;
+
+        pop(R15);
+        pop(R14);
+        pop(R13);
+        pop(R12);
+        pop(RBX);
+        emit8(0xC3); // RET
+
+        // exits after writing to the current block
+        for(auto &stub : stubs)
+        {
+            patch(stub.rel, ptr);
+            aluMemImm(ALU_ADD, 32, eipOffset, stub.ipAdjust);
+            patch(jmp(), exit);
+        }
+    }
+
+private:
+    static bool fitsImm8(int width, uint32_t imm)
+    {
+        int32_t v = width == 16 ? int16_t(imm) : int32_t(imm);
+        return v >= -128 && v < 128;
+    }
+
+    struct Stub
+    {
+        uint8_t *rel;
+        uint32_t ipAdjust;
+    };
+
+    uint8_t *ptr;
+
+    static const int eipOffset = static_cast<int>(CPU::Reg32::EIP) * 4;
+    int flagsOffset, faultIPOffset;
+
+    uint32_t ipOffset = 0;
+
+    std::vector<Stub> stubs;
+};
+
+CPU::~CPU()
+{
+    if(jitBuffer)
+        munmap(jitBuffer, jitBufferSize);
+}
+
+bool CPU::runCompiledBlock(uint32_t addr)
+{
+    auto block = curBlock;
+
+    // let the interpreter handle the limit fault
+    if(addr + block->jitLength - 1 > ipLimit)
+        return false;
+
+    reg(Reg32::EIP) = faultIP;
+    auto startIP = faultIP;
+
+    // compiled code works on the real flags
+    flags.evaluate();
+
+    block->jitCode();
+
+    // continue with the rest of the block if we didn't branch (or modify it)
+    if(curBlock == block && reg(Reg32::EIP) == startIP + block->jitLength)
+    {
+        curBlockOp = block->jitOps - 1;
+        blockNextAddr = addr + block->jitLength;
+    }
+    else
+        invalidateDecodedBlock();
+
+    return true;
+}
+
+void CPU::compileBlock(DecodedBlock &block)
+{
+    if(jitDisabled || trace.isEnabled())
+        return;
+
+    if(!jitBuffer)
+    {
+        auto mem = mmap(nullptr, jitBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(mem == MAP_FAILED)
+        {
+            jitDisabled = true;
+            return;
+        }
+
+        jitBuffer = jitBufferPtr = static_cast<uint8_t *>(mem);
+    }
+
+    if(jitBuffer + jitBufferSize - jitBufferPtr < maxBlockCodeSize)
+        flushCompiledBlocks();
+
+    // find the ops we can compile
+    uint16_t flagsRead[DecodedBlock::maxOps], flagsWritten[DecodedBlock::maxOps];
+    int numOps = 0;
+    uint32_t length = 0;
+
+    for(; numOps < block.numOps; numOps++)
+    {
+        bool endsBlock;
+        if(!getJITOpInfo(block.ops[numOps], flagsRead[numOps], flagsWritten[numOps], endsBlock))
+            break;
+
+        length += block.ops[numOps].length;
+
+        if(endsBlock)
+        {
+            numOps++;
+            break;
+        }
+    }
+
+    if(!numOps)
+        return;
+
+    // only store flags that are used before being overwritten, everything is live at the end
+    uint16_t liveFlags[DecodedBlock::maxOps];
+    uint16_t live = JITFlags_Arith;
+
+    for(int i = numOps - 1; i >= 0; i--)
+    {
+        liveFlags[i] = live;
+        live = (live & ~flagsWritten[i]) | flagsRead[i];
+    }
+
+    auto byteOffset = [this](const void *p)
+    {
+        return static_cast<int>(reinterpret_cast<const uint8_t *>(p) - reinterpret_cast<const uint8_t *>(regs));
+    };
+
+    auto code = jitBufferPtr;
+
+    // keep the buffer W^X, only the pages we're about to emit into are writable
+    auto pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto protStart = reinterpret_cast<uint8_t *>(reinterpret_cast<uintptr_t>(code) & ~(pageSize - 1));
+    auto protEnd = reinterpret_cast<uint8_t *>((reinterpret_cast<uintptr_t>(code) + maxBlockCodeSize + pageSize - 1) & ~(pageSize - 1));
+    protEnd = std::min(protEnd, jitBuffer + jitBufferSize);
+
+    if(mprotect(protStart, protEnd - protStart, PROT_READ | PROT_WRITE) != 0)
+    {
+        jitDisabled = true;
+        return;
+    }
+
+    JITEmitter emit(code, byteOffset(&flags.getValue()), byteOffset(&faultIP));
+
+    emit.prologue(regs, this);
+
+    uint32_t offset = 0;
+
+    for(int i = 0; i < numOps; i++)
+    {
+        compileOp(emit, block.ops[i], offset, liveFlags[i]);
+        offset += block.ops[i].length;
+    }
+
+    emit.epilogue(offset);
+
+    assert(emit.getPtr() - code <= maxBlockCodeSize);
+
+    jitBufferPtr = emit.getPtr();
+
+    if(mprotect(protStart, protEnd - protStart, PROT_READ | PROT_EXEC) != 0)
+    {
+        // can't run it, drop the code and stop compiling
+        flushCompiledBlocks();
+        jitDisabled = true;
+        return;
+    }
+
+    block.jitCode = reinterpret_cast<void (*)()>(code);
+    block.jitOps = numOps;
+    block.jitLength = length;
+}
+
+void CPU::flushCompiledBlocks()
+{
+    for(auto &block : blockCache)
+    {
+        block.execCount = 0;
+        block.jitCode = nullptr;
+    }
+
+    jitBufferPtr = jitBuffer;
+}
+
+// returns false if we can't compile the op
+bool CPU::getJITOpInfo(const DecodedOp &op, uint16_t &flagsRead, uint16_t &flagsWritten, bool &endsBlock)
+{
+    flagsRead = flagsWritten = 0;
+    endsBlock = false;
+
+    if(op.prefixes & (Prefix_Lock | Prefix_Rep | Prefix_RepNZ))
+        return false;
+
+    bool isMem = op.modRMOffset && op.rmBase > static_cast<int>(Reg16::IP);
+
+    // anything that can fault needs the flags to be up to date
+    if(isMem)
+        flagsRead = JITFlags_Arith;
+
+    auto aluFlags = [&flagsRead, &flagsWritten](int aluOp)
+    {
+        if(aluOp == ALU_ADC || aluOp == ALU_SBB)
+            flagsRead |= JITFlag_C;
+
+        if(aluOp == ALU_AND || aluOp == ALU_OR || aluOp == ALU_XOR || aluOp == ALU_TEST)
+            flagsWritten = JITFlags_Logic;
+        else
+            flagsWritten = JITFlags_Arith;
+
+        return true;
+    };
+
+    auto opcode = op.opcode;
+
+    // ALU ops
+    if(opcode < 0x40 && (opcode & 7) < 6)
+        return aluFlags(opcode >> 3);
+
+    switch(opcode)
+    {
+        case 0x0F:
+        {
+            if((op.opcode2 & 0xF0) == 0x80) // Jcc
+            {
+                flagsRead = JITFlags_Arith;
+                endsBlock = true;
+                return true;
+            }
+
+            // MOVZX/MOVSX
+            return op.opcode2 == 0xB6 || op.opcode2 == 0xB7 || op.opcode2 == 0xBE || op.opcode2 == 0xBF;
+        }
+
+        case 0x40: // INC/DEC
+        case 0x41:
+        case 0x42:
+        case 0x43:
+        case 0x44:
+        case 0x45:
+        case 0x46:
+        case 0x47:
+        case 0x48:
+        case 0x49:
+        case 0x4A:
+        case 0x4B:
+        case 0x4C:
+        case 0x4D:
+        case 0x4E:
+        case 0x4F:
+            flagsWritten = JITFlags_IncDec;
+            return true;
+
+        case 0x50: // PUSH/POP
+        case 0x51:
+        case 0x52:
+        case 0x53:
+        case 0x54:
+        case 0x55:
+        case 0x56:
+        case 0x57:
+        case 0x58:
+        case 0x59:
+        case 0x5A:
+        case 0x5B:
+        case 0x5C:
+        case 0x5D:
+        case 0x5E:
+        case 0x5F:
+        case 0x68: // PUSH imm
+        case 0x6A:
+            flagsRead = JITFlags_Arith;
+            return true;
+
+        case 0x70: // Jcc
+        case 0x71:
+        case 0x72:
+        case 0x73:
+        case 0x74:
+        case 0x75:
+        case 0x76:
+        case 0x77:
+        case 0x78:
+        case 0x79:
+        case 0x7A:
+        case 0x7B:
+        case 0x7C:
+        case 0x7D:
+        case 0x7E:
+        case 0x7F:
+        case 0xC3: // RET
+        case 0xE8: // CALL
+            flagsRead = JITFlags_Arith;
+            endsBlock = true;
+            return true;
+
+        case 0xE9: // JMP
+        case 0xEB:
+            endsBlock = true;
+            return true;
+
+        case 0x80: // imm op
+        case 0x81:
+        case 0x82:
+        case 0x83:
+            return aluFlags(op.rmReg);
+
+        case 0x84: // TEST
+        case 0x85:
+        case 0xA8:
+        case 0xA9:
+            return aluFlags(ALU_TEST);
+
+        case 0x88: // MOV
+        case 0x89:
+        case 0x8A:
+        case 0x8B:
+        case 0x90: // NOP
+        case 0xB0: // MOV imm
+        case 0xB1:
+        case 0xB2:
+        case 0xB3:
+        case 0xB4:
+        case 0xB5:
+        case 0xB6:
+        case 0xB7:
+        case 0xB8:
+        case 0xB9:
+        case 0xBA:
+        case 0xBB:
+        case 0xBC:
+        case 0xBD:
+        case 0xBE:
+        case 0xBF:
+            return true;
+
+        case 0x8D: // LEA, doesn't access memory
+            flagsRead = 0;
+            return isMem;
+
+        case 0xC6: // MOV imm
+        case 0xC7:
+            return op.rmReg == 0;
+
+        case 0xF6: // TEST imm
+        case 0xF7:
+            return op.rmReg < 2 && aluFlags(ALU_TEST);
+
+        case 0xFE: // INC/DEC
+        case 0xFF:
+            flagsWritten = JITFlags_IncDec;
+            return op.rmReg < 2;
+    }
+
+    return false;
+}
+
+void CPU::compileOp(JITEmitter &emit, const DecodedOp &op, uint32_t offset, uint16_t liveFlags)
+{
+    bool operandSize32 = codeSizeBit != !!(op.prefixes & Prefix_OperandSize);
+    bool addressSize32 = codeSizeBit != !!(op.prefixes & Prefix_AddressSize);
+    int opWidth = operandSize32 ? 32 : 16;
+
+    uint32_t nextOffset = offset + op.length;
+
+    bool isMem = op.modRMOffset && op.rmBase > static_cast<int>(Reg16::IP);
+    int segment = op.rmBase;
+
+    auto readFunc = [](int width) -> const void *
+    {
+        if(width == 8)
+            return reinterpret_cast<const void *>(&jitRead8);
+        if(width == 16)
+            return reinterpret_cast<const void *>(&jitRead16);
+        return reinterpret_cast<const void *>(&jitRead32);
+    };
+
+    auto writeFunc = [](int width) -> const void *
+    {
+        if(width == 8)
+            return reinterpret_cast<const void *>(&jitWrite8);
+        if(width == 16)
+            return reinterpret_cast<const void *>(&jitWrite16);
+        return reinterpret_cast<const void *>(&jitWrite32);
+    };
+
+    // effective address -> R12
+    auto loadEffectiveAddress = [&]()
+    {
+        emit.movRegImm(R12, op.disp);
+
+        auto addReg = [&](int r, int shift)
+        {
+            if(r == 0xFF)
+                return;
+
+            if(addressSize32)
+            {
+                emit.load(32, RAX, emit.regOffset(32, r));
+                if(shift)
+                    emit.shiftRegImm(4 /*SHL*/, RAX, shift);
+            }
+            else
+                emit.load(16, RAX, emit.regOffset(16, r));
+
+            emit.aluRegReg(ALU_ADD, 32, R12, RAX);
+        };
+
+        addReg(op.baseReg, op.baseShift);
+        addReg(op.indexReg, op.indexShift);
+
+        if(!addressSize32)
+            emit.extend(false, 16, R12, R12);
+    };
+
+    // r/m op= reg/imm
+    auto aluRMReg = [&](int aluOp, int width, int rmReg, bool srcIsImm, int srcReg, uint32_t imm)
+    {
+        uint32_t flagsMask = aluOp == ALU_AND || aluOp == ALU_OR || aluOp == ALU_XOR || aluOp == ALU_TEST ? JITFlags_Logic : JITFlags_Arith;
+        bool withCarry = aluOp == ALU_ADC || aluOp == ALU_SBB;
+
+        if(!isMem)
+        {
+            auto dest = emit.regOffset(width, rmReg);
+
+            if(srcIsImm)
+            {
+                if(withCarry)
+                    emit.loadCarry();
+                emit.aluMemImm(aluOp, width, dest, imm);
+            }
+            else
+            {
+                emit.load(width, RCX, emit.regOffset(width, srcReg));
+                if(withCarry)
+                    emit.loadCarry();
+                emit.aluMemReg(aluOp, width, dest, RCX);
+            }
+
+            emit.storeFlags(flagsMask & liveFlags);
+            return;
+        }
+
+        loadEffectiveAddress();
+        emit.setFaultIP(offset);
+
+        if(srcIsImm)
+            emit.movRegImm(R13, imm);
+        else
+            emit.load(width, R13, emit.regOffset(width, srcReg));
+
+        emit.callRead(readFunc(width), segment);
+
+        if(withCarry)
+            emit.loadCarry();
+        emit.aluRegReg(aluOp, width, RAX, R13);
+        emit.storeFlags(flagsMask & liveFlags);
+
+        if(aluOp != ALU_CMP && aluOp != ALU_TEST)
+        {
+            emit.movRegReg(32, R14, RAX);
+            emit.callWrite(writeFunc(width), segment, nextOffset);
+        }
+    };
+
+    auto aluRM = [&](int aluOp, int width, bool srcIsImm, int srcReg, uint32_t imm)
+    {
+        aluRMReg(aluOp, width, op.rmBase, srcIsImm, srcReg, imm);
+    };
+
+    // reg op= r/m
+    auto aluReg = [&](int aluOp, int width)
+    {
+        uint32_t flagsMask = aluOp == ALU_AND || aluOp == ALU_OR || aluOp == ALU_XOR ? JITFlags_Logic : JITFlags_Arith;
+        bool withCarry = aluOp == ALU_ADC || aluOp == ALU_SBB;
+
+        if(isMem)
+        {
+            loadEffectiveAddress();
+            emit.setFaultIP(offset);
+            emit.callRead(readFunc(width), segment);
+        }
+        else
+            emit.load(width, RAX, emit.regOffset(width, op.rmBase));
+
+        if(withCarry)
+            emit.loadCarry();
+        emit.aluMemReg(aluOp, width, emit.regOffset(width, op.rmReg), RAX);
+        emit.storeFlags(flagsMask & liveFlags);
+    };
+
+    auto incDec = [&](int width, bool dec)
+    {
+        if(!isMem)
+        {
+            emit.incDecMem(width, emit.regOffset(width, op.rmBase), dec);
+            emit.storeFlags(JITFlags_IncDec & liveFlags);
+            return;
+        }
+
+        loadEffectiveAddress();
+        emit.setFaultIP(offset);
+        emit.callRead(readFunc(width), segment);
+        emit.incDecReg(width, RAX, dec);
+        emit.storeFlags(JITFlags_IncDec & liveFlags);
+        emit.movRegReg(32, R14, RAX);
+        emit.callWrite(writeFunc(width), segment, nextOffset);
+    };
+
+    // r/m -> EAX
+    auto readRM = [&](int width)
+    {
+        if(isMem)
+        {
+            loadEffectiveAddress();
+            emit.setFaultIP(offset);
+            emit.callRead(readFunc(width), segment);
+        }
+        else
+            emit.load(width, RAX, emit.regOffset(width, op.rmBase));
+    };
+
+    auto push = [&](bool isImm, uint32_t val)
+    {
+        emit.setFaultIP(offset);
+
+        emit.movRegReg(64, RDI, R15);
+        if(isImm)
+            emit.movRegImm(RSI, val);
+        else
+            emit.load(32, RSI, emit.regOffset(32, val));
+        emit.movRegImm(RDX, operandSize32);
+        emit.callHelper(reinterpret_cast<const void *>(&jitPush));
+        emit.checkWriteResult(nextOffset);
+    };
+
+    auto jump = [&](bool cond, int condCode, uint32_t off)
+    {
+        emit.commitIP(nextOffset);
+
+        uint8_t *skip = nullptr;
+
+        if(cond)
+        {
+            emit.testCondition(condCode);
+            skip = emit.jcc(condCode & 1 ? Cond_NZ : Cond_Z);
+        }
+
+        emit.jumpRelative(off, operandSize32);
+
+        if(skip)
+            JITEmitter::patch(skip, emit.getPtr());
+    };
+
+    auto opcode = op.opcode;
+    auto imm = op.imm;
+    auto imm8 = static_cast<uint32_t>(static_cast<int8_t>(imm)); // sign extended
+
+    // ALU ops
+    if(opcode < 0x40 && (opcode & 7) < 6)
+    {
+        int aluOp = opcode >> 3;
+        int width = opcode & 1 ? opWidth : 8;
+
+        switch(opcode & 7)
+        {
+            case 0: // r/m op= reg
+            case 1:
+                aluRM(aluOp, width, false, op.rmReg, 0);
+                break;
+            case 2: // reg op= r/m
+            case 3:
+                aluReg(aluOp, width);
+                break;
+            case 4: // AL op= imm
+            case 5:
+                aluRMReg(aluOp, width, 0, true, 0, imm);
+                break;
+        }
+        return;
+    }
+
+    switch(opcode)
+    {
+        case 0x0F:
+        {
+            if((op.opcode2 & 0xF0) == 0x80) // Jcc
+            {
+                jump(true, op.opcode2 & 0xF, imm);
+                break;
+            }
+
+            // MOVZX/MOVSX
+            bool sign = op.opcode2 & 8;
+            int srcWidth = op.opcode2 & 1 ? 16 : 8;
+
+            readRM(srcWidth);
+            if(sign)
+                emit.extend(true, srcWidth, RAX, RAX);
+            emit.store(opWidth, emit.regOffset(32, op.rmReg), RAX);
+            break;
+        }
+
+        case 0x40: // INC
+        case 0x41:
+        case 0x42:
+        case 0x43:
+        case 0x44:
+        case 0x45:
+        case 0x46:
+        case 0x47:
+        case 0x48: // DEC
+        case 0x49:
+        case 0x4A:
+        case 0x4B:
+        case 0x4C:
+        case 0x4D:
+        case 0x4E:
+        case 0x4F:
+            emit.incDecMem(opWidth, emit.regOffset(32, opcode & 7), opcode & 8);
+            emit.storeFlags(JITFlags_IncDec & liveFlags);
+            break;
+
+        case 0x50: // PUSH
+        case 0x51:
+        case 0x52:
+        case 0x53:
+        case 0x54:
+        case 0x55:
+        case 0x56:
+        case 0x57:
+            push(false, opcode & 7);
+            break;
+
+        case 0x58: // POP
+        case 0x59:
+        case 0x5A:
+        case 0x5B:
+        case 0x5C:
+        case 0x5D:
+        case 0x5E:
+        case 0x5F:
+            emit.setFaultIP(offset);
+            emit.movRegReg(64, RDI, R15);
+            emit.movRegImm(RSI, operandSize32);
+            emit.callHelper(reinterpret_cast<const void *>(&jitPop));
+            emit.store(opWidth, emit.regOffset(32, opcode & 7), RAX);
+            break;
+
+        case 0x68: // PUSH imm
+            push(true, imm);
+            break;
+        case 0x6A:
+            push(true, imm8);
+            break;
+
+        case 0x70: // Jcc
+        case 0x71:
+        case 0x72:
+        case 0x73:
+        case 0x74:
+        case 0x75:
+        case 0x76:
+        case 0x77:
+        case 0x78:
+        case 0x79:
+        case 0x7A:
+        case 0x7B:
+        case 0x7C:
+        case 0x7D:
+        case 0x7E:
+        case 0x7F:
+            jump(true, opcode & 0xF, imm8);
+            break;
+
+        case 0x80: // imm op
+        case 0x82:
+            aluRM(op.rmReg, 8, true, 0, imm);
+            break;
+        case 0x81:
+            aluRM(op.rmReg, opWidth, true, 0, imm);
+            break;
+        case 0x83:
+            aluRM(op.rmReg, opWidth, true, 0, imm8);
+            break;
+
+        case 0x84: // TEST
+            aluRM(ALU_TEST, 8, false, op.rmReg, 0);
+            break;
+        case 0x85:
+            aluRM(ALU_TEST, opWidth, false, op.rmReg, 0);
+            break;
+
+        case 0x88: // MOV r/m <- reg
+        case 0x89:
+        {
+            int width = opcode & 1 ? opWidth : 8;
+
+            if(isMem)
+            {
+                loadEffectiveAddress();
+                emit.setFaultIP(offset);
+                emit.load(width, R14, emit.regOffset(width, op.rmReg));
+                emit.callWrite(writeFunc(width), segment, nextOffset);
+            }
+            else
+            {
+                emit.load(width, RAX, emit.regOffset(width, op.rmReg));
+                emit.store(width, emit.regOffset(width, op.rmBase), RAX);
+            }
+            break;
+        }
+
+        case 0x8A: // MOV reg <- r/m
+        case 0x8B:
+        {
+            int width = opcode & 1 ? opWidth : 8;
+
+            readRM(width);
+            emit.store(width, emit.regOffset(width, op.rmReg), RAX);
+            break;
+        }
+
+        case 0x8D: // LEA
+            loadEffectiveAddress();
+            emit.store(opWidth, emit.regOffset(32, op.rmReg), R12);
+            break;
+
+        case 0x90: // NOP
+            break;
+
+        case 0xA8: // TEST AL imm
+            aluRMReg(ALU_TEST, 8, 0, true, 0, imm);
+            break;
+        case 0xA9:
+            aluRMReg(ALU_TEST, opWidth, 0, true, 0, imm);
+            break;
+
+        case 0xB0: // MOV reg8 imm
+        case 0xB1:
+        case 0xB2:
+        case 0xB3:
+        case 0xB4:
+        case 0xB5:
+        case 0xB6:
+        case 0xB7:
+            emit.storeImm(8, emit.regOffset(8, opcode & 7), imm);
+            break;
+
+        case 0xB8: // MOV reg imm
+        case 0xB9:
+        case 0xBA:
+        case 0xBB:
+        case 0xBC:
+        case 0xBD:
+        case 0xBE:
+        case 0xBF:
+            emit.storeImm(opWidth, emit.regOffset(32, opcode & 7), imm);
+            break;
+
+        case 0xC3: // RET
+            emit.setFaultIP(offset);
+            emit.movRegReg(64, RDI, R15);
+            emit.movRegImm(RSI, operandSize32);
+            emit.callHelper(reinterpret_cast<const void *>(&jitReturn));
+            emit.setIPCommitted(nextOffset);
+            break;
+
+        case 0xC6: // MOV r/m imm
+        case 0xC7:
+        {
+            int width = opcode & 1 ? opWidth : 8;
+
+            if(isMem)
+            {
+                loadEffectiveAddress();
+                emit.setFaultIP(offset);
+                emit.movRegImm(R14, imm);
+                emit.callWrite(writeFunc(width), segment, nextOffset);
+            }
+            else
+                emit.storeImm(width, emit.regOffset(width, op.rmBase), imm);
+            break;
+        }
+
+        case 0xE8: // CALL
+        {
+            emit.setFaultIP(offset);
+            emit.commitIP(nextOffset);
+
+            emit.movRegReg(64, RDI, R15);
+            emit.load(32, RSI, emit.regOffset(32, static_cast<int>(Reg32::EIP)));
+            emit.movRegImm(RDX, operandSize32);
+            emit.callHelper(reinterpret_cast<const void *>(&jitPush));
+
+            // modifying this block doesn't matter as we're leaving
+            emit.jumpRelative(imm, operandSize32);
+            break;
+        }
+
+        case 0xE9: // JMP
+            jump(false, 0, imm);
+            break;
+        case 0xEB:
+            jump(false, 0, imm8);
+            break;
+
+        case 0xF6: // TEST imm
+            aluRM(ALU_TEST, 8, true, 0, imm);
+            break;
+        case 0xF7:
+            aluRM(ALU_TEST, opWidth, true, 0, imm);
+            break;
+
+        case 0xFE: // INC/DEC
+            incDec(8, op.rmReg == 1);
+            break;
+        case 0xFF:
+            incDec(opWidth, op.rmReg == 1);
+            break;
+    }
+}
+
+// helpers
+// a fault doesn't return to the compiled code, it unwinds straight back to run()
+uint32_t CPU::jitRead8(CPU *cpu, uint32_t offset, int segment)
+{
+    return cpu->readMem8(offset, static_cast<Reg16>(segment));
+}
+
+uint32_t CPU::jitRead16(CPU *cpu, uint32_t offset, int segment)
+{
+    return cpu->readMem16(offset, static_cast<Reg16>(segment));
+}
+
+uint32_t CPU::jitRead32(CPU *cpu, uint32_t offset, int segment)
+{
+    return cpu->readMem32(offset, static_cast<Reg16>(segment));
+}
+
+// writes return 2 if the current block was modified
+int CPU::jitWrite8(CPU *cpu, uint32_t offset, int segment, uint32_t data)
+{
+    cpu->writeMem8(offset, static_cast<Reg16>(segment), data);
+    return cpu->curBlock ? 1 : 2;
+}
+
+int CPU::jitWrite16(CPU *cpu, uint32_t offset, int segment, uint32_t data)
+{
+    cpu->writeMem16(offset, static_cast<Reg16>(segment), data);
+    return cpu->curBlock ? 1 : 2;
+}
+
+int CPU::jitWrite32(CPU *cpu, uint32_t offset, int segment, uint32_t data)
+{
+    cpu->writeMem32(offset, static_cast<Reg16>(segment), data);
+    return cpu->curBlock ? 1 : 2;
+}
+
+int CPU::jitPush(CPU *cpu, uint32_t val, int op32)
+{
+    cpu->doPush(val, op32, cpu->stackAddrSize32);
+    return cpu->curBlock ? 1 : 2;
+}
+
+uint32_t CPU::jitPop(CPU *cpu, int op32)
+{
+    return cpu->doPop(op32, cpu->stackAddrSize32);
+}
+
+// same as the interpreter's RET, sets EIP
+void CPU::jitReturn(CPU *cpu, int op32)
+{
+    uint32_t newIP = cpu->doPeek(op32, cpu->stackAddrSize32, 0);
+
+    // check IP against limit
+    if(newIP > cpu->getCachedSegmentDescriptor(Reg16::CS).limit)
+        cpu->fault(Fault::GP, 0);
+
+    // update SP
+    if(cpu->stackAddrSize32)
+        cpu->reg(Reg32::ESP) += (op32 ? 4 : 2);
+    else
+        cpu->reg(Reg16::SP) += (op32 ? 4 : 2);
+
+    cpu->reg(Reg32::EIP) = newIP;
+}
+
+#endif
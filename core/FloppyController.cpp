@@ -5,8 +5,8 @@
 
 FloppyController::FloppyController(System &sys) : sys(sys)
 {
-    // technically generates IRQ6, but not in a way that requires updateForInterrupts (yet?)
-    sys.addIODevice(0x3F8, 0x3F0, 0, this);
+    // technically generates IRQ6, but completes commands immediately so has no events to schedule (yet?)
+    sys.addIODevice(0x3F8, 0x3F0, this);
 }
 
 void FloppyController::setIOInterface(FloppyDiskIO *io)
@@ -1,8 +1,10 @@
+#include <algorithm>
+
 #include "GamePort.h"
 
 GamePort::GamePort(System &sys) : sys(sys)
 {
-    sys.addIODevice(0x3FF, 0x201, 0, this);
+    sys.addIODevice(0x3FF, 0x201, this);
 }
 
 uint8_t GamePort::read(uint16_t addr)
@@ -24,6 +26,23 @@ uint8_t GamePort::read(uint16_t addr)
     return ret;
 }
 
+int GamePort::getCyclesToPortChange(uint16_t addr, uint32_t cycleCount)
+{
+    auto elapsed = cycleCount - timerStartCycle;
+    int ret = std::numeric_limits<int>::max();
+
+    // the next axis to time out
+    for(int i = 0; i < 4; i++)
+    {
+        unsigned axisTime = (24 + axisState[i] * 1100) * 14;
+
+        if(elapsed < axisTime)
+            ret = std::min(ret, static_cast<int>(axisTime - elapsed));
+    }
+
+    return ret;
+}
+
 void GamePort::write(uint16_t addr, uint8_t data)
 {
     // start timer
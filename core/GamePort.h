@@ -12,8 +12,7 @@ public:
     void write(uint16_t addr, uint8_t data) override;
     void write16(uint16_t addr, uint16_t data) override {write(addr, data); write(addr + 1, data >> 8);}
 
-    void updateForInterrupts(uint8_t mask) override {}
-    int getCyclesToNextInterrupt(uint32_t cycleCount) override {return 0;}
+    int getCyclesToPortChange(uint16_t addr, uint32_t cycleCount) override;
 
     uint8_t dmaRead(int ch) override {return 0xFF;}
     void dmaWrite(int ch, uint8_t data) override {}
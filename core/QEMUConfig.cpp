@@ -18,7 +18,7 @@ static const uint32_t numFiles = __builtin_bswap32(std::size(files));
 
 QEMUConfig::QEMUConfig(System &sys)
 {
-    sys.addIODevice(0xFFFE, 0x510, 0, this);
+    sys.addIODevice(0xFFFE, 0x510, this);
 }
 
 void QEMUConfig::setVGABIOS(const uint8_t *bios)
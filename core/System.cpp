@@ -42,6 +42,10 @@ Chipset::Chipset(System &sys) : sys(sys)
 
     cmosRam[0x30] = extMemKB & 0xFF;
     cmosRam[0x31] = extMemKB >> 8;
+
+    // the PIC starts with the timer unmasked
+    calculateNextPITUpdate();
+    schedulePITEvent();
 }
 
 uint8_t Chipset::read(uint16_t addr)
@@ -287,28 +291,33 @@ void Chipset::write(uint16_t addr, uint8_t data)
         }
 
         case 0x20: // PIC ICW1, OCW 2/3
+        {
+            // ICW1 clears the mask, which may unmask the timer
+            bool timerUnmasked = (data & (1 << 4)) && (pic[0].mask & 1);
+
+            if(timerUnmasked)
+                updatePIT();
+
             pic[0].write(0, data);
+
+            if(timerUnmasked)
+                schedulePITEvent();
             break;
+        }
 
         case 0x21: // PIC
         {
-            if(pic[0].nextInit == 0) // writing mask
-            {
-                auto enabled = pic[0].mask & ~data;
+            bool timerMaskChanged = pic[0].nextInit == 0 && ((pic[0].mask ^ data) & 1);
 
-                if(enabled)
-                {
-                    // sync devices that are getting their IRQ unmasked
-                    if(enabled & 1)
-                        updatePIT();
-
-                    sys.updateForInterrupts(enabled, data);
-                }
-            }
+            // sync the timer if it's getting unmasked
+            if(timerMaskChanged && !(data & 1))
+                updatePIT();
 
             pic[0].write(1, data);
 
-            sys.calculateNextInterruptCycle(sys.getCycleCount());
+            if(timerMaskChanged)
+                schedulePITEvent();
+
             updateMaskedPICRequest();
 
             break;
@@ -354,7 +363,7 @@ void Chipset::write(uint16_t addr, uint8_t data)
                             pit.outState |= (1 << channel);
 
                         calculateNextPITUpdate();
-                        sys.calculateNextInterruptCycle(sys.getCycleCount());
+                        schedulePITEvent();
                     }
                 }
 
@@ -417,7 +426,7 @@ void Chipset::write(uint16_t addr, uint8_t data)
 #endif
 
                 calculateNextPITUpdate();
-                sys.calculateNextInterruptCycle(sys.getCycleCount());
+                schedulePITEvent();
             }
 
             break;
@@ -480,7 +489,7 @@ void Chipset::write(uint16_t addr, uint8_t data)
             systemControlA = data;
 
             // bit 0/1 are also reset/a20
-            i8042OutputPort = (i8042OutputPort & ~3) | (data & 3);
+            set8042OutputPort((i8042OutputPort & ~3) | (data & 3));
 
             break;
 
@@ -489,25 +498,16 @@ void Chipset::write(uint16_t addr, uint8_t data)
             break;
         case 0xA1: // second PIC
         {
-            if(pic[1].nextInit == 0) // writing mask
-            {
-                auto enabled = pic[1].mask & ~data;
-
-                if(enabled)
-                {
-                    // sync devices that are getting their IRQ unmasked
-                    sys.updateForInterrupts(enabled, data);
-                }
-            }
-
             pic[1].write(1, data);
-
-            sys.calculateNextInterruptCycle(sys.getCycleCount());
             updateMaskedPICRequest();
 
             break;
         }
 
+        case 0xF0: // clear coprocessor error (IRQ13)
+            setPICInput(13, false);
+            break;
+
 #ifndef NDEBUG
         default:
             auto [cs, ip, opAddr] = sys.getCPU().getOpStartAddr();
@@ -516,31 +516,14 @@ void Chipset::write(uint16_t addr, uint8_t data)
     }
 }
 
-void Chipset::updateForInterrupts(uint8_t mask)
-{
-    // timer
-    if(!(mask & 1))
-    {
-        auto passed = sys.getCycleCount() - pit.lastUpdateCycle;
-        if(passed >= pit.nextUpdateCycle - pit.lastUpdateCycle)
-            updatePIT();
-    }
-}
-
-int Chipset::getCyclesToNextInterrupt(uint32_t cycleCount)
+int Chipset::getCyclesToPortChange(uint16_t addr, uint32_t cycleCount)
 {
-    int toUpdate = std::numeric_limits<int>::max();
-
-    // timer
-    if(!(pic[0].mask & 1))
-        toUpdate = std::min(toUpdate, static_cast<int>(pit.nextUpdateCycle - cycleCount));
-
-    // might be late for a PIT update sometimes
-    // usually hit this when recalculating because the PIC mask has changed
-    if(toUpdate < 0)
-        toUpdate = 0;
+    // the 8042 only changes when there's input
+    if(addr == 0x60 || addr == 0x64)
+        return std::numeric_limits<int>::max();
 
-    return toUpdate;
+    // everything else is timers or interrupts
+    return 0;
 }
 
 void Chipset::dmaWrite(int ch, uint8_t data)
@@ -1109,6 +1092,7 @@ void Chipset::updateMaskedPICRequest()
 void Chipset::updatePIT()
 {
     auto elapsed = sys.getCycleCount() - pit.lastUpdateCycle;
+    auto oldNextUpdateCycle = pit.nextUpdateCycle;
 
     elapsed /= System::getPITClockDiv();
 
@@ -1192,6 +1176,9 @@ void Chipset::updatePIT()
         else if(pit.lastUpdateCycle == pit.nextUpdateCycle || pit.reloadNextCycle)
             calculateNextPITUpdate();
     }
+
+    if(pit.nextUpdateCycle != oldNextUpdateCycle)
+        schedulePITEvent();
 }
 
 void Chipset::calculateNextPITUpdate()
@@ -1226,6 +1213,22 @@ void Chipset::calculateNextPITUpdate()
     pit.nextUpdateCycle = pit.lastUpdateCycle + step * System::getPITClockDiv();
 }
 
+// the PIT only needs to be kept up to date while it can interrupt, otherwise it catches up when accessed
+void Chipset::schedulePITEvent()
+{
+    auto cb = [](IODevice *dev)
+    {
+        auto chipset = static_cast<Chipset *>(dev);
+        chipset->updatePIT();
+        chipset->schedulePITEvent();
+    };
+
+    if(pic[0].mask & 1)
+        sys.cancelEvent(this, cb);
+    else
+        sys.scheduleEvent(this, cb, pit.nextUpdateCycle);
+}
+
 void Chipset::updateSpeaker(uint32_t target)
 {
     static const int fracBits = 8;
@@ -1339,7 +1342,7 @@ void Chipset::write8042ControllerData(uint8_t data)
 
         case 0xD1:
             printf("8042 output %02X\n", data);
-            i8042OutputPort = data;
+            set8042OutputPort(data);
             break;
         case 0xD2: // first port echo
             i8042Queue.push(data);
@@ -1480,6 +1483,16 @@ void Chipset::write8042DeviceData(uint8_t data, int devIndex)
     }
 }
 
+void Chipset::set8042OutputPort(uint8_t data)
+{
+    bool a20Changed = (data ^ i8042OutputPort) & (1 << 1);
+
+    i8042OutputPort = data;
+
+    if(a20Changed)
+        sys.setA20(data & (1 << 1));
+}
+
 void Chipset::update8042Interrupt()
 {
     if(i8042Queue.empty())
@@ -1506,7 +1519,7 @@ void Chipset::update8042Interrupt()
 
 System::System() : chipset(*this), cpu(*this)
 {
-    addIODevice(0xFF00, 0, 1 << 0 | 1 << 1, &chipset);
+    addIODevice(0xFF00, 0, &chipset);
 }
 
 void System::reset()
@@ -1516,36 +1529,107 @@ void System::reset()
 
 void System::addMemory(uint32_t base, uint32_t size, uint8_t *ptr)
 {
-    assert(size % blockSize == 0);
-    assert(base % blockSize == 0);
+    assert(size % pageSize == 0);
+    assert(base % pageSize == 0);
     assert(base + size <= maxAddress);
 
-    auto block = base / blockSize;
-    int numBlocks = size / blockSize;
+    auto page = base / pageSize;
+    int numPages = size / pageSize;
+
+    for(int i = 0; i < numPages; i++)
+        mapPage(page + i, ptr ? ptr - base : nullptr, ptr ? ptr - base : nullptr);
 
-    for(int i = 0; i < numBlocks; i++)
-        memMap[block + i] = ptr ? ptr - base : nullptr;
+    invalidateCodePages(base, size);
 }
 
 void System::addReadOnlyMemory(uint32_t base, uint32_t size, const uint8_t *ptr)
 {
-    assert(size % blockSize == 0);
-    assert(base % blockSize == 0);
+    assert(size % pageSize == 0);
+    assert(base % pageSize == 0);
     assert(base + size <= maxAddress);
 
-    auto block = base / blockSize;
-    int numBlocks = size / blockSize;
+    auto page = base / pageSize;
+    int numPages = size / pageSize;
+
+    // writes go to the slow path and get dropped
+    for(int i = 0; i < numPages; i++)
+        mapPage(page + i, ptr - base, nullptr);
+
+    invalidateCodePages(base, size);
+}
+
+void System::removeMemoryPage(unsigned int page)
+{
+    assert(page < numMemPages);
+    mapPage(page, nullptr, nullptr);
+
+    invalidateCodePages(page * pageSize, pageSize);
+}
+
+void System::setA20(bool enabled)
+{
+    if(enabled == a20Enabled)
+        return;
+
+    a20Enabled = enabled;
 
-    for(int i = 0; i < numBlocks; i++)
+    // swap the real mappings of every page with A20 set with aliases of the page below
+    // (the alias has no write pointer so that writes invalidate the code page they really hit)
+    int i = 0;
+    for(unsigned int page = a20PageBit; page < numMemPages; page = (page + 1) | a20PageBit, i++)
     {
-        memMap[block + i] = const_cast<uint8_t *>(ptr) - base;
+        if(enabled)
+        {
+            memReadMap[page] = a20ReadMap[i];
+            memWriteMap[page] = a20WriteMap[i];
+        }
+        else
+        {
+            a20ReadMap[i] = memReadMap[page];
+            a20WriteMap[i] = memWriteMap[page];
+
+            auto aliasPtr = memReadMap[page & ~a20PageBit];
+            memReadMap[page] = aliasPtr ? aliasPtr - (1 << 20) : nullptr;
+            memWriteMap[page] = nullptr;
+        }
     }
+
+    // CPU has cached mappings
+    cpu.flushTLB();
 }
 
-void System::removeMemory(unsigned int block)
+void System::mapPage(unsigned int page, const uint8_t *readPtr, uint8_t *writePtr)
 {
-    assert(block < maxAddress / blockSize);
-    memMap[block] = nullptr;
+    if(!a20Enabled)
+    {
+        // hidden until A20 is enabled
+        if(page & a20PageBit)
+        {
+            int i = (page / a20PageBit / 2) * a20PageBit + page % a20PageBit;
+            a20ReadMap[i] = readPtr;
+            a20WriteMap[i] = writePtr;
+            return;
+        }
+
+        memReadMap[page | a20PageBit] = readPtr ? readPtr - (1 << 20) : nullptr;
+    }
+
+    memReadMap[page] = readPtr;
+    memWriteMap[page] = writePtr;
+}
+
+void System::invalidateCodePages(uint32_t base, uint32_t size)
+{
+    // the CPU caches pointers to memory
+    cpu.flushTLB();
+
+#ifdef CPU_BLOCK_CACHE_SIZE
+    for(uint32_t addr = base; addr < base + size; addr += codePageSize)
+    {
+        if(isCodePage(addr))
+            invalidateCodePage(addr);
+    }
+#endif
 }
 
 // this is entirely because EGA/VGA memory mapping is mad
@@ -1556,17 +1640,65 @@ void System::setMemAccessCallbacks(uint32_t baseAddr, uint32_t size, MemReadCall
     memReadCb = readCb;
     memWriteCb = writeCb;
     memAccessUserData = userData;
+
+    cpu.flushTLB();
 }
 
-void System::addIODevice(uint16_t mask, uint16_t value, uint8_t picMask, IODevice *dev)
+void System::addIODevice(uint16_t mask, uint16_t value, IODevice *dev)
 {
-    ioDevices.emplace_back(IORange{mask, value, picMask, dev});
+    ioDevices.emplace_back(IORange{mask, value, dev});
+    updateIOPortMap();
 }
 
 void System::removeIODevice(IODevice *dev)
 {
     auto it = std::remove_if(ioDevices.begin(), ioDevices.end(), [dev](auto &r){return r.dev == dev;});
     ioDevices.erase(it, ioDevices.end());
+    updateIOPortMap();
+}
+
+void System::updateIOPortMap()
+{
+    const int numPages = 0x10000 / ioPageSize;
+    size_t pageOffset[numPages];
+    IODevice *page[ioPageSize];
+
+    ioPages.clear();
+
+    for(int p = 0; p < numPages; p++)
+    {
+        // first device that matches, in the order they were added
+        for(int i = 0; i < ioPageSize; i++)
+        {
+            uint16_t addr = p * ioPageSize + i;
+            page[i] = nullptr;
+
+            for(auto &dev : ioDevices)
+            {
+                if((addr & dev.ioMask) == dev.ioValue)
+                {
+                    page[i] = dev.dev;
+                    break;
+                }
+            }
+        }
+
+        size_t offset;
+        for(offset = 0; offset < ioPages.size(); offset += ioPageSize)
+        {
+            if(std::equal(page, page + ioPageSize, ioPages.begin() + offset))
+                break;
+        }
+
+        if(offset == ioPages.size())
+            ioPages.insert(ioPages.end(), page, page + ioPageSize);
+
+        pageOffset[p] = offset;
+    }
+
+    // now that it's done growing
+    for(int p = 0; p < numPages; p++)
+        ioPageMap[p] = ioPages.data() + pageOffset[p];
 }
 
 
@@ -1575,16 +1707,15 @@ uint8_t RAM_FUNC(System::readMem)(uint32_t addr)
     if(addr >= maxAddress)
         return 0xFF;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
-    
-    auto ptr = memMap[block];
+    auto ptr = memReadMap[addr / pageSize];
 
     if(ptr)
         return ptr[addr];
 
+    // MMIO doesn't get aliased
+    if((addr & (1 << 20)) && !a20Enabled)
+        addr &= ~(1 << 20);
+
     // final attempt for complicated mappings
     if(memReadCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
         return memReadCb(addr, memAccessUserData);
@@ -1597,15 +1728,10 @@ uint16_t RAM_FUNC(System::readMem16)(uint32_t addr)
     if(addr >= maxAddress)
         return 0xFFFF;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
-
-    auto ptr = memMap[block];
+    auto ptr = memReadMap[addr / pageSize];
 
     if(ptr)
-        return *reinterpret_cast<uint16_t *>(ptr + addr);
+        return *reinterpret_cast<const uint16_t *>(ptr + addr);
 
     // final attempt for complicated mappings
     return readMem16WithCallback(addr);
@@ -1616,16 +1742,11 @@ uint32_t RAM_FUNC(System::readMem32)(uint32_t addr)
     if(addr >= maxAddress)
         return 0xFFFFFFFF;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    // this should work fine so long as nobody tries to read past the end of the block before A0000...
-    auto block = addr / blockSize;
-
-    auto ptr = memMap[block];
+    // the CPU splits accesses crossing a page
+    auto ptr = memReadMap[addr / pageSize];
 
     if(ptr)
-        return *reinterpret_cast<uint32_t *>(ptr + addr);
+        return *reinterpret_cast<const uint32_t *>(ptr + addr);
 
     // final attempt for complicated mappings
     return readMem32WithCallback(addr);
@@ -1636,12 +1757,12 @@ void RAM_FUNC(System::writeMem)(uint32_t addr, uint8_t data)
     if(addr >= maxAddress)
         return;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
+#ifdef CPU_BLOCK_CACHE_SIZE
+    if(isCodePage(addr))
+        invalidateCodePage(addr);
+#endif
 
-    auto ptr = memMap[block];
+    auto ptr = memWriteMap[addr / pageSize];
 
     if(ptr)
     {
@@ -1649,6 +1770,9 @@ void RAM_FUNC(System::writeMem)(uint32_t addr, uint8_t data)
         return;
     }
 
+    if((addr & (1 << 20)) && !a20Enabled)
+        return writeMem(addr & ~(1 << 20), data);
+
     if(memWriteCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
         memWriteCb(addr, data, memAccessUserData);
 }
@@ -1658,16 +1782,19 @@ void RAM_FUNC(System::writeMem16)(uint32_t addr, uint16_t data)
     if(addr >= maxAddress)
         return;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
+    // the CPU splits accesses crossing a page, so we only need to check the first one
+#ifdef CPU_BLOCK_CACHE_SIZE
+    if(isCodePage(addr))
+        invalidateCodePage(addr);
+#endif
 
-    auto ptr = memMap[block];
+    auto ptr = memWriteMap[addr / pageSize];
 
+#ifndef CPU_FPU
     // HACK: prevent setting coprocessor bit in equipment flags
     if(addr == 0x410)
         data &= ~2;
+#endif
 
     if(ptr)
     {
@@ -1683,12 +1810,12 @@ void RAM_FUNC(System::writeMem32)(uint32_t addr, uint32_t data)
     if(addr >= maxAddress)
         return;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
-
-    auto block = addr / blockSize;
+#ifdef CPU_BLOCK_CACHE_SIZE
+    if(isCodePage(addr))
+        invalidateCodePage(addr);
+#endif
 
-    auto ptr = memMap[block];
+    auto ptr = memWriteMap[addr / pageSize];
 
     if(ptr)
     {
@@ -1703,6 +1830,9 @@ void RAM_FUNC(System::writeMem32)(uint32_t addr, uint32_t data)
 [[gnu::noinline]]
 uint16_t RAM_FUNC(System::readMem16WithCallback)(uint32_t addr)
 {
+    if((addr & (1 << 20)) && !a20Enabled)
+        addr &= ~(1 << 20);
+
     if(memReadCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
     {
         return memReadCb(addr + 0, memAccessUserData)      |
@@ -1714,6 +1844,9 @@ uint16_t RAM_FUNC(System::readMem16WithCallback)(uint32_t addr)
 [[gnu::noinline]]
 uint32_t RAM_FUNC(System::readMem32WithCallback)(uint32_t addr)
 {
+    if((addr & (1 << 20)) && !a20Enabled)
+        addr &= ~(1 << 20);
+
     if(memReadCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
     {
         return memReadCb(addr + 0, memAccessUserData)       |
@@ -1727,6 +1860,10 @@ uint32_t RAM_FUNC(System::readMem32WithCallback)(uint32_t addr)
 [[gnu::noinline]]
 void RAM_FUNC(System::writeMem16WithCallback)(uint32_t addr, uint16_t data)
 {
+    // A20 alias (of anything)
+    if((addr & (1 << 20)) && !a20Enabled)
+        return writeMem16(addr & ~(1 << 20), data);
+
     if(memWriteCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
     {
         memWriteCb(addr + 0, data      , memAccessUserData);
@@ -1737,6 +1874,9 @@ void RAM_FUNC(System::writeMem16WithCallback)(uint32_t addr, uint16_t data)
 [[gnu::noinline]]
 void RAM_FUNC(System::writeMem32WithCallback)(uint32_t addr, uint32_t data)
 {
+    if((addr & (1 << 20)) && !a20Enabled)
+        return writeMem32(addr & ~(1 << 20), data);
+
     if(memWriteCb && addr >= memAccessCbBase && addr < memAccessCbEnd)
     {
         memWriteCb(addr + 0, data      , memAccessUserData);
@@ -1751,11 +1891,20 @@ const uint8_t *RAM_FUNC(System::mapAddress)(uint32_t addr) const
     if(addr >= maxAddress)
         return nullptr;
 
-    if((addr & (1 << 20)) && !chipset.getA20())
-        addr &= ~(1 << 20);
+    auto ptr = memReadMap[addr / pageSize];
 
-    auto block = addr / blockSize;
-    auto ptr = memMap[block];
+    if(ptr)
+        return ptr + addr;
+
+    return nullptr;
+}
+
+uint8_t *RAM_FUNC(System::mapAddressForWrite)(uint32_t addr)
+{
+    if(addr >= maxAddress)
+        return nullptr;
+
+    auto ptr = memWriteMap[addr / pageSize];
 
     if(ptr)
         return ptr + addr;
@@ -1763,13 +1912,26 @@ const uint8_t *RAM_FUNC(System::mapAddress)(uint32_t addr) const
     return nullptr;
 }
 
+#ifdef CPU_BLOCK_CACHE_SIZE
+[[gnu::noinline]]
+void RAM_FUNC(System::invalidateCodePage)(uint32_t addr)
+{
+    auto page = addr / codePageSize;
+
+    codePageMask[page / 32] &= ~(1u << (page % 32));
+    codePageGen[page]++;
+
+    cpu.invalidateCodePage(addr);
+}
+#endif
+
 uint8_t RAM_FUNC(System::readIOPort)(uint16_t addr)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->read(addr);
-    }
+    // devices work out their state from the time
+    updateCycleCount();
+
+    if(auto dev = getIODevice(addr))
+        return dev->read(addr);
 
 #ifndef NDEBUG
     if(addr >= 0xCF8 && addr < 0xD00) // PCI
@@ -1789,11 +1951,10 @@ uint8_t RAM_FUNC(System::readIOPort)(uint16_t addr)
 
 uint16_t RAM_FUNC(System::readIOPort16)(uint16_t addr)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->read16(addr);
-    }
+    updateCycleCount();
+
+    if(auto dev = getIODevice(addr))
+        return dev->read16(addr);
 
 #ifndef NDEBUG
     if(addr >= 0xCF8 && addr < 0xD00) // PCI
@@ -1808,11 +1969,10 @@ uint16_t RAM_FUNC(System::readIOPort16)(uint16_t addr)
 
 void RAM_FUNC(System::writeIOPort)(uint16_t addr, uint8_t data)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->write(addr, data);
-    }
+    updateCycleCount();
+
+    if(auto dev = getIODevice(addr))
+        return dev->write(addr, data);
 
     if(addr == 0xCF9 && data == 6) // PCI reboot (seabios uses this to reboot)
     {
@@ -1837,11 +1997,10 @@ void RAM_FUNC(System::writeIOPort)(uint16_t addr, uint8_t data)
 
 void RAM_FUNC(System::writeIOPort16)(uint16_t addr, uint16_t data)
 {
-    for(auto & dev : ioDevices)
-    {
-        if((addr & dev.ioMask) == dev.ioValue)
-            return dev.dev->write16(addr, data);
-    }
+    updateCycleCount();
+
+    if(auto dev = getIODevice(addr))
+        return dev->write16(addr, data);
 
 #ifndef NDEBUG
     if(addr >= 0xCF8 && addr < 0xD00) // PCI
@@ -1852,39 +2011,127 @@ void RAM_FUNC(System::writeIOPort16)(uint16_t addr, uint16_t data)
 #endif
 }
 
-void System::updateForInterrupts()
+int System::getCyclesToPortChange(uint16_t addr, uint32_t cycleCount)
 {
-    auto mask = chipset.getPICMask();
-    for(auto &dev : ioDevices)
+    if(auto dev = getIODevice(addr))
+        return dev->getCyclesToPortChange(addr, cycleCount);
+
+    // nothing there, always reads FF
+    return std::numeric_limits<int>::max();
+}
+
+void System::scheduleEvent(IODevice *dev, EventCallback cb, uint32_t cycle)
+{
+    int index;
+
+    for(index = 0; index < numEvents; index++)
     {
-        if((dev.picMask & ~mask))
-            dev.dev->updateForInterrupts(mask);
+        if(events[index].dev == dev && events[index].cb == cb)
+            break;
     }
 
-    calculateNextInterruptCycle(getCycleCount());
+    if(index == numEvents)
+    {
+        assert(numEvents < maxEvents);
+        events[numEvents++] = {cycle, dev, cb};
+        siftEventUp(index);
+    }
+    else
+    {
+        auto oldCycle = events[index].cycle;
+        events[index].cycle = cycle;
+
+        if(static_cast<int32_t>(cycle - oldCycle) < 0)
+            siftEventUp(index);
+        else
+            siftEventDown(index);
+    }
+
+    updateNextEventCycle();
 }
 
-void System::updateForInterrupts(uint8_t updateMask, uint8_t picMask)
+void System::cancelEvent(IODevice *dev, EventCallback cb)
 {
-    for(auto &dev : ioDevices)
+    for(int i = 0; i < numEvents; i++)
     {
-        if(dev.picMask & updateMask)
-            dev.dev->updateForInterrupts(picMask);
+        if(events[i].dev == dev && events[i].cb == cb)
+        {
+            removeEvent(i);
+            updateNextEventCycle();
+            return;
+        }
     }
 }
 
-void System::calculateNextInterruptCycle(uint32_t cycleCount)
+void System::runEvents()
 {
-    int toUpdate = std::numeric_limits<int>::max();
+    auto cycleCount = getCycleCount();
 
-    auto mask = chipset.getPICMask();
-    for(auto &dev : ioDevices)
+    while(numEvents && static_cast<int32_t>(cycleCount - events[0].cycle) >= 0)
     {
-        if((dev.picMask & ~mask))
-            toUpdate = std::min(toUpdate, dev.dev->getCyclesToNextInterrupt(cycleCount));
+        // remove first, the callback will usually schedule the next one
+        auto event = events[0];
+        removeEvent(0);
+
+        event.cb(event.dev);
     }
 
-    assert(toUpdate >= 0 || nextInterruptCycle == cycleCount + toUpdate);
+    updateNextEventCycle();
+}
+
+void System::removeEvent(int index)
+{
+    auto oldCycle = events[index].cycle;
+    events[index] = events[--numEvents];
 
-    nextInterruptCycle = cycleCount + toUpdate;
+    if(index == numEvents)
+        return;
+
+    if(static_cast<int32_t>(events[index].cycle - oldCycle) < 0)
+        siftEventUp(index);
+    else
+        siftEventDown(index);
+}
+
+void System::siftEventUp(int index)
+{
+    while(index)
+    {
+        int parent = (index - 1) / 2;
+
+        if(static_cast<int32_t>(events[index].cycle - events[parent].cycle) >= 0)
+            break;
+
+        std::swap(events[index], events[parent]);
+        index = parent;
+    }
+}
+
+void System::siftEventDown(int index)
+{
+    while(true)
+    {
+        int first = index;
+        int left = index * 2 + 1, right = left + 1;
+
+        if(left < numEvents && static_cast<int32_t>(events[left].cycle - events[first].cycle) < 0)
+            first = left;
+        if(right < numEvents && static_cast<int32_t>(events[right].cycle - events[first].cycle) < 0)
+            first = right;
+
+        if(first == index)
+            break;
+
+        std::swap(events[index], events[first]);
+        index = first;
+    }
+}
+
+void System::updateNextEventCycle()
+{
+    // nothing scheduled, come back in a while
+    if(!numEvents)
+        nextEventCycle = getCycleCount() + std::numeric_limits<int>::max();
+    else
+        nextEventCycle = events[0].cycle;
 }
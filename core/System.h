@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <functional>
+#include <limits>
 #include <list>
 
 #include "CPU.h"
@@ -12,6 +13,10 @@
 #define USE_PORT_TIMER
 #endif
 
+#ifdef USE_HOST_CLOCK
+#include <chrono>
+#endif
+
 class System;
 
 class IODevice
@@ -23,8 +28,9 @@ public:
     virtual void write(uint16_t addr, uint8_t data) = 0;
     virtual void write16(uint16_t addr, uint16_t data) = 0;
 
-    virtual void updateForInterrupts(uint8_t mask) = 0;
-    virtual int getCyclesToNextInterrupt(uint32_t cycleCount) = 0;
+    // how long until reading addr could return something different, without any other I/O
+    // (0 if it can change at any time, INT_MAX if only from outside the emulator)
+    virtual int getCyclesToPortChange(uint16_t addr, uint32_t cycleCount) = 0;
 
     // these are reversed from the DMA controller's perspective...
     virtual uint8_t dmaRead(int ch) = 0;
@@ -45,8 +51,7 @@ public:
     void write(uint16_t addr, uint8_t data) override;
     void write16(uint16_t addr, uint16_t data) override {write(addr, data); write(addr + 1, data >> 8);}
 
-    void updateForInterrupts(uint8_t mask) override;
-    int getCyclesToNextInterrupt(uint32_t cycleCount) override;
+    int getCyclesToPortChange(uint16_t addr, uint32_t cycleCount) override;
 
     uint8_t dmaRead(int ch) override {return 0xFF;}
     void dmaWrite(int ch, uint8_t data) override;
@@ -151,6 +156,7 @@ private:
 
     void updatePIT();
     void calculateNextPITUpdate();
+    void schedulePITEvent();
     void updateSpeaker(uint32_t target);
 
     void write8042ControllerCommand(uint8_t data);
@@ -158,6 +164,8 @@ private:
     void write8042DeviceCommand(uint8_t data, int devIndex);
     void write8042DeviceData(uint8_t data, int devIndex);
 
+    void set8042OutputPort(uint8_t data);
+
     void update8042Interrupt();
 
     // frequently checked from CPU
@@ -201,6 +209,7 @@ class System
 public:
     using MemReadCallback = uint8_t(*)(uint32_t addr, void *);
     using MemWriteCallback = void(*)(uint32_t addr, uint8_t data, void *);
+    using EventCallback = void(*)(IODevice *dev);
 
     System();
     void reset();
@@ -210,22 +219,35 @@ public:
     uint32_t getCycleCount() const
     {
 #ifdef USE_PORT_TIMER
-        return getTimer();
-#else
+        if(!virtualTime)
+            return getTimer();
+#endif
         return cycleCount;
+    }
+
+    // samples the host clock into the cycle count
+    // (it's too slow to read every instruction, so this is done when something needs to know the time)
+    void updateCycleCount()
+    {
+#ifdef USE_HOST_CLOCK
+        if(!virtualTime)
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - hostClockStart).count();
+            cycleCount = ns / 1000000000 * systemClock + ns % 1000000000 * systemClock / 1000000000;
+        }
 #endif
     }
 
     void addMemory(uint32_t base, uint32_t size, uint8_t *ptr);
     void addReadOnlyMemory(uint32_t base, uint32_t size, const uint8_t *ptr);
 
-    void removeMemory(unsigned int block);
+    void removeMemoryPage(unsigned int page);
 
     void setMemAccessCallbacks(uint32_t baseAddr, uint32_t size, MemReadCallback readCb, MemWriteCallback writeCb, void *userData = nullptr);
 
     Chipset &getChipset() {return chipset;}
 
-    void addIODevice(uint16_t mask, uint16_t value, uint8_t picMask, IODevice *dev);
+    void addIODevice(uint16_t mask, uint16_t value, IODevice *dev);
     void removeIODevice(IODevice *dev);
 
     uint8_t readMem(uint32_t addr);
@@ -241,56 +263,121 @@ public:
     void writeMem32WithCallback(uint32_t addr, uint32_t data);
 
     const uint8_t *mapAddress(uint32_t addr) const;
+    uint8_t *mapAddress(uint32_t addr) {return const_cast<uint8_t *>(static_cast<const System *>(this)->mapAddress(addr));}
+    uint8_t *mapAddressForWrite(uint32_t addr); // null for ROM/MMIO
+
+    // remaps the pages above 1M, called by the chipset when the A20 gate changes
+    void setA20(bool enabled);
+
+#ifdef CPU_BLOCK_CACHE_SIZE
+    // tracking for pages the CPU has decoded code from
+    void setCodePage(uint32_t addr) {codePageMask[addr / codePageSize / 32] |= 1u << ((addr / codePageSize) % 32);}
+    bool isCodePage(uint32_t addr) const {return codePageMask[(addr & (maxAddress - 1)) / codePageSize / 32] & (1u << ((addr / codePageSize) % 32));}
+    uint32_t getCodePageGeneration(uint32_t addr) const {return codePageGen[addr / codePageSize];}
+
+    void invalidateCodePage(uint32_t addr);
+#endif
 
     uint8_t readIOPort(uint16_t addr);
     uint16_t readIOPort16(uint16_t addr);
     void writeIOPort(uint16_t addr, uint8_t data);
     void writeIOPort16(uint16_t addr, uint16_t data);
 
-    void addCPUCycles(int cycles)
-    {
-#ifndef USE_PORT_TIMER
-        cycleCount += cycles * cpuClkDiv;
-#endif
-    }
+    int getCyclesToPortChange(uint16_t addr, uint32_t cycleCount);
+
+    // virtual time, the CPU charges cycles for each instruction instead of time coming from the host
+    // (charged at the system clock, so the CPU runs at ~14MHz however fast the host is)
+    void setVirtualTime(bool enabled) {virtualTime = enabled;}
+    bool isVirtualTime() const {return virtualTime;}
 
-    void updateForInterrupts();
-    void updateForInterrupts(uint8_t updateMask, uint8_t picMask);
+    void addVirtualCycles(uint32_t cycles) {cycleCount += cycles;}
 
-    void calculateNextInterruptCycle(uint32_t cycleCount);
-    uint32_t getNextInterruptCycle() const {return nextInterruptCycle;}
+    // timed device events, the callback is run once the cycle count reaches the deadline
+    // (scheduling again with the same device and callback moves the pending event)
+    void scheduleEvent(IODevice *dev, EventCallback cb, uint32_t cycle);
+    void cancelEvent(IODevice *dev, EventCallback cb);
+
+    void runEvents();
+    uint32_t getNextEventCycle() const {return nextEventCycle;}
 
     static constexpr int getClockSpeed() {return systemClock;}
     static constexpr int getCPUClockSpeed() {return systemClock / cpuClkDiv;}
     static constexpr int getPITClockDiv() {return pitClkDiv;}
 
-    static constexpr int getMemoryBlockSize() {return blockSize;}
-    static constexpr int getNumMemoryBlocks() {return maxAddress / blockSize;}
+    static constexpr int getMemoryPageSize() {return pageSize;}
+    static constexpr int getNumMemoryPages() {return numMemPages;}
 
 private:
     struct IORange
     {
         uint16_t ioMask, ioValue;
-        uint8_t picMask;
         IODevice *dev;
     };
 
+    struct Event
+    {
+        uint32_t cycle;
+        IODevice *dev;
+        EventCallback cb;
+    };
+
+    void mapPage(unsigned int page, const uint8_t *readPtr, uint8_t *writePtr);
+    void invalidateCodePages(uint32_t base, uint32_t size);
+
+    void updateIOPortMap();
+    IODevice *getIODevice(uint16_t addr) const {return ioPageMap[addr / ioPageSize][addr % ioPageSize];}
+
+    void removeEvent(int index);
+    void siftEventUp(int index);
+    void siftEventDown(int index);
+    void updateNextEventCycle();
+
     // clocks
     static constexpr int systemClock = 14318180;
     static constexpr int cpuClkDiv = 3; // 4.7727MHz
     static constexpr int periphClkDiv = 6; // 2.38637MHz
     static constexpr int pitClkDiv = periphClkDiv * 2; // 1.19318MHz
 
-#ifndef USE_PORT_TIMER
     uint32_t cycleCount = 0;
+    bool virtualTime = false;
+
+#ifdef USE_HOST_CLOCK
+    std::chrono::steady_clock::time_point hostClockStart = std::chrono::steady_clock::now();
 #endif
 
-    uint32_t nextInterruptCycle = 0;
+    static const int maxEvents = 16;
+
+    Event events[maxEvents]; // binary heap, soonest first
+    int numEvents = 0;
+
+    uint32_t nextEventCycle = 0;
 
     static const int maxAddress = 1 << 24;
-    static const int blockSize = 128 * 1024;
+#if defined(PICO_BUILD) || defined(ESP_BUILD)
+    // the maps below are ~3K instead of ~48K, nothing maps smaller regions there
+    static const int pageSize = 64 * 1024;
+#else
+    static const int pageSize = 4096;
+#endif
+    static const int numMemPages = maxAddress / pageSize;
+    static const int a20PageBit = (1 << 20) / pageSize;
+
+    // host pointers for each page, offset by the page address (so ptr[addr] works)
+    // a null write pointer sends writes to the slow path (ROM/MMIO/A20 alias)
+    const uint8_t *memReadMap[numMemPages] = {};
+    uint8_t *memWriteMap[numMemPages] = {};
+
+    // real mappings of the pages with A20 set while they are replaced by aliases of the pages below
+    const uint8_t *a20ReadMap[numMemPages / 2] = {};
+    uint8_t *a20WriteMap[numMemPages / 2] = {};
+    bool a20Enabled = false; // matches the initial 8042 output port
 
-    uint8_t *memMap[maxAddress / blockSize];
+#ifdef CPU_BLOCK_CACHE_SIZE
+    static const int codePageSize = 4096;
+
+    uint32_t codePageMask[maxAddress / codePageSize / 32] = {};
+    uint32_t codePageGen[maxAddress / codePageSize] = {};
+#endif
 
     uint32_t memAccessCbBase, memAccessCbEnd;
     MemReadCallback memReadCb = nullptr;
@@ -301,5 +388,12 @@ private:
 
     std::vector<IORange> ioDevices;
 
+    // port -> device (or null), rebuilt from ioDevices when they change
+    // pages with the same devices are shared, most devices only decode 10 bits so the same few repeat
+    static const int ioPageSize = 256;
+
+    std::vector<IODevice *> ioPages;
+    IODevice **ioPageMap[0x10000 / ioPageSize];
+
     CPU cpu;
 };
\ No newline at end of file
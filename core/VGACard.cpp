@@ -12,7 +12,7 @@
 VGACard::VGACard(System &sys) : sys(sys)
 {
     // FIXME: some could also be at 3Bx
-    sys.addIODevice(0x3E0, 0x3C0, 0, this); // 3Cx/3Dx
+    sys.addIODevice(0x3E0, 0x3C0, this); // 3Cx/3Dx
 }
 
 void RAM_FUNC(VGACard::drawScanline)(int line, uint8_t *output)
@@ -503,6 +503,15 @@ uint8_t VGACard::read(uint16_t addr)
     }
 }
 
+int VGACard::getCyclesToPortChange(uint16_t addr, uint32_t cycleCount)
+{
+    // retrace status follows the display, which isn't tied to the CPU clock
+    if(addr == 0x3BA || addr == 0x3DA)
+        return 0;
+
+    return std::numeric_limits<int>::max();
+}
+
 void VGACard::write(uint16_t addr, uint8_t data)
 {
     switch(addr)
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -19,6 +20,10 @@ static bool quit = false;
 
 static SDL_AudioStream *audioStream;
 
+static SDL_Semaphore *cpuWakeSem; // signalled on input to wake the CPU thread from HLT
+
+static bool turbo = false; // virtual time, without waiting for the host clock to catch up
+
 static System sys;
 
 static ATAController ataPrimary(sys);
@@ -315,27 +320,18 @@ static ATScancode scancodeMap[SDL_SCANCODE_COUNT]
     ATScancode::WWWFavourites,
 };
 
-static Uint64 systemTimerCallback(void *userdata, SDL_TimerID timerID, Uint64 interval)
-{
-    // asking for a 838ns interval was a little optimistic...
-    auto now = SDL_GetTicksNS();
-    static Uint64 lastUpdate = now;
-
-    auto elapsed = (now - lastUpdate) / interval;
-    lastUpdate += elapsed * interval;
-
-    // this expects the old cpu clock (~4.77MHz), we're going for the PIT clock (~1.19MHz)
-    reinterpret_cast<System *>(userdata)->addCPUCycles(elapsed * 4);
-    return interval;
-}
-
 static void pollEvents()
 {
     const int escMod = SDL_KMOD_RCTRL | SDL_KMOD_RSHIFT;
 
+    bool hadInput = false;
+
     SDL_Event event;
     while(SDL_PollEvent(&event))
     {
+        if(event.type != SDL_EVENT_QUIT)
+            hadInput = true;
+
         switch(event.type)
         {
             case SDL_EVENT_KEY_DOWN:
@@ -414,6 +410,32 @@ static void pollEvents()
     }
 
     sys.getChipset().syncMouse();
+
+    if(hadInput)
+        SDL_SignalSemaphore(cpuWakeSem);
+}
+
+// sleep while the CPU is halted (or busy-waiting), until the next device event or some input
+static void waitForInterrupt()
+{
+    auto &cpu = sys.getCPU();
+    auto endCycle = cpu.isHalted() ? sys.getNextEventCycle() : cpu.getBusyWaitEndCycle();
+
+    sys.updateCycleCount();
+
+    // may have already passed if interrupts are disabled
+    auto cycles = endCycle - sys.getCycleCount();
+    if(static_cast<int32_t>(cycles) <= 0)
+        return;
+
+    // don't sleep too long, the speaker and RTC are updated from the loop
+    const Uint64 maxWait = 10 * SDL_NS_PER_MS;
+    auto ns = std::min(Uint64(cycles) * SDL_NS_PER_SECOND / System::getClockSpeed(), maxWait);
+
+    if(ns >= SDL_NS_PER_MS)
+        SDL_WaitSemaphoreTimeout(cpuWakeSem, ns / SDL_NS_PER_MS);
+    else
+        SDL_DelayNS(ns);
 }
 
 static int cpuThreadFunc(void *data)
@@ -424,19 +446,59 @@ static int cpuThreadFunc(void *data)
 
     auto lastTime = time(nullptr);
 
+    // with virtual time the CPU moves the clock, keep a 64-bit total of it
+    auto startTicks = SDL_GetTicksNS();
+    auto lastCycleCount = sys.getCycleCount();
+    uint64_t virtualCycles = 0;
+    uint64_t nextRTCCycle = System::getClockSpeed();
+
     while(!quit)
     {
+        // any input from here on hasn't been seen by this run, so it should still wake us up
+        // (but earlier wakeups shouldn't cut the next wait short)
+        while(SDL_TryWaitSemaphore(cpuWakeSem));
+
         cpu.run(1);
 
-        sys.getChipset().updateForDisplay(); // this just tries to make sure the PIT doesn't get too far behind
+        bool secondPassed;
 
-        // update RTC
-        auto newTime = time(nullptr);
-        if(newTime != lastTime)
+        if(sys.isVirtualTime())
         {
+            auto cycleCount = sys.getCycleCount();
+            virtualCycles += cycleCount - lastCycleCount;
+            lastCycleCount = cycleCount;
+
+            // wait for the host to catch up
+            if(!turbo)
+            {
+                const Uint64 clock = System::getClockSpeed();
+                auto emuNS = virtualCycles / clock * SDL_NS_PER_SECOND + virtualCycles % clock * SDL_NS_PER_SECOND / clock;
+                auto hostNS = SDL_GetTicksNS() - startTicks;
+
+                if(emuNS > hostNS)
+                    SDL_DelayNS(emuNS - hostNS);
+            }
+
+            secondPassed = virtualCycles >= nextRTCCycle;
+            if(secondPassed)
+                nextRTCCycle += System::getClockSpeed();
+        }
+        else
+        {
+            if(cpu.isHalted() || cpu.isBusyWaiting())
+                waitForInterrupt();
+
+            auto newTime = time(nullptr);
+            secondPassed = newTime != lastTime;
             lastTime = newTime;
-            sys.getChipset().updateRTC();
         }
+
+        sys.updateCycleCount();
+        sys.getChipset().updateForDisplay(); // this just tries to make sure the PIT doesn't get too far behind
+
+        // update RTC
+        if(secondPassed)
+            sys.getChipset().updateRTC();
     }
     return 0;
 }
@@ -460,6 +522,7 @@ int main(int argc, char *argv[])
     std::string biosPath = "bios.bin";
     std::string floppyPaths[FileFloppyIO::maxDrives];
     std::string ataPaths[FileATAIO::maxDrives];
+    auto cpuModel = CPU::Model::i386;
 
     int i = 1;
 
@@ -471,6 +534,19 @@ int main(int argc, char *argv[])
             screenScale = std::stoi(argv[++i]);
         else if(arg == "--bios" && i + 1 < argc)
             biosPath = argv[++i];
+        else if(arg == "--cpu" && i + 1 < argc)
+        {
+            std::string model(argv[++i]);
+            if(model == "486")
+                cpuModel = CPU::Model::i486;
+            else if(model == "386")
+                cpuModel = CPU::Model::i386;
+            else
+            {
+                std::cerr << "Unknown CPU model " << model << " (expected 386 or 486)\n";
+                return 1;
+            }
+        }
         else if(arg.compare(0, 8, "--floppy") == 0 && arg.length() == 9 && i + 1 < argc)
         {
             int n = arg[8] - '0';
@@ -494,6 +570,13 @@ int main(int argc, char *argv[])
             if(n >= 0 && n < FileATAIO::maxDrives)
                 ataPrimary.overrideSectorsPerTrack(n, std::stoi(argv[++i]));
         }
+        else if(arg == "--virtual-time")
+            sys.setVirtualTime(true);
+        else if(arg == "--turbo")
+        {
+            sys.setVirtualTime(true);
+            turbo = true;
+        }
         else
             break;
     }
@@ -506,9 +589,12 @@ int main(int argc, char *argv[])
   
     // emu init
     auto &cpu = sys.getCPU();
+    cpu.setModel(cpuModel);
     sys.addMemory(0, sizeof(ram), ram);
 
-    sys.getChipset().setSpeakerAudioCallback(speakerCallback);
+    // audio would pile up when running faster than real time
+    if(!turbo)
+        sys.getChipset().setSpeakerAudioCallback(speakerCallback);
 
     std::ifstream biosFile(basePath + biosPath, std::ios::binary);
 
@@ -623,8 +709,7 @@ int main(int argc, char *argv[])
 
     SDL_free(gamepads);
 
-    // timer
-    SDL_AddTimerNS(838, systemTimerCallback, &sys); // ~1.193MHz
+    cpuWakeSem = SDL_CreateSemaphore(0);
 
     auto cpuThread = SDL_CreateThread(cpuThreadFunc, "CPU", nullptr);
 
@@ -648,6 +733,10 @@ int main(int argc, char *argv[])
         SDL_RenderPresent(renderer);
     }
 
+    SDL_SignalSemaphore(cpuWakeSem);
+    SDL_WaitThread(cpuThread, nullptr);
+    SDL_DestroySemaphore(cpuWakeSem);
+
     SDL_DestroyAudioStream(audioStream);
 
     SDL_DestroyTexture(texture);